@@ -58,6 +58,7 @@
 #include <linux/io.h>	// virt_to_phys
 #include <linux/hrtimer.h>
 #include <linux/highmem.h> // kmap
+#include <linux/srcu.h>	// VALE forwarding path
 
 #define KASSERT(a, b)		BUG_ON(!(a))
 
@@ -129,6 +130,10 @@ struct net_device_ops {
 #define netdev_tx_t	int
 #endif
 
+#if !defined(NETIF_F_CSUM_MASK) && defined(NETIF_F_ALL_CSUM)
+#define NETIF_F_CSUM_MASK	NETIF_F_ALL_CSUM
+#endif
+
 #if !defined(NETMAP_LINUX_HAVE_USLEEP_RANGE) && !defined(usleep_range)
 #define usleep_range(a, b)	msleep((a)+(b)+999)
 #endif
@@ -384,9 +389,9 @@ static inline void mtx_unlock(safe_spinlock_t *m)
 #define mtx_unlock_spin(a)	mtx_unlock(a)
 
 /*
- * XXX these must be changed, as we cannot sleep within the RCU.
- * Must change to proper rwlock, and then can move the definitions
- * into the main netmap.c file.
+ * The bridge lock only serializes the control path. The forwarding
+ * path runs in a SRCU read section, since it may sleep (e.g. in
+ * copyin() for indirect buffers).
  */
 #define BDG_RWLOCK_T		struct rw_semaphore
 #define BDG_RWINIT(b)		init_rwsem(&(b)->bdg_lock)
@@ -396,8 +401,16 @@ static inline void mtx_unlock(safe_spinlock_t *m)
 #define BDG_RLOCK(b)		down_read(&(b)->bdg_lock)
 #define BDG_RUNLOCK(b)		up_read(&(b)->bdg_lock)
 #define BDG_RTRYLOCK(b)		down_read_trylock(&(b)->bdg_lock)
-#define BDG_SET_VAR(lval, p)	((lval) = (p))
-#define BDG_GET_VAR(lval)	(lval)
+#define BDG_SET_VAR(lval, p)	WRITE_ONCE(lval, p)
+#define BDG_GET_VAR(lval)	READ_ONCE(lval)
+
+extern struct srcu_struct netmap_bdg_srcu;
+#define BDG_EPOCH_T		int
+#define BDG_EPOCH_INIT()	0
+#define BDG_EPOCH_FINI()	do {} while (0)
+#define BDG_EPOCH_ENTER(b, et)	((et) = srcu_read_lock(&netmap_bdg_srcu))
+#define BDG_EPOCH_EXIT(b, et)	srcu_read_unlock(&netmap_bdg_srcu, (et))
+#define BDG_EPOCH_WAIT(b)	synchronize_srcu(&netmap_bdg_srcu)
 
 #ifndef ilog2 /* not in 2.6.18 */
 static inline int ilog2(uint64_t n)
@@ -413,15 +426,31 @@ static inline int ilog2(uint64_t n)
 /* XXX do we need GFP_DMA for slots ?
  * Documentation/DMA-API.txt */
 
-#define contigmalloc(sz, ty, flags, a, b, pgsz, c) ({		\
+/* contigmalloc_node() prefers pages on NUMA node 'node' (-1 means any)
+ * and falls back to other nodes if that one is exhausted.
+ * Nodes that do not exist or are offline have no NODE_DATA(), so they
+ * are treated as -1. Buddy allocations are naturally aligned to their
+ * size, which covers any 'align' up to the rounded size. */
+#define contigmalloc_node(sz, ty, flags, node, align) ({	\
 	unsigned int order_ =					\
 		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
-	struct page *p_ = alloc_pages(GFP_ATOMIC | __GFP_ZERO,  \
-		order_);					\
+	int node_ = (node);					\
+	struct page *p_;					\
+	if (node_ < 0 || node_ >= nr_node_ids ||		\
+	    !node_online(node_))				\
+		node_ = NUMA_NO_NODE;				\
+	p_ = alloc_pages_node(node_,				\
+		GFP_ATOMIC | __GFP_ZERO, order_);		\
 	if (p_ != NULL) 					\
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
 
+/* NUMA node of memory returned by contigmalloc_node() */
+#define contig_node(va)		page_to_nid(virt_to_page(va))
+
+#define contigmalloc(sz, ty, flags, a, b, pgsz, c)		\
+	contigmalloc_node(sz, ty, flags, NUMA_NO_NODE, pgsz)
+
 #define contigfree(va, sz, ty)					\
 	do {							\
 		unsigned int npages_ =				\
@@ -480,6 +509,7 @@ struct nm_linux_selrecord_t;
  */
 #define CTLFLAG_RD              1
 #define CTLFLAG_RW              2
+#define CTLFLAG_RDTUN           CTLFLAG_RD	/* module parameter */
 
 struct sysctl_oid;
 struct sysctl_req;
@@ -344,6 +344,16 @@ int nm_iommu_group_id(struct device *dev)
 }
 #endif /* HAVE_IOMMU */
 
+/* #################### NUMA ################## */
+/*
+ * Returns the NUMA node that the device is attached to, or -1
+ * if unknown (or if the kernel has no NUMA support).
+ */
+int nm_numa_node(struct device *dev)
+{
+	return dev ? dev_to_node(dev) : NUMA_NO_NODE;
+}
+
 /* #################### VALE OFFLOADINGS SUPPORT ################## */
 
 /* Compute and return a raw checksum over (data, len), using 'cur_sum'
@@ -932,8 +942,67 @@ nm_os_catch_tx(struct netmap_generic_adapter *gna, int intercept)
 /* Used to cover cases where ETH_P_802_3_MIN is undefined */
 #define NM_ETH_P_802_3_MIN 0x0600
 
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+/*
+ * Pass the mbufs queued by nm_os_generic_xmit_frame() straight to the
+ * driver, like pktgen does, telling it that more packets are coming
+ * for all of them but the last one. Returns the number of mbufs not
+ * sent, which are those at the end of the queue.
+ */
+static u_int
+nm_os_generic_xmit_batch(struct nm_os_gen_arg *a)
+{
+	struct ifnet *ifp = a->ifp;
+	struct mbuf *m = a->head, *next;
+	struct netdev_queue *txq;
+	u_int unsent = a->count;
+	netdev_tx_t ret;
+
+	a->head = a->tail = NULL;
+	a->count = 0;
+	txq = netdev_get_tx_queue(ifp, a->ring_nr % ifp->real_num_tx_queues);
+
+	local_bh_disable();
+	HARD_TX_LOCK(ifp, txq, smp_processor_id());
+	for (; m != NULL; m = next) {
+		if (unlikely(netif_xmit_frozen_or_drv_stopped(txq)))
+			break;
+		next = m->next;
+		m->next = NULL;
+		ret = netdev_start_xmit(m, ifp, txq, next != NULL);
+		if (unlikely(!dev_xmit_complete(ret))) {
+			/* not consumed by the driver */
+			m->next = next;
+			break;
+		}
+		unsent--;
+	}
+	HARD_TX_UNLOCK(ifp, txq);
+	local_bh_enable();
+
+	/* Give the mbufs not sent back to the pool, dropping the
+	 * reference taken by nm_os_generic_xmit_frame(). */
+	for (; m != NULL; m = next) {
+		next = m->next;
+		m->next = NULL;
+		m->priority = 0;
+#ifdef NETMAP_LINUX_HAVE_REFCOUNT_T
+		refcount_dec(&m->users);
+#else  /* !NETMAP_LINUX_HAVE_REFCOUNT_T */
+		atomic_dec(&m->users);
+#endif /* !NETMAP_LINUX_HAVE_REFCOUNT_T */
+	}
+	if (unlikely(unsent))
+		nm_prlim(3, "%s: %u packets not sent", ifp->name, unsent);
+
+	return unsent;
+}
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+
 /* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
-   and -1 on error (which may be packet drops or other errors). */
+   and -1 on error (which may be packet drops or other errors).
+   With a->batch, the mbuf is only queued, and the call with a->addr
+   set to NULL sends the queue. */
 int
 nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 {
@@ -943,6 +1012,11 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	netdev_tx_t ret;
 	uint16_t ethertype;
 
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+	if (a->addr == NULL)
+		return a->head ? nm_os_generic_xmit_batch(a) : 0;
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+
 	/* We know that the driver needs to prepend ifp->needed_headroom bytes
 	 * to each packet to be transmitted. We then reset the mbuf pointers
 	 * to the correct initial state:
@@ -998,8 +1072,11 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	m->dev = ifp;
 	skb_shinfo(m)->destructor_arg = m->dev;
 
-	/* Tell the NIC to compute checksums for outgoing TCP and UDP packets */
-	if (netmap_generic_hwcsum) {
+	/* Tell the NIC to compute checksums for outgoing TCP and UDP packets.
+	 * Batches skip validate_xmit_skb(), so the NIC must be able to
+	 * do it. */
+	if (netmap_generic_hwcsum &&
+	    (!a->batch || (ifp->features & NETIF_F_CSUM_MASK))) {
 		uint8_t transport_proto = IPPROTO_IP;
 
 		if (m->protocol == htons(ETH_P_IPV6)) {
@@ -1028,6 +1105,18 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 		m->next = NULL;
 	}
 
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+	if (a->batch) {
+		if (a->tail)
+			((struct mbuf *)a->tail)->next = m;
+		else
+			a->head = m;
+		a->tail = m;
+		a->count++;
+		return 0;
+	}
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+
 	ret = dev_queue_xmit(m);
 
 	if (unlikely(ret != NET_XMIT_SUCCESS)) {
@@ -1058,6 +1147,11 @@ nm_os_generic_set_features(struct netmap_generic_adapter *gna)
 {
 	gna->rxsg = 1; /* Supported through skb_copy_bits(). */
 	gna->txqdisc = netmap_generic_txqdisc;
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+	/* batches bypass the qdisc, see nm_os_generic_xmit_batch() */
+	if (!gna->txqdisc && netmap_generic_txbatch > 1)
+		gna->txbatch = netmap_generic_txbatch;
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
 }
 #endif /* WITH_GENERIC */
 
@@ -1245,6 +1339,98 @@ static struct vm_operations_struct linux_netmap_mmap_ops = {
 	.fault = linux_netmap_fault,
 };
 
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+#include <linux/pfn_t.h>
+
+#ifdef NETMAP_LINUX_HAVE_MM_GET_UNMAPPED_AREA
+#define nm_get_unmapped_area(f, a, l, p, fl)	\
+	mm_get_unmapped_area(current->mm, f, a, l, p, fl)
+#else
+#define nm_get_unmapped_area(f, a, l, p, fl)	\
+	current->mm->get_unmapped_area(f, a, l, p, fl)
+#endif /* MM_GET_UNMAPPED_AREA */
+
+/*
+ * When the buffer pool is made of PMD-sized clusters
+ * (dev.netmap.buf_hugepages) the mapping is VM_PFNMAP and every
+ * cluster is mapped with a single PMD. Pages are not refcounted by
+ * the mapping, which is fine since the vma keeps the file (hence
+ * the registration, hence the allocator) alive.
+ */
+static vm_fault_t
+linux_netmap_pfn_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	unsigned long addr = vmf->address & PAGE_MASK;
+	vm_paddr_t pa;
+
+	pa = netmap_mem_ofstophys(priv->np_na->nm_mem,
+		(vma->vm_pgoff << PAGE_SHIFT) + (addr - vma->vm_start));
+	if (pa == 0)
+		return VM_FAULT_SIGBUS;
+	return vmf_insert_pfn(vma, addr, pa >> PAGE_SHIFT);
+}
+
+static vm_fault_t
+linux_netmap_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_mem_d *nmd = priv->np_na->nm_mem;
+	unsigned long addr = vmf->address & PMD_MASK;
+	uint64_t off, hofs, hlen;
+	u_int hsz;
+	vm_paddr_t pa;
+
+	if (order != PMD_ORDER || addr < vma->vm_start ||
+	    addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	off = (vma->vm_pgoff << PAGE_SHIFT) + (addr - vma->vm_start);
+	/* only whole clusters can go in a PMD */
+	if (netmap_mem_get_hugepages(nmd, &hofs, &hlen, &hsz) ||
+	    hsz != PMD_SIZE || off < hofs || off + PMD_SIZE > hofs + hlen ||
+	    ((off - hofs) & (PMD_SIZE - 1)))
+		return VM_FAULT_FALLBACK;
+	pa = netmap_mem_ofstophys(nmd, off);
+	if (pa == 0)
+		return VM_FAULT_SIGBUS;
+	return vmf_insert_pfn_pmd(vmf, phys_to_pfn_t(pa, PFN_DEV),
+			vmf->flags & FAULT_FLAG_WRITE);
+}
+
+static struct vm_operations_struct linux_netmap_huge_mmap_ops = {
+	.fault = linux_netmap_pfn_fault,
+	.huge_fault = linux_netmap_huge_fault,
+};
+
+/*
+ * Place the mapping so that the hugepage clusters start on a PMD
+ * boundary in the user address space, or they could never be
+ * mapped by a single PMD.
+ */
+static unsigned long
+linux_netmap_get_unmapped_area(struct file *f, unsigned long addr,
+		unsigned long len, unsigned long pgoff, unsigned long flags)
+{
+	struct netmap_priv_d *priv = f->private_data;
+	uint64_t hofs, hlen;
+	unsigned long ret;
+	u_int hsz;
+
+	if (addr || (flags & MAP_FIXED) || priv->np_nifp == NULL ||
+	    netmap_mem_get_hugepages(priv->np_na->nm_mem,
+		    &hofs, &hlen, &hsz) || hsz != PMD_SIZE)
+		return nm_get_unmapped_area(f, addr, len, pgoff, flags);
+
+	ret = nm_get_unmapped_area(f, 0, len + PMD_SIZE, pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return ret;
+	/* the pool starts at ret + hofs - (pgoff << PAGE_SHIFT) */
+	return ret + (((pgoff << PAGE_SHIFT) - hofs - ret) & (PMD_SIZE - 1));
+}
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
+
 static int
 linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 {
@@ -1254,6 +1440,10 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 	uint64_t memsize;
 	struct netmap_priv_d *priv = f->private_data;
 	struct netmap_adapter *na = priv->np_na;
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+	uint64_t hofs, hlen;
+	u_int hsz;
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
 	/*
 	 * vma->vm_start: start of mapping user address space
 	 * vma->vm_end: end of the mapping user address space
@@ -1294,6 +1484,16 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 		 */
 		vma->vm_private_data = priv;
 		vma->vm_ops = &linux_netmap_mmap_ops;
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+		/* PFNMAP cannot be used on private (COW) mappings */
+		if ((vma->vm_flags & VM_SHARED) &&
+		    netmap_mem_get_hugepages(na->nm_mem,
+			    &hofs, &hlen, &hsz) == 0) {
+			vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND |
+					VM_DONTDUMP | VM_HUGEPAGE);
+			vma->vm_ops = &linux_netmap_huge_mmap_ops;
+		}
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
 	}
 	return 0;
 }
@@ -1460,6 +1660,9 @@ static struct file_operations netmap_fops = {
 	.owner = THIS_MODULE,
 	.open = linux_netmap_open,
 	.mmap = linux_netmap_mmap,
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+	.get_unmapped_area = linux_netmap_get_unmapped_area,
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
 	LIN_IOCTL_NAME = linux_netmap_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = linux_netmap_compat_ioctl,
@@ -1547,7 +1750,7 @@ netmap_pernet_init(struct net *net)
 		return error;
 
 	ns->net = net;
-	ns->num_bridges = NM_BRIDGES;
+	ns->num_bridges = netmap_bdg_num_bridges();
 	ns->bridges = netmap_init_bridges2(ns->num_bridges);
 	if (ns->bridges == NULL) {
 		nm_bns_destroy(net, ns);
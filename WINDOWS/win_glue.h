@@ -136,6 +136,7 @@ typedef ULONG 			vm_ooffset_t;
 #define destroy_dev(a)
 #define __user
 #define nm_iommu_group_id(dev)	0
+#define nm_numa_node(dev)	(-1)
 
 
 /*
@@ -203,6 +204,13 @@ static inline void mtx_unlock(win_spinlock_t *m)
 #define BDG_RTRYLOCK(b)			ExAcquireResourceExclusiveLite(&b->bdg_lock, FALSE)
 #define BDG_SET_VAR(lval, p)		((lval) = (p))
 #define BDG_GET_VAR(lval)		(lval)
+/* no epochs, the forwarding path takes the bridge lock */
+#define BDG_EPOCH_T			int
+#define BDG_EPOCH_INIT()		0
+#define BDG_EPOCH_FINI()		do {} while (0)
+#define BDG_EPOCH_ENTER(b, et)		((et) = 0, BDG_RLOCK(b))
+#define BDG_EPOCH_EXIT(b, et)		BDG_RUNLOCK(b)
+#define BDG_EPOCH_WAIT(b)		do { BDG_WLOCK(b); BDG_WUNLOCK(b); } while (0)
 
 
 /*
@@ -407,6 +415,9 @@ win_contigmalloc(int sz, int page_size)
  */
 #define contigmalloc(sz, ty, flags, a, b, pgsz, c)	\
 					win_contigmalloc(sz, M_NETMAP)
+#define contigmalloc_node(sz, ty, flags, node, align)	\
+					win_contigmalloc(sz, M_NETMAP)
+#define contig_node(va)			(-1)
 #define contigfree(va, sz, ty)		ExFreePoolWithTag(va, M_NETMAP)
 
 #define vtophys				MmGetPhysicalAddress
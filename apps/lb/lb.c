@@ -23,6 +23,7 @@
  * SUCH DAMAGE.
  */
 /* $FreeBSD$ */
+#define _GNU_SOURCE	/* for CPU_SET() */
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -37,6 +38,15 @@
 #include <netinet/in.h>		/* htonl */
 
 #include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>	/* pthread w/ affinity */
+#include <sys/cpuset.h>	/* cpu_set */
+#else
+#define cpuset_t	cpu_set_t
+#endif
+#include <unistd.h>	/* sysconf */
+#include <errno.h>
+#include <time.h>
 
 #include "pkt_hash.h"
 #include "ctrs.h"
@@ -87,6 +97,9 @@ struct compact_ipv6_hdr {
 #define DEF_WAIT_LINK	2
 #define DEF_STATS_INT	600
 #define BUF_REVOKE	100
+#define HASH_BATCH	32	/* packets hashed in one go */
+#define DEF_DEAD_TIMEOUT 5
+#define MAGLEV_EMPTY	0xffff
 #define STAT_MSG_MAXSIZE 1024
 
 struct {
@@ -101,6 +114,15 @@ struct {
 	int syslog_interval;
 	int wait_link;
 	bool busy_wait;
+	bool per_ring;		/* one worker per input ring */
+	int first_cpu;		/* -1: do not pin the workers */
+	int num_workers;
+	bool consistent;	/* Maglev hashing in all groups */
+	int dead_timeout;	/* seconds before a stuck pipe is skipped */
+	int revoke;		/* what to do when the free queue is empty */
+#define REVOKE_OLDEST	0	/* oldest buffers of the longest queue */
+#define REVOKE_GROUP	1	/* same, in the group using most buffers */
+#define REVOKE_TAIL	2	/* drop the new packet */
 } glob_arg;
 
 /*
@@ -115,8 +137,6 @@ struct overflow_queue {
 	uint32_t size;
 };
 
-struct overflow_queue *freeq;
-
 static inline int
 oq_full(struct overflow_queue *q)
 {
@@ -158,14 +178,44 @@ oq_deq(struct overflow_queue *q)
 	return s;
 }
 
-static volatile int do_abort = 0;
+/* move the n oldest slots of q to the tail of dst,
+ * return their total length
+ */
+static inline uint64_t
+oq_move(struct overflow_queue *dst, struct overflow_queue *q, uint32_t n)
+{
+	uint64_t bytes = 0;
 
-uint64_t dropped = 0;
-uint64_t forwarded = 0;
-uint64_t received_bytes = 0;
-uint64_t received_pkts = 0;
-uint64_t non_ip = 0;
-uint32_t freeq_n = 0;
+	if (unlikely(n > q->n || n > dst->size - dst->n)) {
+		D("%s -> %s: cannot move %u slots", q->name, dst->name, n);
+		abort();
+	}
+	while (n) {
+		uint32_t k = n, i;
+
+		/* contiguous chunks on both sides */
+		if (k > q->size - q->head)
+			k = q->size - q->head;
+		if (k > dst->size - dst->tail)
+			k = dst->size - dst->tail;
+		memcpy(&dst->slots[dst->tail], &q->slots[q->head],
+			k * sizeof(struct netmap_slot));
+		for (i = 0; i < k; i++)
+			bytes += q->slots[q->head + i].len;
+		q->head += k;
+		if (q->head >= q->size)
+			q->head = 0;
+		q->n -= k;
+		dst->tail += k;
+		if (dst->tail >= dst->size)
+			dst->tail = 0;
+		dst->n += k;
+		n -= k;
+	}
+	return bytes;
+}
+
+static volatile int do_abort = 0;
 
 struct port_des {
 	char interface[MAX_PORTNAMELEN];
@@ -176,10 +226,16 @@ struct port_des {
 	struct nm_desc *nmd;
 	struct netmap_ring *ring;
 	struct group_des *group;
+	/* a pipe whose ring stays full is considered dead */
+	uint32_t stall_tail;
+	time_t stall_since;
+	int dead;
+	/* position in the length index of the group (see oq_index_update()) */
+	struct port_des *oq_prev, *oq_next;
+	int oq_bucket;
+	uint32_t oq_last_n;
 };
 
-struct port_des *ports;
-
 /* each group of pipes receives all the packets */
 struct group_des {
 	char pipename[MAX_IFNAMELEN];
@@ -188,8 +244,23 @@ struct group_des {
 	int nports;
 	int last;
 	int custom_port;
+	/*
+	 * Consistent hashing: the packets go to the pipe found in
+	 * table[hash % table_size], filled with the Maglev algorithm so
+	 * that each pipe gets a share of the entries proportional to
+	 * its weight, and losing a pipe only moves its own flows.
+	 */
+	uint16_t *weights;	/* NULL: all weights are 1 */
+	uint16_t *table;	/* NULL: use hash % nports */
+	uint32_t table_size;
+	uint32_t *next;		/* scratch space for maglev_populate() */
+	/* overflow queues indexed by length */
+	uint64_t oq_bitmap;
+	struct port_des *oq_buckets[33];
+	uint32_t oq_n;		/* buffers in all the overflow queues */
 };
 
+/* the groups as given on the command line, each worker has a copy */
 struct group_des *groups;
 
 /* statistcs */
@@ -205,19 +276,55 @@ struct counters {
 #define COUNTERS_FULL	1
 };
 
-struct counters counters_buf;
+/*
+ * A worker serves one input port (or one ring of it, see -t) and owns
+ * a private copy of all the pipe groups, with their overflow queues and
+ * free queue, so that workers never share data on the packet path.
+ * The counters are only written by the worker, which hands a snapshot
+ * to the stats thread through counters_buf.
+ */
+struct worker {
+	int id;
+	int cpu;
+	pthread_t tid;
+	struct port_des *ports;		/* output pipes, then the input port */
+	struct port_des *rxport;
+	struct group_des *groups;
+	struct overflow_queue *oq;	/* output pipes, then the free queue */
+	struct overflow_queue *freeq;
+
+	uint64_t dropped;
+	uint64_t forwarded;
+	uint64_t received_bytes;
+	uint64_t received_pkts;
+	uint64_t non_ip;
+
+	struct counters counters_buf;
+} __attribute__((aligned(64)));
+
+struct worker *workers;
 
 static void *
 print_stats(void *arg)
 {
 	int npipes = glob_arg.output_rings;
+	int nworkers = glob_arg.num_workers;
 	int sys_int = 0;
 	(void)arg;
 	struct my_ctrs cur, prev;
-	struct my_ctrs *pipe_prev;
-
-	pipe_prev = calloc(npipes, sizeof(struct my_ctrs));
-	if (pipe_prev == NULL) {
+	struct my_ctrs *pipe_prev, *pipe_last;
+	uint64_t *non_ip_last, *received_last;
+	uint32_t *freeq_last;
+	int w;
+
+	/* the last snapshot seen from each worker */
+	pipe_prev = calloc(npipes * nworkers, sizeof(struct my_ctrs));
+	pipe_last = calloc(npipes * nworkers, sizeof(struct my_ctrs));
+	non_ip_last = calloc(nworkers, sizeof(uint64_t));
+	received_last = calloc(nworkers, sizeof(uint64_t));
+	freeq_last = calloc(nworkers, sizeof(uint32_t));
+	if (pipe_prev == NULL || pipe_last == NULL || non_ip_last == NULL ||
+	    received_last == NULL || freeq_last == NULL) {
 		D("out of memory");
 		exit(1);
 	}
@@ -228,20 +335,33 @@ print_stats(void *arg)
 	while (!do_abort) {
 		int j, dosyslog = 0, dostdout = 0, newdata;
 		uint64_t pps = 0, dps = 0, bps = 0, dbps = 0, usec = 0;
+		uint64_t received_pkts = 0, non_ip = 0;
+		uint32_t freeq_n = 0;
 		struct my_ctrs x;
 
-		counters_buf.status = COUNTERS_EMPTY;
+		for (w = 0; w < nworkers; w++)
+			workers[w].counters_buf.status = COUNTERS_EMPTY;
 		newdata = 0;
 		memset(&cur, 0, sizeof(cur));
 		sleep(1);
-		if (counters_buf.status == COUNTERS_FULL) {
+		for (w = 0; w < nworkers; w++) {
+			struct counters *cb = &workers[w].counters_buf;
+
+			if (cb->status != COUNTERS_FULL)
+				continue;
 			__sync_synchronize();
 			newdata = 1;
-			cur.t = counters_buf.ts;
-			if (prev.t.tv_sec || prev.t.tv_usec) {
-				usec = (cur.t.tv_sec - prev.t.tv_sec) * 1000000 +
-					cur.t.tv_usec - prev.t.tv_usec;
-			}
+			if (timercmp(&cb->ts, &cur.t, >))
+				cur.t = cb->ts;
+			memcpy(pipe_last + w * npipes, cb->ctrs,
+				npipes * sizeof(struct my_ctrs));
+			received_last[w] = cb->received_pkts;
+			non_ip_last[w] = cb->non_ip;
+			freeq_last[w] = cb->freeq_n;
+		}
+		if (newdata && (prev.t.tv_sec || prev.t.tv_usec)) {
+			usec = (cur.t.tv_sec - prev.t.tv_sec) * 1000000 +
+				cur.t.tv_usec - prev.t.tv_usec;
 		}
 
 		++sys_int;
@@ -250,8 +370,8 @@ print_stats(void *arg)
 		if (glob_arg.syslog_interval && sys_int % glob_arg.syslog_interval == 0)
 				dosyslog = 1;
 
-		for (j = 0; j < npipes; ++j) {
-			struct my_ctrs *c = &counters_buf.ctrs[j];
+		for (j = 0; j < npipes * nworkers; ++j) {
+			struct my_ctrs *c = &pipe_last[j];
 			cur.pkts += c->pkts;
 			cur.drop += c->drop;
 			cur.drop_bytes += c->drop_bytes;
@@ -283,7 +403,7 @@ print_stats(void *arg)
 				       "\"packet_drop_rate_kpps\":%.4f,"
 				       "\"overflow_queue_size\":%" PRIu32
 				       "}", cur.t.tv_sec + (cur.t.tv_usec / 1000000.0),
-				            ports[j].interface,
+				            workers[j / npipes].ports[j % npipes].interface,
 				            j,
 				            c->pkts,
 				            c->drop,
@@ -298,6 +418,11 @@ print_stats(void *arg)
 			if (dostdout && stat_msg[0])
 				printf("%s\n", stat_msg);
 		}
+		for (w = 0; w < nworkers; w++) {
+			received_pkts += received_last[w];
+			non_ip += non_ip_last[w];
+			freeq_n += freeq_last[w];
+		}
 		if (usec) {
 			x.pkts = cur.pkts - prev.pkts;
 			x.drop = cur.drop - prev.drop;
@@ -329,22 +454,27 @@ print_stats(void *arg)
 			              received_pkts,
 			              cur.pkts,
 			              cur.drop,
-			              counters_buf.non_ip,
+			              non_ip,
 			              (double)bps / 1024 / 1024,
 			              (double)dbps / 1024 / 1024,
 			              (double)pps / 1000,
 			              (double)dps / 1000,
-			              counters_buf.freeq_n);
+			              freeq_n);
 
 		if (dosyslog && stat_msg[0])
 			syslog(LOG_INFO, "%s", stat_msg);
 		if (dostdout && stat_msg[0])
 			printf("%s\n", stat_msg);
 
-		prev = cur;
+		if (newdata)
+			prev = cur;
 	}
 
 	free(pipe_prev);
+	free(pipe_last);
+	free(non_ip_last);
+	free(received_last);
+	free(freeq_last);
 
 	return NULL;
 }
@@ -352,31 +482,40 @@ print_stats(void *arg)
 static void
 free_buffers(void)
 {
-	int i, tot = 0;
-	struct port_des *rxport = &ports[glob_arg.output_rings];
+	int i, w, tot = 0;
 
-	/* build a netmap free list with the buffers in all the overflow queues */
-	for (i = 0; i < glob_arg.output_rings + 1; i++) {
-		struct port_des *cp = &ports[i];
-		struct overflow_queue *q = cp->oq;
+	/* the input port of worker 0 owns the mmap, close it last */
+	for (w = glob_arg.num_workers - 1; w >= 0; w--) {
+		struct worker *wk = &workers[w];
+		struct port_des *rxport = wk->rxport;
 
-		if (!q)
+		if (rxport == NULL || rxport->nmd == NULL)
 			continue;
+		/* build a netmap free list with the buffers in all the
+		 * overflow queues */
+		for (i = 0; i < glob_arg.output_rings + 1; i++) {
+			struct port_des *cp = &wk->ports[i];
+			struct overflow_queue *q = cp->oq;
+
+			if (!q)
+				continue;
 
-		while (q->n) {
-			struct netmap_slot s = oq_deq(q);
-			uint32_t *b = (uint32_t *)NETMAP_BUF(cp->ring, s.buf_idx);
+			while (q->n) {
+				struct netmap_slot s = oq_deq(q);
+				uint32_t *b = (uint32_t *)NETMAP_BUF(rxport->ring, s.buf_idx);
 
-			*b = rxport->nmd->nifp->ni_bufs_head;
-			rxport->nmd->nifp->ni_bufs_head = s.buf_idx;
-			tot++;
+				*b = rxport->nmd->nifp->ni_bufs_head;
+				rxport->nmd->nifp->ni_bufs_head = s.buf_idx;
+				tot++;
+			}
 		}
-	}
-	D("added %d buffers to netmap free list", tot);
 
-	for (i = 0; i < glob_arg.output_rings + 1; ++i) {
-		nm_close(ports[i].nmd);
+		for (i = 0; i < glob_arg.output_rings + 1; ++i) {
+			if (wk->ports[i].nmd)
+				nm_close(wk->ports[i].nmd);
+		}
 	}
+	D("added %d buffers to netmap free list", tot);
 }
 
 
@@ -393,9 +532,14 @@ void usage()
 	printf("where options are:\n");
 	printf("  -h              	view help text\n");
 	printf("  -i iface        	interface name (required)\n");
-	printf("  -p [prefix:]npipes	add a new group of output pipes\n");
-	printf("  -B nbufs        	number of extra buffers (default: %d)\n", DEF_EXTRA_BUFS);
+	printf("  -p [prefix:]npipes[@w,...]	add a new group of output pipes, with weights\n");
+	printf("  -B nbufs        	number of extra buffers per worker (default: %d)\n", DEF_EXTRA_BUFS);
 	printf("  -b batch        	batch size (default: %d)\n", DEF_BATCH);
+	printf("  -t                    one worker thread per input ring\n");
+	printf("  -a cpu                pin worker i to core cpu+i (default: 0 with -t)\n");
+	printf("  -c                    use consistent hashing in all groups\n");
+	printf("  -D seconds            skip pipes stuck for this long, 0 never (default: %d)\n", DEF_DEAD_TIMEOUT);
+	printf("  -R policy             when out of extra buffers: oldest, group or tail (default: oldest)\n");
 	printf("  -w seconds        	wait for link up (default: %d)\n", DEF_WAIT_LINK);
 	printf("  -W                    enable busy waiting. this will run your CPU at 100%%\n");
 	printf("  -s seconds      	seconds between syslog stats messages (default: 0)\n");
@@ -447,11 +591,35 @@ parse_pipes(char *spec)
 		g->nports = DEF_OUT_PIPES;
 	} else {
 		g->nports = atoi(end);
-		if (g->nports < 1) {
+		if (g->nports < 1 || g->nports >= MAGLEV_EMPTY) {
 			D("invalid number of pipes '%s' (must be at least 1)", end);
 			return 1;
 		}
 	}
+	end = index(end, '@');
+	if (end != NULL) {
+		/* per-pipe weights, missing ones are 1 */
+		int i;
+
+		g->weights = calloc(g->nports, sizeof(*g->weights));
+		if (g->weights == NULL) {
+			D("out of memory");
+			return 1;
+		}
+		for (i = 0; i < g->nports; i++)
+			g->weights[i] = 1;
+		for (i = 0; end != NULL; i++) {
+			int wt = atoi(end + 1);
+
+			if (i >= g->nports || wt < 1 || wt > 100) {
+				D("invalid weights '%s' (at most %d, between 1 and 100)",
+					spec, g->nports);
+				return 1;
+			}
+			g->weights[i] = wt;
+			end = index(end + 1, ',');
+		}
+	}
 	glob_arg.output_rings += g->nports;
 	glob_arg.num_groups++;
 	return 0;
@@ -460,14 +628,10 @@ parse_pipes(char *spec)
 /* complete the initialization of the groups data structure */
 void init_groups(void)
 {
-	int i, j, t = 0;
+	int i, j;
 	struct group_des *g = NULL;
 	for (i = 0; i < glob_arg.num_groups; i++) {
 		g = &groups[i];
-		g->ports = &ports[t];
-		for (j = 0; j < g->nports; j++)
-			g->ports[j].group = g;
-		t += g->nports;
 		if (!g->custom_port)
 			strcpy(g->pipename, glob_arg.base_name);
 		for (j = 0; j < i; j++) {
@@ -479,18 +643,232 @@ void init_groups(void)
 	g->last = 1;
 }
 
+static uint32_t
+pipe_hash(const char *name, uint32_t k, uint32_t seed)
+{
+	uint32_t h = 2166136261U ^ seed; /* FNV-1a */
+	int i;
+
+	for (; *name; name++) {
+		h ^= (uint8_t)*name;
+		h *= 16777619;
+	}
+	for (i = 0; i < 4; i++) {
+		h ^= (k >> (8 * i)) & 0xff;
+		h *= 16777619;
+	}
+	return h;
+}
+
+/*
+ * (Re)build the lookup table of group g, leaving out the dead pipes
+ * (unless all of them are dead).
+ * Each pipe owns a permutation of the table entries, which only
+ * depends on the group name and on the position of the pipe in the
+ * group. In turn, the pipes claim the next free entry of their own
+ * permutation, as many times per round as their weight. When a pipe
+ * is left out, its entries go to the others and all the other
+ * entries stay where they were.
+ */
+static void
+maglev_populate(struct group_des *g)
+{
+	uint32_t M = g->table_size, filled = 0;
+	int i, alive = 0;
+
+	for (i = 0; i < g->nports; i++)
+		alive += !g->ports[i].dead;
+	memset(g->table, 0xff, M * sizeof(*g->table));
+	memset(g->next, 0, g->nports * sizeof(*g->next));
+	for (;;) {
+		for (i = 0; i < g->nports; i++) {
+			uint32_t offset = pipe_hash(g->pipename, i, 0) % M;
+			uint32_t skip = pipe_hash(g->pipename, i, 1) % (M - 1) + 1;
+			int t, wt = g->weights ? g->weights[i] : 1;
+
+			if (alive && g->ports[i].dead)
+				continue;
+			for (t = 0; t < wt; t++) {
+				uint32_t c;
+
+				do {
+					c = (offset + (uint64_t)g->next[i]++ * skip) % M;
+				} while (g->table[c] != MAGLEV_EMPTY);
+				g->table[c] = i;
+				if (++filled == M)
+					return;
+			}
+		}
+	}
+}
+
+/* give worker w its own copy of the groups, using its own ports */
+static int
+init_worker_groups(struct worker *w)
+{
+	/* primes, we use the first one with ~100 entries per unit of weight */
+	static const uint32_t sizes[] = { 251, 509, 1021, 2039, 4093, 8191,
+		16381, 32749, 65521 };
+	int i, j, t = 0;
+
+	w->groups = calloc(glob_arg.num_groups, sizeof(struct group_des));
+	if (w->groups == NULL)
+		return 1;
+	memcpy(w->groups, groups, glob_arg.num_groups * sizeof(struct group_des));
+	for (i = 0; i < glob_arg.num_groups; i++) {
+		struct group_des *g = &w->groups[i];
+		uint32_t tot = 0, k;
+
+		g->ports = &w->ports[t];
+		for (j = 0; j < g->nports; j++) {
+			g->ports[j].group = g;
+			tot += g->weights ? g->weights[j] : 1;
+		}
+		t += g->nports;
+
+		if (!glob_arg.consistent && g->weights == NULL)
+			continue;
+		for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]) - 1 &&
+				sizes[k] < 100 * tot; k++)
+			;
+		g->table_size = sizes[k];
+		g->table = calloc(g->table_size, sizeof(*g->table));
+		g->next = calloc(g->nports, sizeof(*g->next));
+		if (g->table == NULL || g->next == NULL)
+			return 1;
+		maglev_populate(g);
+	}
+	return 0;
+}
+
+/*
+ * A pipe is dead when its ring has been full for dead_timeout seconds
+ * without its consumer releasing any slot. In a consistent hashing
+ * group the flows of a dead pipe are moved to the others, and moved
+ * back as soon as the consumer drains the ring again.
+ */
+static void
+check_dead_pipes(struct worker *w, time_t now)
+{
+	int i, j;
+
+	for (i = 0; i < glob_arg.num_groups; i++) {
+		struct group_des *g = &w->groups[i];
+		int changed = 0;
+
+		if (g->table == NULL)
+			continue;
+		for (j = 0; j < g->nports; j++) {
+			struct port_des *p = &g->ports[j];
+			struct netmap_ring *ring = p->ring;
+
+			if (ring->head == ring->tail && ring->tail == p->stall_tail) {
+				if (p->stall_since == 0)
+					p->stall_since = now;
+				else if (!p->dead &&
+				    now - p->stall_since >= glob_arg.dead_timeout) {
+					D("%s is stuck, moving its flows", p->interface);
+					p->dead = 1;
+					changed = 1;
+				}
+				continue;
+			}
+			p->stall_tail = ring->tail;
+			p->stall_since = 0;
+			if (p->dead) {
+				D("%s is back", p->interface);
+				p->dead = 0;
+				changed = 1;
+			}
+		}
+		if (changed)
+			maglev_populate(g);
+	}
+}
+
+/*
+ * The overflow queues of each group are indexed by length: bucket b
+ * lists the ports whose queue holds 2^(b-1) to 2^b - 1 buffers, and
+ * bit b of oq_bitmap is set when the bucket is not empty (bucket 0,
+ * the empty queues, is not kept). Updates are O(1) and the longest
+ * queue (within a factor of two) is found with a bit scan, instead
+ * of scanning all the ports when the free queue runs out.
+ */
+static inline int
+oq_bucket(uint32_t n)
+{
+	return n ? 32 - __builtin_clz(n) : 0;
+}
+
+/* call after changing the length of the overflow queue of p */
+static inline void
+oq_index_update(struct port_des *p)
+{
+	struct group_des *g = p->group;
+	int b = oq_bucket(p->oq->n);
+
+	g->oq_n += p->oq->n - p->oq_last_n;
+	p->oq_last_n = p->oq->n;
+	if (likely(b == p->oq_bucket))
+		return;
+	if (p->oq_bucket) {
+		if (p->oq_prev)
+			p->oq_prev->oq_next = p->oq_next;
+		else
+			g->oq_buckets[p->oq_bucket] = p->oq_next;
+		if (p->oq_next)
+			p->oq_next->oq_prev = p->oq_prev;
+		if (g->oq_buckets[p->oq_bucket] == NULL)
+			g->oq_bitmap &= ~(1ULL << p->oq_bucket);
+	}
+	p->oq_bucket = b;
+	if (b) {
+		p->oq_prev = NULL;
+		p->oq_next = g->oq_buckets[b];
+		if (p->oq_next)
+			p->oq_next->oq_prev = p;
+		g->oq_buckets[b] = p;
+		g->oq_bitmap |= 1ULL << b;
+	}
+}
+
+/* choose the queue to revoke buffers from, NULL if all are empty */
+static struct port_des *
+oq_victim(struct worker *w)
+{
+	struct group_des *best = NULL;
+	int i;
+
+	for (i = 0; i < glob_arg.num_groups; i++) {
+		struct group_des *g = &w->groups[i];
+
+		if (!g->oq_bitmap)
+			continue;
+		if (best == NULL ||
+		    (glob_arg.revoke == REVOKE_GROUP ? g->oq_n > best->oq_n :
+		     g->oq_bitmap > best->oq_bitmap))
+			best = g;
+	}
+	if (best == NULL)
+		return NULL;
+	return best->oq_buckets[63 - __builtin_clzll(best->oq_bitmap)];
+}
+
 /* push the packet described by slot rs to the group g.
  * This may cause other buffers to be pushed down the
  * chain headed by g.
  * Return a free buffer.
  */
-uint32_t forward_packet(struct group_des *g, struct netmap_slot *rs)
+uint32_t forward_packet(struct worker *w, struct group_des *g,
+		struct netmap_slot *rs)
 {
 	uint32_t hash = rs->ptr;
-	uint32_t output_port = hash % g->nports;
+	uint32_t output_port = g->table ?
+		g->table[hash % g->table_size] : hash % g->nports;
 	struct port_des *port = &g->ports[output_port];
 	struct netmap_ring *ring = port->ring;
 	struct overflow_queue *q = port->oq;
+	struct overflow_queue *freeq = w->freeq;
 
 	/* Move the packet to the output pipe, unless there is
 	 * either no space left on the ring, or there is some
@@ -508,22 +886,24 @@ uint32_t forward_packet(struct group_des *g, struct netmap_slot *rs)
 		ring->head = nm_ring_next(ring, ring->head);
 		port->ctr.bytes += rs->len;
 		port->ctr.pkts++;
-		forwarded++;
+		w->forwarded++;
 		return old_slot.buf_idx;
 	}
 
 	/* use the overflow queue, if available */
-	if (q == NULL || oq_full(q)) {
+	if (q == NULL || oq_full(q) ||
+	    (glob_arg.revoke == REVOKE_TAIL && oq_empty(freeq))) {
 		/* no space left on the ring and no overflow queue
 		 * available: we are forced to drop the packet
 		 */
-		dropped++;
+		w->dropped++;
 		port->ctr.drop++;
 		port->ctr.drop_bytes += rs->len;
 		return rs->buf_idx;
 	}
 
 	oq_enq(q, rs);
+	oq_index_update(port);
 
 	/*
 	 * we cannot continue down the chain and we need to
@@ -531,159 +911,63 @@ uint32_t forward_packet(struct group_des *g, struct netmap_slot *rs)
 	 */
 	if (oq_empty(freeq)) {
 		/* the free queue is empty. Revoke some buffers
-		 * from the longest overflow queue
+		 * from the longest overflow queue (of the group
+		 * using most buffers, for REVOKE_GROUP)
 		 */
-		uint32_t j;
-		struct port_des *lp = &ports[0];
-		uint32_t max = lp->oq->n;
-
-		/* let lp point to the port with the longest queue */
-		for (j = 1; j < glob_arg.output_rings; j++) {
-			struct port_des *cp = &ports[j];
-			if (cp->oq->n > max) {
-				lp = cp;
-				max = cp->oq->n;
-			}
-		}
+		struct port_des *lp = oq_victim(w);
+		uint32_t n = lp->oq->n < BUF_REVOKE ? lp->oq->n : BUF_REVOKE;
 
-		/* move the oldest BUF_REVOKE buffers from the
-		 * lp queue to the free queue
+		/* move the oldest buffers from the lp queue to
+		 * the free queue
 		 */
-		// XXX optimize this cycle
-		for (j = 0; lp->oq->n && j < BUF_REVOKE; j++) {
-			struct netmap_slot tmp = oq_deq(lp->oq);
+		lp->ctr.drop_bytes += oq_move(freeq, lp->oq, n);
+		lp->ctr.drop += n;
+		w->dropped += n;
+		oq_index_update(lp);
 
-			dropped++;
-			lp->ctr.drop++;
-			lp->ctr.drop_bytes += tmp.len;
-
-			oq_enq(freeq, &tmp);
-		}
-
-		ND(1, "revoked %d buffers from %s", j, lq->name);
+		ND(1, "revoked %d buffers from %s", n, lp->oq->name);
 	}
 
 	return oq_deq(freeq).buf_idx;
 }
 
-int main(int argc, char **argv)
+/* set the affinity of the calling thread */
+static int
+setaffinity(int i)
 {
-	int ch;
-	uint32_t i;
-	int rv;
-	unsigned int iter = 0;
-	int poll_timeout = 10; /* default */
-
-	glob_arg.ifname[0] = '\0';
-	glob_arg.output_rings = 0;
-	glob_arg.batch = DEF_BATCH;
-	glob_arg.wait_link = DEF_WAIT_LINK;
-	glob_arg.busy_wait = false;
-	glob_arg.syslog_interval = 0;
-	glob_arg.stdout_interval = 0;
+	cpuset_t cpumask;
 
-	while ( (ch = getopt(argc, argv, "hi:p:b:B:s:o:w:W")) != -1) {
-		switch (ch) {
-		case 'i':
-			D("interface is %s", optarg);
-			if (strlen(optarg) > MAX_IFNAMELEN - 8) {
-				D("ifname too long %s", optarg);
-				return 1;
-			}
-			if (strncmp(optarg, "netmap:", 7) && strncmp(optarg, "vale", 4)) {
-				sprintf(glob_arg.ifname, "netmap:%s", optarg);
-			} else {
-				strcpy(glob_arg.ifname, optarg);
-			}
-			break;
+	if (i == -1)
+		return 0;
 
-		case 'p':
-			if (parse_pipes(optarg)) {
-				usage();
-				return 1;
-			}
-			break;
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
 
-		case 'B':
-			glob_arg.extra_bufs = atoi(optarg);
-			D("requested %d extra buffers", glob_arg.extra_bufs);
-			break;
-
-		case 'b':
-			glob_arg.batch = atoi(optarg);
-			D("batch is %d", glob_arg.batch);
-			break;
-
-		case 'w':
-			glob_arg.wait_link = atoi(optarg);
-			D("link wait for up time is %d", glob_arg.wait_link);
-			break;
-
-		case 'W':
-			glob_arg.busy_wait = true;
-			break;
-
-		case 'o':
-			glob_arg.stdout_interval = atoi(optarg);
-			break;
-
-		case 's':
-			glob_arg.syslog_interval = atoi(optarg);
-			break;
-
-		case 'h':
-			usage();
-			return 0;
-			break;
-
-		default:
-			D("bad option %c %s", ch, optarg);
-			usage();
-			return 1;
-		}
-	}
-
-	if (glob_arg.ifname[0] == '\0') {
-		D("missing interface name");
-		usage();
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset_t), &cpumask) != 0) {
+		D("Unable to set affinity: %s", strerror(errno));
 		return 1;
 	}
+	return 0;
+}
 
-	/* extract the base name */
-	char *nscan = strncmp(glob_arg.ifname, "netmap:", 7) ?
-			glob_arg.ifname : glob_arg.ifname + 7;
-	strncpy(glob_arg.base_name, nscan, MAX_IFNAMELEN-1);
-	for (nscan = glob_arg.base_name; *nscan && !index("-*^{}/@", *nscan); nscan++)
-		;
-	*nscan = '\0';
-
-	if (glob_arg.num_groups == 0)
-		parse_pipes("");
-
-	if (glob_arg.syslog_interval) {
-		setlogmask(LOG_UPTO(LOG_INFO));
-		openlog("lb", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-	}
-
+/*
+ * Open the input port (or ring) of worker w and move its extra
+ * buffers to the free queue. Worker 0 maps the netmap memory, the
+ * others inherit the mapping.
+ */
+static int
+worker_open_port(struct worker *w, struct nm_desc *parent)
+{
 	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *rxport = w->rxport;
+	struct overflow_queue *oq;
+	char ifname[MAX_PORTNAMELEN];
+	uint32_t extra_bufs;
 
-
-	pthread_t stat_thread;
-
-	ports = calloc(npipes + 1, sizeof(struct port_des));
-	if (!ports) {
-		D("failed to allocate the stats array");
-		return 1;
-	}
-	struct port_des *rxport = &ports[npipes];
-	init_groups();
-
-	memset(&counters_buf, 0, sizeof(counters_buf));
-	counters_buf.ctrs = calloc(npipes, sizeof(struct my_ctrs));
-	if (!counters_buf.ctrs) {
-		D("failed to allocate the counters snapshot buffer");
-		return 1;
-	}
+	if (glob_arg.per_ring)
+		snprintf(ifname, sizeof(ifname), "%s-%d", glob_arg.ifname, w->id);
+	else
+		snprintf(ifname, sizeof(ifname), "%s", glob_arg.ifname);
 
 	/* we need base_req to specify pipes and extra bufs */
 	struct nmreq base_req;
@@ -692,27 +976,26 @@ int main(int argc, char **argv)
 	base_req.nr_arg1 = npipes;
 	base_req.nr_arg3 = glob_arg.extra_bufs;
 
-	rxport->nmd = nm_open(glob_arg.ifname, &base_req, 0, NULL);
+	rxport->nmd = nm_open(ifname, &base_req, 0, parent);
 
 	if (rxport->nmd == NULL) {
-		D("cannot open %s", glob_arg.ifname);
+		D("cannot open %s", ifname);
 		return (1);
 	} else {
-		D("successfully opened %s (tx rings: %u)", glob_arg.ifname,
+		D("successfully opened %s (tx rings: %u)", ifname,
 		  rxport->nmd->req.nr_tx_slots);
 	}
 
-	uint32_t extra_bufs = rxport->nmd->req.nr_arg3;
-	struct overflow_queue *oq = NULL;
+	extra_bufs = rxport->nmd->req.nr_arg3;
 	/* reference ring to access the buffers */
 	rxport->ring = NETMAP_RXRING(rxport->nmd->nifp, 0);
 
 	if (!glob_arg.extra_bufs)
-		goto run;
+		return 0;
 
 	D("obtained %d extra buffers", extra_bufs);
 	if (!extra_bufs)
-		goto run;
+		return 0;
 
 	/* one overflow queue for each output pipe, plus one for the
 	 * free extra buffers
@@ -720,18 +1003,19 @@ int main(int argc, char **argv)
 	oq = calloc(npipes + 1, sizeof(struct overflow_queue));
 	if (!oq) {
 		D("failed to allocated overflow queues descriptors");
-		goto run;
+		return 0;
 	}
+	w->oq = oq;
 
-	freeq = &oq[npipes];
-	rxport->oq = freeq;
+	w->freeq = &oq[npipes];
+	rxport->oq = w->freeq;
 
-	freeq->slots = calloc(extra_bufs, sizeof(struct netmap_slot));
-	if (!freeq->slots) {
+	w->freeq->slots = calloc(extra_bufs, sizeof(struct netmap_slot));
+	if (!w->freeq->slots) {
 		D("failed to allocate the free list");
 	}
-	freeq->size = extra_bufs;
-	snprintf(freeq->name, MAX_IFNAMELEN, "free queue");
+	w->freeq->size = extra_bufs;
+	snprintf(w->freeq->name, MAX_IFNAMELEN, "free queue %d", w->id);
 
 	/*
 	 * the list of buffers uses the first uint32_t in each buffer
@@ -747,33 +1031,48 @@ int main(int argc, char **argv)
 		s.ptr = 0;
 		s.buf_idx = scan;
 		ND("freeq <- %d", s.buf_idx);
-		oq_enq(freeq, &s);
+		oq_enq(w->freeq, &s);
 	}
 
 
-	if (freeq->n != extra_bufs) {
+	if (w->freeq->n != extra_bufs) {
 		D("something went wrong: netmap reported %d extra_bufs, but the free list contained %d",
-				extra_bufs, freeq->n);
+				extra_bufs, w->freeq->n);
 		return 1;
 	}
 	rxport->nmd->nifp->ni_bufs_head = 0;
 
-run:
-	atexit(free_buffers);
+	return 0;
+}
 
+/* open the output pipes of worker w, with their overflow queues */
+static int
+worker_open_pipes(struct worker *w)
+{
+	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *rxport = w->rxport;
+	struct nm_desc *parent = workers[0].rxport->nmd;
+	struct overflow_queue *oq = w->oq;
+	uint32_t extra_bufs = w->freeq ? w->freeq->size : 0;
+	uint32_t i;
 	int j, t = 0;
+
 	for (j = 0; j < glob_arg.num_groups; j++) {
-		struct group_des *g = &groups[j];
+		struct group_des *g = &w->groups[j];
 		int k;
 		for (k = 0; k < g->nports; ++k) {
 			struct port_des *p = &g->ports[k];
+			/* the pipes of a group are numbered worker by worker */
+			int id = g->first_id * glob_arg.num_workers +
+				w->id * g->nports + k;
+
 			snprintf(p->interface, MAX_PORTNAMELEN, "%s%s{%d/xT@%d",
 					(strncmp(g->pipename, "vale", 4) ? "netmap:" : ""),
-					g->pipename, g->first_id + k,
+					g->pipename, id,
 					rxport->nmd->req.nr_arg2);
 			D("opening pipe named %s", p->interface);
 
-			p->nmd = nm_open(p->interface, NULL, 0, rxport->nmd);
+			p->nmd = nm_open(p->interface, NULL, 0, parent);
 
 			if (p->nmd == NULL) {
 				D("cannot open %s", p->interface);
@@ -782,7 +1081,7 @@ run:
 				D("failed to open pipe #%d in zero-copy mode, "
 					"please close any application that uses either pipe %s}%d, "
 				        "or %s{%d, and retry",
-					k + 1, g->pipename, g->first_id + k, g->pipename, g->first_id + k);
+					k + 1, g->pipename, id, g->pipename, id);
 				return (1);
 			} else {
 				D("successfully opened pipe #%d %s (tx slots: %d)",
@@ -802,7 +1101,7 @@ run:
 					extra_bufs = 0;
 				}
 				q->size = extra_bufs;
-				snprintf(q->name, sizeof(q->name), "oq %s{%4d", g->pipename, k);
+				snprintf(q->name, sizeof(q->name), "oq %s{%4d", g->pipename, id);
 				p->oq = q;
 			}
 		}
@@ -811,27 +1110,46 @@ run:
 
 	if (glob_arg.extra_bufs && !extra_bufs) {
 		if (oq) {
+			/* give the extra buffers back to netmap */
+			while (w->freeq->n) {
+				struct netmap_slot s = oq_deq(w->freeq);
+				uint32_t *b = (uint32_t *)NETMAP_BUF(rxport->ring, s.buf_idx);
+
+				*b = rxport->nmd->nifp->ni_bufs_head;
+				rxport->nmd->nifp->ni_bufs_head = s.buf_idx;
+			}
 			for (i = 0; i < npipes + 1; i++) {
 				free(oq[i].slots);
 				oq[i].slots = NULL;
+				w->ports[i].oq = NULL;
 			}
 			free(oq);
 			oq = NULL;
+			w->freeq = NULL;
 		}
 		D("*** overflow queues disabled ***");
 	}
+	w->oq = oq;
 
-	sleep(glob_arg.wait_link);
+	return 0;
+}
 
-	/* start stats thread after wait_link */
-	if (pthread_create(&stat_thread, NULL, print_stats, NULL) == -1) {
-		D("unable to create the stats thread: %s", strerror(errno));
-		return 1;
-	}
+static void *
+worker_body(void *arg)
+{
+	struct worker *w = arg;
+	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *rxport = w->rxport;
+	struct overflow_queue *oq = w->oq;
+	unsigned int iter = 0;
+	int poll_timeout = 10; /* default */
+	uint32_t i;
+	int rv;
+
+	setaffinity(w->cpu);
 
 	struct pollfd pollfd[npipes + 1];
 	memset(&pollfd, 0, sizeof(pollfd));
-	signal(SIGINT, sigint_h);
 
 	/* make sure we wake up as often as needed, even when there are no
 	 * packets coming in
@@ -846,7 +1164,7 @@ run:
 		iter++;
 
 		for (i = 0; i < npipes; ++i) {
-			struct netmap_ring *ring = ports[i].ring;
+			struct netmap_ring *ring = w->ports[i].ring;
 			int pending = nm_tx_pending(ring);
 
 			/* if there are packets pending, we want to be notified when
@@ -858,7 +1176,7 @@ run:
 				/* no need to poll, there are no packets pending */
 				continue;
 			}
-			pollfd[polli].fd = ports[i].nmd->fd;
+			pollfd[polli].fd = w->ports[i].nmd->fd;
 			pollfd[polli].events = POLLOUT;
 			pollfd[polli].revents = 0;
 			++polli;
@@ -871,6 +1189,8 @@ run:
 
 		//RD(5, "polling %d file descriptors", polli+1);
 		rv = poll(pollfd, polli, poll_timeout);
+		if (glob_arg.dead_timeout)
+			check_dead_pipes(w, time(NULL));
 		if (rv <= 0) {
 			if (rv < 0 && errno != EAGAIN && errno != EINTR)
 				RD(1, "poll error %s", strerror(errno));
@@ -885,7 +1205,7 @@ run:
 		 * done starting from the last group going backwards.
 		 */
 		for (i = glob_arg.num_groups - 1U; i > 0; i--) {
-			struct group_des *g = &groups[i - 1];
+			struct group_des *g = &w->groups[i - 1];
 			int j;
 
 			for (j = 0; j < g->nports; j++) {
@@ -900,7 +1220,7 @@ run:
 				for ( ; last != stop; last = nm_ring_next(ring, last)) {
 					struct netmap_slot *rs = &ring->slot[last];
 					// XXX less aggressive?
-					rs->buf_idx = forward_packet(g + 1, rs);
+					rs->buf_idx = forward_packet(w, g + 1, rs);
 					rs->flags |= NS_BUF_CHANGED;
 					rs->ptr = 0;
 				}
@@ -915,7 +1235,7 @@ run:
 			 * to the corresponding pipes
 			 */
 			for (i = 0; i < npipes; i++) {
-				struct port_des *p = &ports[i];
+				struct port_des *p = &w->ports[i];
 				struct overflow_queue *q = p->oq;
 				uint32_t j, lim;
 				struct netmap_ring *ring;
@@ -934,11 +1254,12 @@ run:
 					tmp.ptr = 0;
 					slot = &ring->slot[ring->head];
 					tmp.buf_idx = slot->buf_idx;
-					oq_enq(freeq, &tmp);
+					oq_enq(w->freeq, &tmp);
 					*slot = s;
 					slot->flags |= NS_BUF_CHANGED;
 					ring->head = nm_ring_next(ring, ring->head);
 				}
+				oq_index_update(p);
 			}
 		}
 
@@ -948,77 +1269,314 @@ run:
 			struct netmap_ring *rxring = NETMAP_RXRING(rxport->nmd->nifp, i);
 
 			//D("prepare to scan rings");
-			int next_head = rxring->head;
-			struct netmap_slot *next_slot = &rxring->slot[next_head];
-			const char *next_buf = NETMAP_BUF(rxring, next_slot->buf_idx);
 			while (!nm_ring_empty(rxring)) {
-				struct netmap_slot *rs = next_slot;
-				struct group_des *g = &groups[0];
-				++received_pkts;
-				received_bytes += rs->len;
-
-				// CHOOSE THE CORRECT OUTPUT PIPE
-				rs->ptr = pkt_hdr_hash((const unsigned char *)next_buf, 4, 'B');
-				if (rs->ptr == 0) {
-					non_ip++; // XXX ??
+				const unsigned char *bufs[HASH_BATCH];
+				uint32_t hash[HASH_BATCH];
+				uint32_t head = rxring->head, k, n;
+
+				/* first classify a whole batch, so that the
+				 * hash stage can prefetch ahead of the parser
+				 */
+				n = nm_ring_space(rxring);
+				if (n > HASH_BATCH)
+					n = HASH_BATCH;
+				for (k = 0; k < n; k++) {
+					bufs[k] = (const unsigned char *)NETMAP_BUF(rxring,
+						rxring->slot[head].buf_idx);
+					head = nm_ring_next(rxring, head);
 				}
-				// prefetch the buffer for the next round
-				next_head = nm_ring_next(rxring, next_head);
-				next_slot = &rxring->slot[next_head];
-				next_buf = NETMAP_BUF(rxring, next_slot->buf_idx);
-				__builtin_prefetch(next_buf);
 				// 'B' is just a hashing seed
-				rs->buf_idx = forward_packet(g, rs);
-				rs->flags |= NS_BUF_CHANGED;
-				rxring->head = rxring->cur = next_head;
-
-				batch++;
-				if (unlikely(batch >= glob_arg.batch)) {
-					ioctl(rxport->nmd->fd, NIOCRXSYNC, NULL);
-					batch = 0;
+				pkt_hdr_hash_batch(bufs, hash, n, 4, 'B');
+
+				for (k = 0; k < n; k++) {
+					struct netmap_slot *rs = &rxring->slot[rxring->head];
+					struct group_des *g = &w->groups[0];
+					++w->received_pkts;
+					w->received_bytes += rs->len;
+
+					// CHOOSE THE CORRECT OUTPUT PIPE
+					rs->ptr = hash[k];
+					if (rs->ptr == 0) {
+						w->non_ip++; // XXX ??
+					}
+					rs->buf_idx = forward_packet(w, g, rs);
+					rs->flags |= NS_BUF_CHANGED;
+					rxring->head = rxring->cur = nm_ring_next(rxring, rxring->head);
+
+					batch++;
+					if (unlikely(batch >= glob_arg.batch)) {
+						ioctl(rxport->nmd->fd, NIOCRXSYNC, NULL);
+						batch = 0;
+					}
+					ND(1,
+					   "Forwarded Packets: %"PRIu64" Dropped packets: %"PRIu64"   Percent: %.2f",
+					   w->forwarded, w->dropped,
+					   ((float)w->dropped / (float)w->forwarded * 100));
 				}
-				ND(1,
-				   "Forwarded Packets: %"PRIu64" Dropped packets: %"PRIu64"   Percent: %.2f",
-				   forwarded, dropped,
-				   ((float)dropped / (float)forwarded * 100));
 			}
 
 		}
 
 	send_stats:
-		if (counters_buf.status == COUNTERS_FULL)
+		if (w->counters_buf.status == COUNTERS_FULL)
 			continue;
 		/* take a new snapshot of the counters */
-		gettimeofday(&counters_buf.ts, NULL);
+		gettimeofday(&w->counters_buf.ts, NULL);
 		for (i = 0; i < npipes; i++) {
-			struct my_ctrs *c = &counters_buf.ctrs[i];
-			*c = ports[i].ctr;
+			struct my_ctrs *c = &w->counters_buf.ctrs[i];
+			*c = w->ports[i].ctr;
 			/*
 			 * If there are overflow queues, copy the number of them for each
 			 * port to the ctrs.oq_n variable for each port.
 			 */
-			if (ports[i].oq != NULL)
-				c->oq_n = ports[i].oq->n;
+			if (w->ports[i].oq != NULL)
+				c->oq_n = w->ports[i].oq->n;
 		}
-		counters_buf.received_pkts = received_pkts;
-		counters_buf.received_bytes = received_bytes;
-		counters_buf.non_ip = non_ip;
-		if (freeq != NULL)
-			counters_buf.freeq_n = freeq->n;
+		w->counters_buf.received_pkts = w->received_pkts;
+		w->counters_buf.received_bytes = w->received_bytes;
+		w->counters_buf.non_ip = w->non_ip;
+		if (w->freeq != NULL)
+			w->counters_buf.freeq_n = w->freeq->n;
 		__sync_synchronize();
-		counters_buf.status = COUNTERS_FULL;
+		w->counters_buf.status = COUNTERS_FULL;
 	}
 
-	/*
-	 * If freeq exists, copy the number to the freeq_n member of the
-	 * message struct, otherwise set it to 0.
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+	int w;
+	uint64_t forwarded = 0, dropped = 0;
+
+	glob_arg.ifname[0] = '\0';
+	glob_arg.output_rings = 0;
+	glob_arg.batch = DEF_BATCH;
+	glob_arg.wait_link = DEF_WAIT_LINK;
+	glob_arg.busy_wait = false;
+	glob_arg.syslog_interval = 0;
+	glob_arg.stdout_interval = 0;
+	glob_arg.per_ring = false;
+	glob_arg.first_cpu = -1;
+	glob_arg.num_workers = 1;
+	glob_arg.consistent = false;
+	glob_arg.dead_timeout = DEF_DEAD_TIMEOUT;
+	glob_arg.revoke = REVOKE_OLDEST;
+
+	while ( (ch = getopt(argc, argv, "hi:p:b:B:s:o:w:Wta:cD:R:")) != -1) {
+		switch (ch) {
+		case 'i':
+			D("interface is %s", optarg);
+			if (strlen(optarg) > MAX_IFNAMELEN - 8) {
+				D("ifname too long %s", optarg);
+				return 1;
+			}
+			if (strncmp(optarg, "netmap:", 7) && strncmp(optarg, "vale", 4)) {
+				sprintf(glob_arg.ifname, "netmap:%s", optarg);
+			} else {
+				strcpy(glob_arg.ifname, optarg);
+			}
+			break;
+
+		case 'p':
+			if (parse_pipes(optarg)) {
+				usage();
+				return 1;
+			}
+			break;
+
+		case 'B':
+			glob_arg.extra_bufs = atoi(optarg);
+			D("requested %d extra buffers", glob_arg.extra_bufs);
+			break;
+
+		case 'b':
+			glob_arg.batch = atoi(optarg);
+			D("batch is %d", glob_arg.batch);
+			break;
+
+		case 'w':
+			glob_arg.wait_link = atoi(optarg);
+			D("link wait for up time is %d", glob_arg.wait_link);
+			break;
+
+		case 'W':
+			glob_arg.busy_wait = true;
+			break;
+
+		case 't':
+			glob_arg.per_ring = true;
+			break;
+
+		case 'a':
+			glob_arg.first_cpu = atoi(optarg);
+			break;
+
+		case 'c':
+			glob_arg.consistent = true;
+			break;
+
+		case 'D':
+			glob_arg.dead_timeout = atoi(optarg);
+			break;
+
+		case 'R':
+			if (!strcmp(optarg, "oldest")) {
+				glob_arg.revoke = REVOKE_OLDEST;
+			} else if (!strcmp(optarg, "group")) {
+				glob_arg.revoke = REVOKE_GROUP;
+			} else if (!strcmp(optarg, "tail")) {
+				glob_arg.revoke = REVOKE_TAIL;
+			} else {
+				D("unknown revocation policy %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+
+		case 'o':
+			glob_arg.stdout_interval = atoi(optarg);
+			break;
+
+		case 's':
+			glob_arg.syslog_interval = atoi(optarg);
+			break;
+
+		case 'h':
+			usage();
+			return 0;
+			break;
+
+		default:
+			D("bad option %c %s", ch, optarg);
+			usage();
+			return 1;
+		}
+	}
+
+	if (glob_arg.ifname[0] == '\0') {
+		D("missing interface name");
+		usage();
+		return 1;
+	}
+
+	/* extract the base name */
+	char *nscan = strncmp(glob_arg.ifname, "netmap:", 7) ?
+			glob_arg.ifname : glob_arg.ifname + 7;
+	strncpy(glob_arg.base_name, nscan, MAX_IFNAMELEN-1);
+	for (nscan = glob_arg.base_name; *nscan && !index("-*^{}/@", *nscan); nscan++)
+		;
+	if (glob_arg.per_ring && *nscan) {
+		D("-t needs a plain port name, without ring or flag suffixes");
+		return 1;
+	}
+	*nscan = '\0';
+
+	if (glob_arg.num_groups == 0)
+		parse_pipes("");
+
+	if (glob_arg.syslog_interval) {
+		setlogmask(LOG_UPTO(LOG_INFO));
+		openlog("lb", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	}
+
+	uint32_t npipes = glob_arg.output_rings;
+
+	init_groups();
+
+	/* with -t there is a worker per input ring, but we only know
+	 * how many once the first ring is open
 	 */
-	if (freeq != NULL) {
-		freeq_n = freeq->n;
-	} else {
-		freeq_n = 0;
+	if (posix_memalign((void **)&workers, 64, sizeof(struct worker))) {
+		D("failed to allocate the workers");
+		return 1;
 	}
+	memset(workers, 0, sizeof(struct worker));
+	atexit(free_buffers);
+	for (w = 0; w < glob_arg.num_workers; w++) {
+		struct worker *wk = &workers[w];
+
+		wk->id = w;
+		wk->ports = calloc(npipes + 1, sizeof(struct port_des));
+		if (!wk->ports) {
+			D("failed to allocate the stats array");
+			return 1;
+		}
+		wk->rxport = &wk->ports[npipes];
+		wk->counters_buf.ctrs = calloc(npipes, sizeof(struct my_ctrs));
+		if (!wk->counters_buf.ctrs) {
+			D("failed to allocate the counters snapshot buffer");
+			return 1;
+		}
+		if (init_worker_groups(wk)) {
+			D("out of memory");
+			return 1;
+		}
+		if (worker_open_port(wk, w ? workers[0].rxport->nmd : NULL))
+			return 1;
 
+		if (w == 0 && glob_arg.per_ring &&
+		    workers[0].rxport->nmd->req.nr_rx_rings > 1) {
+			struct worker *nw;
+			int n = workers[0].rxport->nmd->req.nr_rx_rings;
+
+			if (posix_memalign((void **)&nw, 64,
+					n * sizeof(struct worker))) {
+				D("failed to allocate the workers");
+				return 1;
+			}
+			memset(nw, 0, n * sizeof(struct worker));
+			/* the groups and ports are not inside the
+			 * worker, so they survive the move
+			 */
+			nw[0] = workers[0];
+			free(workers);
+			workers = nw;
+			glob_arg.num_workers = n;
+		}
+	}
+	D("%d worker(s)", glob_arg.num_workers);
+
+	if (glob_arg.per_ring && glob_arg.first_cpu < 0)
+		glob_arg.first_cpu = 0;
+	for (w = 0; w < glob_arg.num_workers; w++) {
+		struct worker *wk = &workers[w];
+
+		wk->cpu = -1;
+		if (glob_arg.first_cpu >= 0)
+			wk->cpu = (glob_arg.first_cpu + w) %
+				sysconf(_SC_NPROCESSORS_ONLN);
+		if (worker_open_pipes(wk))
+			return 1;
+	}
+
+	sleep(glob_arg.wait_link);
+
+	signal(SIGINT, sigint_h);
+
+	for (w = 0; w < glob_arg.num_workers; w++) {
+		if (pthread_create(&workers[w].tid, NULL, worker_body,
+					&workers[w]) != 0) {
+			D("unable to create worker %d: %s", w, strerror(errno));
+			do_abort = 1;
+			glob_arg.num_workers = w;
+			break;
+		}
+	}
+
+	/* start stats thread after wait_link */
+	pthread_t stat_thread;
+	if (pthread_create(&stat_thread, NULL, print_stats, NULL) == -1) {
+		D("unable to create the stats thread: %s", strerror(errno));
+		return 1;
+	}
+
+	for (w = 0; w < glob_arg.num_workers; w++) {
+		pthread_join(workers[w].tid, NULL);
+		forwarded += workers[w].forwarded;
+		dropped += workers[w].dropped;
+	}
 	pthread_join(stat_thread, NULL);
 
 	printf("%"PRIu64" packets forwarded.  %"PRIu64" packets dropped. Total %"PRIu64"\n", forwarded,
@@ -0,0 +1,224 @@
+/*
+ * Microbenchmark for the lb packet hash.
+ *
+ * Builds a pool of netmap-sized buffers holding IPv4, IPv6, VLAN or
+ * GRE frames with random addresses and ports, then hashes them in a
+ * random order (as buffers come out of a NIC ring) with pkt_hdr_hash()
+ * one packet at a time and with pkt_hdr_hash_batch(), and reports the
+ * ns/packet of both.
+ *
+ * usage: pkt-hash-bench [-p pool_size] [-n packets] [-b batch]
+ *
+ * The default pool (64K buffers, 128 MB) does not fit in the caches;
+ * use a small pool (e.g. -p 256) to measure the parser alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "pkt_hash.h"
+
+#define BUF_SIZE	2048	/* same as the netmap buffers */
+
+enum { MIX_IPV4, MIX_IPV6, MIX_VLAN, MIX_GRE, MIX_ALL, MIX_N };
+static const char *mix_names[MIX_N] = { "ipv4", "ipv6", "vlan", "gre", "mix" };
+
+static volatile uint32_t sink;
+
+static unsigned char *
+put16(unsigned char *p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, 2);
+	return p + 2;
+}
+
+/* IPv4 header followed by the ports of a TCP or UDP header */
+static unsigned char *
+build_ipv4(unsigned char *p)
+{
+	uint32_t a;
+
+	memset(p, 0, 20);
+	p[0] = 0x45;
+	p[8] = 64;
+	p[9] = (random() & 1) ? 6 : 17;
+	a = random();
+	memcpy(p + 12, &a, 4);
+	a = random();
+	memcpy(p + 16, &a, 4);
+	p += 20;
+	put16(p, random());
+	put16(p + 2, random());
+	return p + 4;
+}
+
+static unsigned char *
+build_ipv6(unsigned char *p)
+{
+	int i;
+
+	memset(p, 0, 40);
+	p[0] = 0x60;
+	p[6] = (random() & 1) ? 6 : 17;
+	p[7] = 64;
+	for (i = 8; i < 40; i++)
+		p[i] = random();
+	p += 40;
+	put16(p, random());
+	put16(p + 2, random());
+	return p + 4;
+}
+
+static void
+build_frame(unsigned char *p, int mix)
+{
+	int i;
+
+	if (mix == MIX_ALL)
+		mix = random() % MIX_ALL;
+	for (i = 0; i < 12; i++)
+		p[i] = random();
+	p += 12;
+	switch (mix) {
+	case MIX_IPV4:
+		p = put16(p, 0x0800);
+		build_ipv4(p);
+		break;
+	case MIX_IPV6:
+		p = put16(p, 0x86DD);
+		build_ipv6(p);
+		break;
+	case MIX_VLAN:
+		p = put16(p, 0x8100);
+		p = put16(p, random() & 0xfff);
+		if (random() & 1) {
+			p = put16(p, 0x0800);
+			build_ipv4(p);
+		} else {
+			p = put16(p, 0x86DD);
+			build_ipv6(p);
+		}
+		break;
+	case MIX_GRE:
+		/* outer IPv4 carrying GRE, carrying IPv4 */
+		p = put16(p, 0x0800);
+		memset(p, 0, 20);
+		p[0] = 0x45;
+		p[9] = 47;
+		p += 20;
+		p = put16(p, 0);
+		p = put16(p, 0x0800);
+		build_ipv4(p);
+		break;
+	}
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: pkt-hash-bench [-p pool_size] [-n packets] [-b batch]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int pool = 65536, npkts = 20000000, batch = 32;
+	const unsigned char **order;
+	unsigned char *mem;
+	uint32_t *hash;
+	int ch, mix;
+
+	while ((ch = getopt(argc, argv, "p:n:b:")) != -1) {
+		switch (ch) {
+		case 'p':
+			pool = atoi(optarg);
+			break;
+		case 'n':
+			npkts = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (pool < 1 || batch < 1 || batch > pool)
+		usage();
+
+	mem = aligned_alloc(64, (size_t)pool * BUF_SIZE);
+	order = calloc(pool, sizeof(*order));
+	hash = calloc(batch, sizeof(*hash));
+	if (mem == NULL || order == NULL || hash == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	printf("pool %u buffers, %u packets, batch %u\n", pool, npkts, batch);
+	printf("%-6s %14s %14s\n", "mix", "single ns/pkt", "batch ns/pkt");
+	srandom(1);
+	for (mix = 0; mix < MIX_N; mix++) {
+		unsigned int i, j, done;
+		double t0, single, batched;
+		uint32_t sum = 0;
+
+		/* visit the buffers in random order, as a NIC would
+		 * return them after a while */
+		for (i = 0; i < pool; i++) {
+			memset(mem + (size_t)i * BUF_SIZE, 0, 128);
+			build_frame(mem + (size_t)i * BUF_SIZE, mix);
+			order[i] = mem + (size_t)i * BUF_SIZE;
+		}
+		for (i = pool - 1; i > 0; i--) {
+			const unsigned char *t;
+
+			j = random() % (i + 1);
+			t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+
+		t0 = now_ns();
+		for (done = 0, i = 0; done < npkts; done++) {
+			sum += pkt_hdr_hash(order[i], 4, 'B');
+			if (++i == pool)
+				i = 0;
+		}
+		single = (now_ns() - t0) / npkts;
+
+		t0 = now_ns();
+		for (done = 0, i = 0; done < npkts; done += batch) {
+			if (i + batch > pool)
+				i = 0;
+			pkt_hdr_hash_batch(order + i, hash, batch, 4, 'B');
+			sum += hash[0];
+			i += batch;
+		}
+		batched = (now_ns() - t0) / done;
+
+		sink = sum;
+		printf("%-6s %14.2f %14.2f\n", mix_names[mix], single, batched);
+	}
+
+	free(hash);
+	free(order);
+	free(mem);
+	return 0;
+}
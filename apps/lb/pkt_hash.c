@@ -105,6 +105,18 @@ build_byte_cache(uint32_t byte_cache[256][4])
 }
 
 
+static uint32_t byte_cache[256][4];
+
+/*
+ * The table is built before main() runs, so that several threads can
+ * hash packets without racing on its initialization.
+ */
+static void __attribute__((constructor))
+pkt_hash_init(void)
+{
+	build_byte_cache(byte_cache);
+}
+
 /*---------------------------------------------------------------------*/
 /**
  ** Computes symmetric hash based on the 4-tuple header data
@@ -113,18 +125,11 @@ static uint32_t
 sym_hash_fn(uint32_t sip, uint32_t dip, uint16_t sp, uint32_t dp)
 {
 	uint32_t rc = 0;
-	static int first_time = 1;
-	static uint32_t byte_cache[256][4];
 	uint8_t *sip_b = (uint8_t *)&sip,
 		*dip_b = (uint8_t *)&dip,
 		*sp_b  = (uint8_t *)&sp,
 		*dp_b  = (uint8_t *)&dp;
 
-	if (first_time) {
-		build_byte_cache(byte_cache);
-		first_time = 0;
-	}
-
 	rc = byte_cache[sip_b[3]][0] ^
 	     byte_cache[sip_b[2]][1] ^
 	     byte_cache[sip_b[1]][2] ^
@@ -394,4 +399,26 @@ decode_gre_hash(const uint8_t *grehdr, uint8_t hash_split, uint8_t seed)
 	return rc;
 }
 /*---------------------------------------------------------------------*/
+/**
+ ** Hashes a batch of packets. The headers of the packet
+ ** PKT_HASH_PREFETCH positions ahead are prefetched while the current
+ ** one is parsed, so that the parser rarely waits for memory.
+ ** All the headers we parse (but the tunneled ones) fit in the first
+ ** cache line of a netmap buffer.
+ **/
+void
+pkt_hdr_hash_batch(const unsigned char * const *buffers, uint32_t *hash,
+		   unsigned int n, uint8_t hash_split, uint8_t seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < n && i < PKT_HASH_PREFETCH; i++)
+		__builtin_prefetch(buffers[i]);
+	for (i = 0; i < n; i++) {
+		if (i + PKT_HASH_PREFETCH < n)
+			__builtin_prefetch(buffers[i + PKT_HASH_PREFETCH]);
+		hash[i] = pkt_hdr_hash(buffers[i], hash_split, seed);
+	}
+}
+/*---------------------------------------------------------------------*/
 
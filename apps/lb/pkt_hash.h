@@ -75,5 +75,18 @@ pkt_hdr_hash(const unsigned char *buffer,
 	     uint8_t hash_split,
 	     uint8_t seed);
 /*---------------------------------------------------------------------*/
+/**
+ ** Same as pkt_hdr_hash() for the n packets in buffers[], storing
+ ** the results in hash[]. Faster when the headers are not in cache.
+ **/
+#define PKT_HASH_PREFETCH	8	/* packets prefetched ahead */
+
+void
+pkt_hdr_hash_batch(const unsigned char * const *buffers,
+		   uint32_t *hash,
+		   unsigned int n,
+		   uint8_t hash_split,
+		   uint8_t seed);
+/*---------------------------------------------------------------------*/
 #endif /* LB_PKT_HASH_H */
 
@@ -298,6 +298,8 @@ struct glob_arg {
 	char *nmr_config;
 	int dummy_send;
 	int virt_header;	/* send also the virt_header */
+	int gso_size;		/* -G option */
+	u_int pool_frames;	/* -L option */
 	char *packet_file;	/* -P option */
 #define	STATS_WIN	15
 	int win_idx;
@@ -339,6 +341,12 @@ struct targ {
 	uint16_t seed[3];
 	u_int frags;
 	u_int frag_size;
+
+	/* pre-built frames (-L), used in turn instead of frame */
+	char *pool;
+	u_int pool_frames;
+	u_int pool_next;
+	u_int pool_stride;
 };
 
 static __inline uint16_t
@@ -1103,6 +1111,16 @@ initialize_packet(struct targ *targ)
 	memcpy(udp_ptr, &udp, sizeof(udp));
 
 	bzero(&pkt->vh, sizeof(pkt->vh));
+	if (targ->g->gso_size) {
+		/* struct virtio_net_hdr, in host byte order */
+		uint16_t hdr_len = (uint8_t *)udp_ptr + sizeof(udp) -
+			(uint8_t *)eh;
+		uint16_t gso_size = targ->g->gso_size;
+
+		pkt->vh.fields[1] = 3;	/* VIRTIO_NET_HDR_GSO_UDP */
+		memcpy(&pkt->vh.fields[2], &hdr_len, sizeof(hdr_len));
+		memcpy(&pkt->vh.fields[4], &gso_size, sizeof(gso_size));
+	}
 	// dump_payload((void *)pkt, targ->g->pkt_size, NULL, 0);
 }
 
@@ -1184,6 +1202,11 @@ send_packets(struct netmap_ring *ring, struct pkt *pkt, void *frame,
 		slot = &ring->slot[head];
 		p = NETMAP_BUF(ring, slot->buf_idx);
 		buf_changed = slot->flags & NS_BUF_CHANGED;
+		if (t->pool != NULL) {
+			frame = t->pool + (size_t)t->pool_next * t->pool_stride;
+			if (++t->pool_next == t->pool_frames)
+				t->pool_next = 0;
+		}
 
 		slot->flags = 0;
 		if (options & OPT_RUBBISH) {
@@ -1211,13 +1234,15 @@ send_packets(struct netmap_ring *ring, struct pkt *pkt, void *frame,
 			p = fp;
 			slot->flags = 0;
 			memcpy(p, f, tosend);
-			update_addresses(pkt, t);
+			if (t->pool == NULL)
+				update_addresses(pkt, t);
 		} else if ((options & (OPT_COPY | OPT_MEMCPY)) || buf_changed) {
 			if (options & OPT_COPY)
 				nm_pkt_copy(frame, p, size);
 			else
 				memcpy(p, frame, size);
-			update_addresses(pkt, t);
+			if (t->pool == NULL)
+				update_addresses(pkt, t);
 		} else if (options & OPT_PREFETCH) {
 			__builtin_prefetch(p);
 		}
@@ -1636,6 +1661,29 @@ sender_body(void *data)
 			targ->frags++;
 	}
 	D("frags %u frag_size %u", targ->frags, targ->frag_size);
+	if (targ->g->pool_frames) {
+		/*
+		 * Pre-build the frames with the addresses and checksums
+		 * that update_addresses() would produce, so that sending
+		 * is a plain copy (or, with -I, no copy at all). The pool
+		 * is built after setaffinity() to be local to our CPU.
+		 */
+		u_int j;
+
+		targ->pool_stride = (size + 63) & ~63;
+		if (posix_memalign((void **)&targ->pool, 64,
+				(size_t)targ->g->pool_frames * targ->pool_stride)) {
+			D("cannot allocate %u frames", targ->g->pool_frames);
+			goto quit;
+		}
+		for (j = 0; j < targ->g->pool_frames; j++) {
+			memcpy(targ->pool + (size_t)j * targ->pool_stride,
+				frame, size);
+			update_addresses(pkt, targ);
+		}
+		targ->pool_frames = targ->g->pool_frames;
+		targ->pool_next = 0;
+	}
 	while (!targ->cancel && (n == 0 || sent < n)) {
 		int rv;
 
@@ -1672,7 +1720,8 @@ sender_body(void *data)
 		/*
 		 * scan our queues and send on those with room
 		 */
-		if (options & OPT_COPY && sent > 100000 && !(targ->g->options & OPT_COPY) ) {
+		if (options & OPT_COPY && sent > 100000 &&
+		    !(targ->g->options & OPT_COPY) && targ->pool == NULL) {
 			D("drop copy");
 			options &= ~OPT_COPY;
 		}
@@ -1737,6 +1786,8 @@ sender_body(void *data)
 	targ->ctr.bytes = sent*size;
 	targ->ctr.events = event;
 quit:
+	free(targ->pool);
+	targ->pool = NULL;
 	/* reset the ``used`` flag. */
 	targ->used = 0;
 
@@ -2419,6 +2470,15 @@ usage(int errcode)
 "     -H len  Add empty virtio-net-header with size 'len'.  Valid sizes are 0, 10 and 12.  This option is\n"
 "             only used with Virtual Machine technologies that use virtio as a network interface.\n"
 "\n"
+"     -G gso_size\n"
+"             Mark the transmitted frames as UDP GSO packets, to be segmented in gso_size payload bytes by\n"
+"             the receiving port.  Needs -H.\n"
+"\n"
+"     -L num_frames\n"
+"             Pre-build num_frames frames with successive addresses and ports (and correct checksums) and\n"
+"             send them in turn, instead of rewriting the headers of each packet.  Implies copying the\n"
+"             frames in the transmit buffers, unless -I is also given.  Not valid with -P.\n"
+"\n"
 "     -P file\n"
 "             Load the packet to be transmitted from a pcap file rather than constructing it within\n"
 "             pkt-gen.\n"
@@ -2820,7 +2880,7 @@ main(int arc, char **argv)
 	g.wait_link = 2;	/* wait 2 seconds for physical ports */
 
 	while ((ch = getopt(arc, argv, "46a:f:F:Nn:i:Il:d:s:D:S:b:c:o:p:"
-	    "T:w:WvR:XC:H:rP:zZAhBM:")) != -1) {
+	    "T:w:WvR:XC:H:G:L:rP:zZAhBM:")) != -1) {
 
 		switch(ch) {
 		default:
@@ -2979,6 +3039,12 @@ main(int arc, char **argv)
 		case 'H':
 			g.virt_header = atoi(optarg);
 			break;
+		case 'G':
+			g.gso_size = atoi(optarg);
+			break;
+		case 'L':
+			g.pool_frames = atoi(optarg);
+			break;
 		case 'P':
 			g.packet_file = strdup(optarg);
 			break;
@@ -3055,6 +3121,14 @@ main(int arc, char **argv)
 		D("bad virtio-net-header length");
 		usage(-1);
 	}
+	if (g.gso_size && (g.virt_header == 0 || g.gso_size > 65535)) {
+		D("-G needs a virtio-net-header (-H)");
+		usage(-1);
+	}
+	if (g.pool_frames && g.packet_file) {
+		D("-L cannot be used with -P");
+		usage(-1);
+	}
 
     if (g.dev_type == DEV_TAP) {
 	D("want to use tap %s", g.ifname);
@@ -519,12 +519,24 @@ int netmap_generic_mit = 100*1000;
  */
 #ifdef linux
 int netmap_generic_txqdisc = 1;
+
+/*
+ * Without the qdisc, generic adapters pass the packets of a txsync
+ * straight to the driver in batches of up to generic_txbatch, and
+ * the driver is asked to ring the doorbell only for the last one
+ * (xmit_more). 1 sends each packet through dev_queue_xmit().
+ */
+int netmap_generic_txbatch = 32;
 #endif
 
 /* Default number of slots and queues for generic adapters. */
 int netmap_generic_ringsize = 1024;
 int netmap_generic_rings = 1;
 
+/* Number of received mbufs that generic adapters can hold in each
+ * rx ring, waiting for rxsync. Rounded up to a power of 2. */
+int netmap_generic_rxqueue = 1024;
+
 /* Non-zero to enable checksum offloading in NIC drivers */
 int netmap_generic_hwcsum = 0;
 
@@ -568,9 +580,15 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW,
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW,
 		&netmap_generic_rings, 0,
 		"Number of TX/RX queues for emulated netmap adapters");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rxqueue, CTLFLAG_RW,
+		&netmap_generic_rxqueue, 0,
+		"Max mbufs queued on each rx ring of emulated netmap adapters");
 #ifdef linux
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txqdisc, CTLFLAG_RW,
 		&netmap_generic_txqdisc, 0, "Use qdisc for generic adapters");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txbatch, CTLFLAG_RW,
+		&netmap_generic_txbatch, 0,
+		"Max packets per driver batch for generic adapters without qdisc");
 #endif
 SYSCTL_INT(_dev_netmap, OID_AUTO, ptnet_vnet_hdr, CTLFLAG_RW, &ptnet_vnet_hdr,
 		0, "Allow ptnet devices to use virtio-net headers");
@@ -1479,6 +1497,58 @@ assign_mem:
 	return 0;
 }
 
+/* Copy the per-ring receive counters of na into req, and reset them
+ * if requested. Called under NMG_LOCK. */
+void
+netmap_ring_stats_get(struct netmap_adapter *na,
+		struct nmreq_vale_ring_stats *req)
+{
+	u_int i;
+
+	req->nr_rx_rings = 0;
+	if (na->rx_rings == NULL)
+		return; /* rings not created yet */
+	for (i = 0; i < na->num_rx_rings && i < NM_VALE_RING_STATS_MAX; i++) {
+		struct netmap_kring *kring = na->rx_rings[i];
+		/* snapshot, the writers may be running */
+		uint64_t pkts = kring->nkr_rx_pkts;
+		uint64_t drops = kring->nkr_rx_drops;
+
+		req->nr_rx_pkts[i] = pkts - kring->nkr_rx_pkts_base;
+		req->nr_rx_drops[i] = drops - kring->nkr_rx_drops_base;
+		if (req->nr_flags & NR_VALE_RING_STATS_RESET) {
+			kring->nkr_rx_pkts_base = pkts;
+			kring->nkr_rx_drops_base = drops;
+		}
+	}
+	req->nr_rx_rings = i;
+}
+
+/* Process NETMAP_REQ_VALE_RING_STATS for an interface in emulated
+ * netmap mode. The adapter is only looked up, never created.
+ */
+static int
+netmap_hw_ring_stats(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_ring_stats *req =
+		(struct nmreq_vale_ring_stats *)(uintptr_t)hdr->nr_body;
+	struct ifnet *ifp;
+	int error = 0;
+
+	ifp = ifunit_ref(hdr->nr_name);
+	if (ifp == NULL)
+		return ENXIO;
+	NMG_LOCK();
+	if (!NM_NA_VALID(ifp) || !na_is_generic(NA(ifp))) {
+		error = EOPNOTSUPP;
+	} else {
+		netmap_ring_stats_get(NA(ifp), req);
+	}
+	NMG_UNLOCK();
+	if_rele(ifp);
+	return error;
+}
+
 /*
  * MUST BE CALLED UNDER NMG_LOCK()
  *
@@ -2788,7 +2858,24 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			error = nm_bdg_polling(hdr);
 			break;
 		}
+
+		case NETMAP_REQ_VALE_FTABLE: {
+			error = netmap_vale_ftable(hdr);
+			break;
+		}
+
 #endif  /* WITH_VALE */
+		case NETMAP_REQ_VALE_RING_STATS: {
+#ifdef WITH_VALE
+			if (!strncmp(hdr->nr_name, NM_BDG_NAME,
+					strlen(NM_BDG_NAME))) {
+				error = netmap_vale_ring_stats(hdr);
+				break;
+			}
+#endif  /* WITH_VALE */
+			error = netmap_hw_ring_stats(hdr);
+			break;
+		}
 		case NETMAP_REQ_POOLS_INFO_GET: {
 			/* Get information from the memory allocator used for
 			 * hdr->nr_name. */
@@ -2860,6 +2947,18 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			break;
 		}
 
+		case NETMAP_REQ_SYNC_KLOOP_STATS: {
+			error = netmap_sync_kloop_stats(priv, hdr);
+			break;
+		}
+
+#ifdef WITH_MONITOR
+		case NETMAP_REQ_MONITOR_STATS: {
+			error = netmap_monitor_stats(priv, hdr);
+			break;
+		}
+#endif /* WITH_MONITOR */
+
 		default: {
 			error = EINVAL;
 			break;
@@ -2979,6 +3078,14 @@ nmreq_size_by_type(uint16_t nr_reqtype)
 		return sizeof(struct nmreq_pools_info);
 	case NETMAP_REQ_SYNC_KLOOP_START:
 		return sizeof(struct nmreq_sync_kloop_start);
+	case NETMAP_REQ_VALE_FTABLE:
+		return sizeof(struct nmreq_vale_ftable);
+	case NETMAP_REQ_VALE_RING_STATS:
+		return sizeof(struct nmreq_vale_ring_stats);
+	case NETMAP_REQ_MONITOR_STATS:
+		return sizeof(struct nmreq_monitor_stats);
+	case NETMAP_REQ_SYNC_KLOOP_STATS:
+		return sizeof(struct nmreq_sync_kloop_stats);
 	}
 	return 0;
 }
@@ -3006,7 +3113,30 @@ nmreq_opt_size_by_type(uint32_t nro_reqtype, uint64_t nro_size)
 		break;
 	case NETMAP_REQ_OPT_SYNC_KLOOP_MODE:
 		rv = sizeof(struct nmreq_opt_sync_kloop_mode);
+		/* older applications only pass the mode */
+		if (nro_size < rv)
+			rv = offsetof(struct nmreq_opt_sync_kloop_mode,
+					spin_us);
+		break;
+	case NETMAP_REQ_OPT_SYNC_KLOOP_WORKERS:
+		rv = sizeof(struct nmreq_opt_sync_kloop_workers);
+		break;
+#ifdef WITH_MONITOR
+	case NETMAP_REQ_OPT_MONITOR_FILTER:
+		rv = sizeof(struct nmreq_opt_monitor_filter);
+		if (nro_size > rv) {
+			size_t max = rv +
+				NM_BPF_MAXINSNS * sizeof(struct nm_bpf_insn);
+			rv = nro_size < max ? nro_size : max;
+		}
+		break;
+	case NETMAP_REQ_OPT_MONITOR_SNAPLEN:
+		rv = sizeof(struct nmreq_opt_monitor_snaplen);
+		break;
+	case NETMAP_REQ_OPT_MONITOR_SAMPLING:
+		rv = sizeof(struct nmreq_opt_monitor_sampling);
 		break;
+#endif /* WITH_MONITOR */
 	}
 	/* subtract the common header */
 	return rv - sizeof(struct nmreq_option);
@@ -81,11 +81,14 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #include <sys/refcount.h>
 #include <sys/smp.h>
 
+epoch_t netmap_bdg_epoch;
 
 #elif defined(linux)
 
 #include "bsd_glue.h"
 
+DEFINE_SRCU(netmap_bdg_srcu);
+
 #elif defined(__APPLE__)
 
 #warning OSX support is only partial
@@ -127,8 +130,25 @@ netmap_bdg_name(struct netmap_vp_adapter *vp)
  * by an exclusive lock.
  */
 struct nm_bridge *nm_bridges;
+u_int nm_num_bridges;
 #endif /* !CONFIG_NET_NS */
 
+/* number of bridges (per network namespace), read at module load */
+static u_int netmap_max_bridges = NM_BRIDGES;
+SYSBEGIN(vars_bdg);
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, max_bridges, CTLFLAG_RDTUN,
+		&netmap_max_bridges, 0, "Max number of VALE switches");
+SYSEND;
+
+u_int
+netmap_bdg_num_bridges(void)
+{
+	nm_bound_var(&netmap_max_bridges, NM_BRIDGES, 1, NM_BRIDGES_MAX,
+			"max_bridges");
+	return netmap_max_bridges;
+}
+
 
 static int
 nm_is_id_char(const char c)
@@ -168,6 +188,252 @@ nm_bdg_name_validate(const char *name, size_t prefixlen)
 	return colon_pos;
 }
 
+/* Forwarding table of the learning bridge, see netmap_bdg.h */
+
+static void
+nm_hash_ents_init(struct nm_hash_ent *e, u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		e[i].mac = 0;
+		e[i].ports = NM_HASH_NOENT;
+		e[i].epoch = 0;
+	}
+}
+
+/* The table can be large and is only touched by the CPU, so on
+ * Linux it does not need physically contiguous memory.
+ */
+static struct nm_hash_ent *
+nm_hash_ents_alloc(u_int n)
+{
+	size_t sz = sizeof(struct nm_hash_ent) * n;
+	struct nm_hash_ent *e;
+#ifdef linux
+	e = nm_os_vmalloc(sz);
+#else
+	e = nm_os_malloc(sz);
+#endif
+	if (e != NULL)
+		nm_hash_ents_init(e, n);
+	return e;
+}
+
+static void
+nm_hash_ents_free(struct nm_hash_ent *e)
+{
+#ifdef linux
+	nm_os_vfree(e);
+#else
+	nm_os_free(e);
+#endif
+}
+
+static u_int
+nm_hash_buckets_round(u_int buckets)
+{
+	u_int n = NM_BDG_HASH_MIN;
+
+	while (n < buckets && n < NM_BDG_HASH_MAX)
+		n <<= 1;
+	return n;
+}
+
+struct nm_hash_table *
+nm_hash_table_new(u_int buckets, u_int ageing_time)
+{
+	struct nm_hash_table *ht;
+
+	ht = nm_os_malloc(sizeof(*ht));
+	if (ht == NULL)
+		return NULL;
+	ht->ht_buckets = nm_hash_buckets_round(buckets);
+	ht->ht_mask = ht->ht_buckets - 1;
+	ht->ht_ents = nm_hash_ents_alloc(ht->ht_buckets * NM_BDG_HASH_WAYS);
+	if (ht->ht_ents == NULL) {
+		nm_os_free(ht);
+		return NULL;
+	}
+	nm_hash_table_set_ageing(ht, ageing_time);
+	return ht;
+}
+
+void
+nm_hash_table_delete(struct nm_hash_table *ht)
+{
+	if (ht == NULL)
+		return;
+	nm_hash_ents_free(ht->ht_ents);
+	nm_os_free(ht);
+}
+
+/* forget all the learned addresses */
+void
+nm_hash_table_flush(struct nm_hash_table *ht)
+{
+	nm_hash_ents_init(ht->ht_ents, ht->ht_buckets * NM_BDG_HASH_WAYS);
+}
+
+/* Change the ageing time. Epochs change length, so the live entries
+ * are stamped with the new current epoch.
+ * Called with the bridge write lock held.
+ */
+void
+nm_hash_table_set_ageing(struct nm_hash_table *ht, u_int ageing_time)
+{
+	u_int i, n = ht->ht_buckets * NM_BDG_HASH_WAYS;
+	uint32_t old_epoch = ht->ht_epoch;
+	uint32_t epoch;
+
+	nm_bound_var(&ageing_time, NM_BDG_AGEING_TIME, NM_BDG_HASH_EPOCHS,
+			NM_BDG_AGEING_MAX, NULL);
+	ht->ht_ageing_time = ageing_time;
+	ht->ht_epoch_len = ageing_time / NM_BDG_HASH_EPOCHS;
+	ht->ht_last_sec = time_second;
+	epoch = ht->ht_epoch = ht->ht_last_sec / ht->ht_epoch_len;
+
+	for (i = 0; i < n; i++) {
+		struct nm_hash_ent *e = ht->ht_ents + i;
+
+		if (nm_hash_ent_age(e, old_epoch) >= NM_BDG_HASH_EPOCHS) {
+			e->ports = NM_HASH_NOENT;
+			continue;
+		}
+		e->epoch = epoch;
+	}
+}
+
+/* Change the number of buckets, rehashing the live entries.
+ * Entries that do not fit in the new table are dropped.
+ * Called with the bridge write lock held.
+ */
+int
+nm_hash_table_resize(struct nm_hash_table *ht, u_int buckets)
+{
+	struct nm_hash_ent *old = ht->ht_ents, *ents;
+	u_int old_n = ht->ht_buckets * NM_BDG_HASH_WAYS;
+	u_int mask, i, j;
+	uint32_t epoch = nm_hash_epoch(ht);
+
+	buckets = nm_hash_buckets_round(buckets);
+	if (buckets == ht->ht_buckets)
+		return 0;
+	ents = nm_hash_ents_alloc(buckets * NM_BDG_HASH_WAYS);
+	if (ents == NULL)
+		return ENOMEM;
+	mask = buckets - 1;
+
+	for (i = 0; i < old_n; i++) {
+		struct nm_hash_ent *e;
+
+		if (nm_hash_ent_age(old + i, epoch) >= NM_BDG_HASH_EPOCHS)
+			continue;
+		e = ents + NM_BDG_HASH_WAYS *
+			(nm_bdg_mac_hash(old[i].mac) & mask);
+		for (j = 0; j < NM_BDG_HASH_WAYS; j++) {
+			if (e[j].ports == NM_HASH_NOENT) {
+				e[j] = old[i];
+				break;
+			}
+		}
+	}
+	ht->ht_ents = ents;
+	ht->ht_buckets = buckets;
+	ht->ht_mask = mask;
+	nm_hash_ents_free(old);
+	return 0;
+}
+
+/* number of live entries */
+u_int
+nm_hash_table_count(struct nm_hash_table *ht)
+{
+	u_int i, n = ht->ht_buckets * NM_BDG_HASH_WAYS, count = 0;
+	uint32_t epoch = nm_hash_epoch(ht);
+
+	for (i = 0; i < n; i++) {
+		if (nm_hash_ent_age(ht->ht_ents + i, epoch) < NM_BDG_HASH_EPOCHS)
+			count++;
+	}
+	return count;
+}
+
+static void
+nm_bdg_free_ports(struct netmap_vp_adapter **ports, uint32_t *index,
+		uint32_t *tmp)
+{
+	if (ports)
+		nm_os_free(ports);
+	if (index)
+		nm_os_free(index);
+	if (tmp)
+		nm_os_free(tmp);
+}
+
+/*
+ * Let the control path change bridge b in ways the forwarding path
+ * cannot follow locklessly: forwarding on b falls back to the read
+ * side of bdg_lock, and we wait for the lockless forwarders to leave
+ * before taking the write lock. Called with NMG_LOCK held.
+ */
+void
+nm_bdg_reconf_begin(struct nm_bridge *b)
+{
+	NMG_LOCK_ASSERT();
+	b->bdg_flags |= NM_BDG_RECONF;
+	BDG_EPOCH_WAIT(b);
+	BDG_WLOCK(b);
+}
+
+void
+nm_bdg_reconf_end(struct nm_bridge *b)
+{
+	nm_stst_barrier(); /* changes visible before the flag goes */
+	b->bdg_flags &= ~NM_BDG_RECONF;
+	BDG_WUNLOCK(b);
+}
+
+/*
+ * Resize the port arrays of bridge b to hold nports ports.
+ * The bridge may be in use, so the new arrays are swapped in
+ * with nm_bdg_reconf_begin(). Called with NMG_LOCK held.
+ */
+static int
+nm_bdg_resize_ports(struct nm_bridge *b, u_int nports)
+{
+	struct netmap_vp_adapter **ports, **old_ports = b->bdg_ports;
+	uint32_t *index, *tmp;
+	uint32_t *old_index = b->bdg_port_index, *old_tmp = b->tmp_bdg_port_index;
+	u_int i, old_n = b->bdg_max_ports;
+
+	NMG_LOCK_ASSERT();
+	ports = nm_os_malloc(sizeof(*ports) * nports);
+	index = nm_os_malloc(sizeof(*index) * nports);
+	tmp = nm_os_malloc(sizeof(*tmp) * nports);
+	if (ports == NULL || index == NULL || tmp == NULL) {
+		nm_bdg_free_ports(ports, index, tmp);
+		return ENOMEM;
+	}
+	if (old_n) {
+		memcpy(ports, old_ports, sizeof(*ports) * old_n);
+		memcpy(index, old_index, sizeof(*index) * old_n);
+	}
+	/* the new ports go at the end of the list of free ones */
+	for (i = old_n; i < nports; i++)
+		index[i] = i;
+
+	nm_bdg_reconf_begin(b);
+	b->bdg_ports = ports;
+	b->bdg_port_index = index;
+	b->tmp_bdg_port_index = tmp;
+	b->bdg_max_ports = nports;
+	nm_bdg_reconf_end(b);
+
+	nm_bdg_free_ports(old_ports, old_index, old_tmp);
+	return 0;
+}
+
 /*
  * locate a bridge among the existing ones.
  * MUST BE CALLED WITH NMG_LOCK()
@@ -212,16 +478,21 @@ nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops)
 		/* initialize the bridge */
 		nm_prdis("create new bridge %s with ports %d", b->bdg_basename,
 			b->bdg_active_ports);
-		b->ht = nm_os_malloc(sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		b->ht = nm_hash_table_new(NM_BDG_HASH, NM_BDG_AGEING_TIME);
 		if (b->ht == NULL) {
 			nm_prerr("failed to allocate hash table");
 			return NULL;
 		}
+		if (nm_bdg_resize_ports(b, NM_BDG_PORTS_INIT)) {
+			nm_prerr("failed to allocate port arrays");
+			nm_hash_table_delete(b->ht);
+			b->ht = NULL;
+			return NULL;
+		}
 		strncpy(b->bdg_basename, name, namelen);
 		b->bdg_namelen = namelen;
 		b->bdg_active_ports = 0;
-		for (i = 0; i < NM_BDG_MAXPORTS; i++)
-			b->bdg_port_index[i] = i;
+		b->bdg_max_rings = 1;
 		/* set the default function */
 		b->bdg_ops = b->bdg_saved_ops = *ops;
 		b->private_data = b->ht;
@@ -240,7 +511,13 @@ netmap_bdg_free(struct nm_bridge *b)
 	}
 
 	nm_prdis("marking bridge %s as free", b->bdg_basename);
-	nm_os_free(b->ht);
+	nm_hash_table_delete(b->ht);
+	b->ht = NULL;
+	nm_bdg_free_ports(b->bdg_ports, b->bdg_port_index,
+			b->tmp_bdg_port_index);
+	b->bdg_ports = NULL;
+	b->bdg_port_index = b->tmp_bdg_port_index = NULL;
+	b->bdg_max_ports = 0;
 	memset(&b->bdg_ops, 0, sizeof(b->bdg_ops));
 	memset(&b->bdg_saved_ops, 0, sizeof(b->bdg_saved_ops));
 	b->bdg_flags = 0;
@@ -272,10 +549,10 @@ netmap_bdg_update_private_data(const char *name, bdg_update_private_data_fn_t ca
 		error = EACCES;
 		goto unlock_update_priv;
 	}
-	BDG_WLOCK(b);
+	nm_bdg_reconf_begin(b);
 	private_data = callback(b->private_data, callback_data, &error);
 	b->private_data = private_data;
-	BDG_WUNLOCK(b);
+	nm_bdg_reconf_end(b);
 
 unlock_update_priv:
 	NMG_UNLOCK();
@@ -293,6 +570,7 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	int s_hw = hw, s_sw = sw;
 	int i, lim =b->bdg_active_ports;
 	uint32_t *tmp = b->tmp_bdg_port_index;
+	struct netmap_vp_adapter *vpna;
 
 	/*
 	New algorithm:
@@ -301,15 +579,18 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	in the array of bdg_port_index, replacing them with
 	entries from the bottom of the array;
 	decrement bdg_active_ports;
-	acquire BDG_WLOCK() and copy back the array.
+	acquire BDG_WLOCK() and publish the new array;
+	wait until the forwarding path cannot see the ports anymore.
 	 */
 
 	if (netmap_debug & NM_DEBUG_BDG)
 		nm_prinf("detach %d and %d (lim %d)", hw, sw, lim);
 	/* make a copy of the list of active ports, update it,
-	 * and then copy back within BDG_WLOCK().
+	 * and then swap it with the current one within BDG_WLOCK().
+	 * The forwarding path sees either list, each of which
+	 * contains every port once.
 	 */
-	memcpy(b->tmp_bdg_port_index, b->bdg_port_index, sizeof(b->tmp_bdg_port_index));
+	memcpy(tmp, b->bdg_port_index, sizeof(*tmp) * b->bdg_max_ports);
 	for (i = 0; (hw >= 0 || sw >= 0) && i < lim; ) {
 		if (hw >= 0 && tmp[i] == hw) {
 			nm_prdis("detach hw %d at %d", hw, i);
@@ -332,21 +613,57 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	}
 
 	BDG_WLOCK(b);
-	if (b->bdg_ops.dtor)
-		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
-	b->bdg_ports[s_hw] = NULL;
+	vpna = b->bdg_ports[s_hw];
+	/* keep the counters of the departing ports */
+	nm_vale_ft_stats_collect(vpna, &b->ht->ht_stats, 1);
+	BDG_SET_VAR(b->bdg_ports[s_hw], NULL);
 	if (s_sw >= 0) {
-		b->bdg_ports[s_sw] = NULL;
+		nm_vale_ft_stats_collect(b->bdg_ports[s_sw],
+				&b->ht->ht_stats, 1);
+		BDG_SET_VAR(b->bdg_ports[s_sw], NULL);
 	}
-	memcpy(b->bdg_port_index, b->tmp_bdg_port_index, sizeof(b->tmp_bdg_port_index));
-	b->bdg_active_ports = lim;
+	b->tmp_bdg_port_index = b->bdg_port_index;
+	BDG_SET_VAR(b->bdg_port_index, tmp);
+	BDG_SET_VAR(b->bdg_active_ports, lim);
 	BDG_WUNLOCK(b);
+	/* packets may still be on their way to the old ports */
+	BDG_EPOCH_WAIT(b);
+	if (b->bdg_ops.dtor)
+		b->bdg_ops.dtor(vpna);
 
 	nm_prdis("now %d active ports", lim);
 	netmap_bdg_free(b);
 }
 
 
+/* Add the learning bridge counters of vpna to dst, including the GRO
+ * counters of its receive rings, and reset them if requested.
+ * Called under NMG_LOCK, which keeps the rings from going away.
+ */
+void
+nm_vale_ft_stats_collect(struct netmap_vp_adapter *vpna,
+		struct nm_vale_ft_stats *dst, int reset)
+{
+	struct netmap_adapter *na = &vpna->up;
+	u_int i;
+
+	nm_vale_ft_stats_add(dst, &vpna->ft_stats);
+	if (reset)
+		bzero(&vpna->ft_stats, sizeof(vpna->ft_stats));
+	if (na->rx_rings == NULL)
+		return;
+	for (i = 0; i < na->num_rx_rings; i++) {
+		struct netmap_kring *kring = na->rx_rings[i];
+
+		/* the same lock as the forwarding path */
+		mtx_lock(&kring->q_lock);
+		dst->gro_merged += kring->nkr_gro_merged;
+		if (reset)
+			kring->nkr_gro_merged = 0;
+		mtx_unlock(&kring->q_lock);
+	}
+}
+
 /* nm_bdg_ctl callback for VALE ports */
 int
 netmap_vp_bdg_ctl(struct nmreq_header *hdr, struct netmap_adapter *na)
@@ -375,6 +692,21 @@ netmap_default_bdg_attach(const char *name, struct netmap_adapter *na,
 	return NM_NEED_BWRAP;
 }
 
+/* Account for the rx rings of a port being attached to b,
+ * which are the possible destinations for each port.
+ * Called with the bridge write lock held.
+ */
+static void
+nm_bdg_update_max_rings(struct nm_bridge *b, struct netmap_vp_adapter *vpna)
+{
+	u_int nrings = vpna->up.num_rx_rings;
+
+	if (nrings > NM_BDG_MAXRINGS)
+		nrings = NM_BDG_MAXRINGS;
+	if (nrings > b->bdg_max_rings)
+		b->bdg_max_rings = nrings;
+}
+
 /* Try to get a reference to a netmap adapter attached to a VALE switch.
  * If the adapter is found (or is created), this function returns 0, a
  * non NULL pointer is returned into *na, and the caller holds a
@@ -442,6 +774,18 @@ netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		nm_prerr("bridge full %d, cannot create new port", b->bdg_active_ports);
 		return ENOMEM;
 	}
+	if (b->bdg_active_ports + needed > b->bdg_max_ports) {
+		u_int nports = 2 * b->bdg_max_ports;
+
+		if (nports > NM_BDG_MAXPORTS)
+			nports = NM_BDG_MAXPORTS;
+		error = nm_bdg_resize_ports(b, nports);
+		if (error) {
+			nm_prerr("cannot grow bridge %s to %u ports",
+				b->bdg_basename, nports);
+			return error;
+		}
+	}
 	/* record the next two ports available, but do not allocate yet */
 	cand = b->bdg_port_index[b->bdg_active_ports];
 	cand2 = b->bdg_port_index[b->bdg_active_ports + 1];
@@ -514,18 +858,27 @@ netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	}
 
 	BDG_WLOCK(b);
+	nm_bdg_update_max_rings(b, vpna);
+	if (hostna != NULL)
+		nm_bdg_update_max_rings(b, hostna);
 	vpna->bdg_port = cand;
 	nm_prdis("NIC  %p to bridge port %d", vpna, cand);
-	/* bind the port to the bridge (virtual ports are not active) */
-	b->bdg_ports[cand] = vpna;
+	/* bind the port to the bridge (virtual ports are not active).
+	 * The forwarding path may see the port as soon as it is
+	 * stored in bdg_ports[], so set it up first.
+	 */
 	vpna->na_bdg = b;
-	b->bdg_active_ports++;
 	if (hostna != NULL) {
-		/* also bind the host stack to the bridge */
-		b->bdg_ports[cand2] = hostna;
 		hostna->bdg_port = cand2;
 		hostna->na_bdg = b;
-		b->bdg_active_ports++;
+	}
+	nm_stst_barrier();
+	BDG_SET_VAR(b->bdg_ports[cand], vpna);
+	BDG_SET_VAR(b->bdg_active_ports, b->bdg_active_ports + 1);
+	if (hostna != NULL) {
+		/* also bind the host stack to the bridge */
+		BDG_SET_VAR(b->bdg_ports[cand2], hostna);
+		BDG_SET_VAR(b->bdg_active_ports, b->bdg_active_ports + 1);
 		nm_prdis("host %p to bridge port %d", hostna, cand2);
 	}
 	nm_prdis("if %s refs %d", ifname, vpna->up.na_refcount);
@@ -866,10 +1219,10 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 		goto unlock_regops;
 	}
 
-	BDG_WLOCK(b);
+	nm_bdg_reconf_begin(b);
 	if (!bdg_ops) {
 		/* resetting the bridge */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		nm_hash_table_flush(b->ht);
 		b->bdg_ops = b->bdg_saved_ops;
 		b->private_data = b->ht;
 	} else {
@@ -877,6 +1230,9 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 		b->private_data = private_data;
 #define nm_bdg_override(m) if (bdg_ops->m) b->bdg_ops.m = bdg_ops->m
 		nm_bdg_override(lookup);
+		/* a new lookup() invalidates the batched one */
+		if (bdg_ops->lookup)
+			b->bdg_ops.lookup_batch = bdg_ops->lookup_batch;
 		nm_bdg_override(config);
 		nm_bdg_override(dtor);
 		nm_bdg_override(vp_create);
@@ -884,7 +1240,7 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 #undef nm_bdg_override
 
 	}
-	BDG_WUNLOCK(b);
+	nm_bdg_reconf_end(b);
 
 unlock_regops:
 	NMG_UNLOCK();
@@ -938,8 +1294,13 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 			na->na_flags &= ~NAF_NETMAP_ON;
 		netmap_krings_mode_commit(na, onoff);
 	}
-	if (vpna->na_bdg)
+	if (vpna->na_bdg) {
 		BDG_WUNLOCK(vpna->na_bdg);
+		/* the forwarding path may still be filling the
+		 * rings we have just turned off */
+		if (!onoff)
+			BDG_EPOCH_WAIT(vpna->na_bdg);
+	}
 	return 0;
 }
 
@@ -1628,14 +1989,22 @@ netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
 int
 netmap_init_bridges(void)
 {
+	int error;
+
+	error = BDG_EPOCH_INIT();
+	if (error)
+		return error;
 #ifdef CONFIG_NET_NS
-	return netmap_bns_register();
+	error = netmap_bns_register();
 #else
-	nm_bridges = netmap_init_bridges2(NM_BRIDGES);
+	nm_num_bridges = netmap_bdg_num_bridges();
+	nm_bridges = netmap_init_bridges2(nm_num_bridges);
 	if (nm_bridges == NULL)
-		return ENOMEM;
-	return 0;
+		error = ENOMEM;
 #endif
+	if (error)
+		BDG_EPOCH_FINI();
+	return error;
 }
 
 void
@@ -1644,6 +2013,7 @@ netmap_uninit_bridges(void)
 #ifdef CONFIG_NET_NS
 	netmap_bns_unregister();
 #else
-	netmap_uninit_bridges2(nm_bridges, NM_BRIDGES);
+	netmap_uninit_bridges2(nm_bridges, nm_num_bridges);
 #endif
+	BDG_EPOCH_FINI();
 }
@@ -41,6 +41,19 @@
 #define BDG_RTRYLOCK(b)		rw_try_rlock(&(b)->bdg_lock)
 #define BDG_RUNLOCK(b)		rw_runlock(&(b)->bdg_lock)
 #define BDG_RWDESTROY(b)	rw_destroy(&(b)->bdg_lock)
+#define BDG_SET_VAR(lval, p)	(*(volatile __typeof(lval) *)&(lval) = (p))
+#define BDG_GET_VAR(lval)	(*(volatile __typeof(lval) *)&(lval))
+
+#include <sys/epoch.h>
+extern epoch_t netmap_bdg_epoch;
+#define BDG_EPOCH_T		struct epoch_tracker
+#define BDG_EPOCH_INIT()	\
+	((netmap_bdg_epoch = epoch_alloc("netmap bdg", EPOCH_PREEMPT)) ? \
+	 0 : ENOMEM)
+#define BDG_EPOCH_FINI()	epoch_free(netmap_bdg_epoch)
+#define BDG_EPOCH_ENTER(b, et)	epoch_enter_preempt(netmap_bdg_epoch, &(et))
+#define BDG_EPOCH_EXIT(b, et)	epoch_exit_preempt(netmap_bdg_epoch, &(et))
+#define BDG_EPOCH_WAIT(b)	epoch_wait_preempt(netmap_bdg_epoch)
 
 #endif /* __FreeBSD__ */
 
@@ -55,6 +68,16 @@
  */
 typedef uint32_t (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
 		struct netmap_vp_adapter *, void *private_data);
+/*
+ * Optional batched version of the lookup function: ft[] holds the
+ * first fragment of n packets, and the function must fill dst_port[i]
+ * with the same values that lookup() would return for ft[i], possibly
+ * changing dst_ring[i] (initialized to the ring of the sender).
+ * The packets must be processed in order, as lookup() would.
+ */
+typedef void (*bdg_lookup_batch_fn_t)(struct nm_bdg_fwd **ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *, void *private_data);
 typedef int (*bdg_config_fn_t)(struct nm_ifreq *);
 typedef void (*bdg_dtor_fn_t)(const struct netmap_vp_adapter *);
 typedef void *(*bdg_update_private_data_fn_t)(void *private_data, void *callback_data, int *error);
@@ -64,6 +87,7 @@ typedef int (*bdg_vp_create_fn_t)(struct nmreq_header *hdr,
 typedef int (*bdg_bwrap_attach_fn_t)(const char *nr_name, struct netmap_adapter *hwna);
 struct netmap_bdg_ops {
 	bdg_lookup_fn_t lookup;
+	bdg_lookup_batch_fn_t lookup_batch;	/* may be NULL */
 	bdg_config_fn_t config;
 	bdg_dtor_fn_t	dtor;
 	bdg_vp_create_fn_t	vp_create;
@@ -73,19 +97,145 @@ struct netmap_bdg_ops {
 int netmap_bwrap_attach(const char *name, struct netmap_adapter *, struct netmap_bdg_ops *);
 int netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *private_data, void *auth_token);
 
-#define	NM_BRIDGES		8	/* number of bridges */
-#define	NM_BDG_MAXPORTS		254	/* up to 254 */
+#define	NM_BRIDGES		64	/* default number of bridges */
+#define	NM_BRIDGES_MAX		1024	/* see the max_bridges sysctl */
+/*
+ * The port arrays of a bridge start with NM_BDG_PORTS_INIT entries
+ * and double as ports are attached, up to NM_BDG_MAXPORTS.
+ * The forwarding scratchpad (see nm_vale_flush()) indexes a queue
+ * for each port and ring with 16 bits, hence the limit.
+ */
+#define	NM_BDG_PORTS_INIT	8
+#define	NM_BDG_MAXPORTS		4094
+#define	NM_BDG_MAXRINGS		16	/* XXX unclear how many. */
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
 #define	NM_BDG_NOPORT		(NM_BDG_MAXPORTS+1)
 
-/* XXX Should go away after fixing find_bridge() - Michio */
-#define NM_BDG_HASH		1024	/* forwarding table entries */
+/*
+ * Forwarding table used by the learning bridge (netmap_vale_learning()).
+ * The table is set-associative: each MAC address hashes to a bucket of
+ * NM_BDG_HASH_WAYS entries (one cache line), so colliding addresses
+ * only compete for a slot when the whole bucket is full, and then
+ * the least recently refreshed entry is evicted.
+ *
+ * Entries are stamped with an epoch on every refresh. An epoch lasts
+ * ht_ageing_time / NM_BDG_HASH_EPOCHS seconds, and entries older than
+ * NM_BDG_HASH_EPOCHS epochs are expired: lookups ignore them and
+ * learning recycles them first.
+ *
+ * The number of buckets and the ageing time can be changed per bridge
+ * with NETMAP_REQ_VALE_FTABLE.
+ */
+#define NM_BDG_HASH		1024	/* default number of buckets */
+#define NM_BDG_HASH_MIN		16
+#define NM_BDG_HASH_MAX		16384	/* 1 MB, see nm_hash_ents_alloc() */
+#define NM_BDG_HASH_WAYS	4	/* entries per bucket */
+#define NM_BDG_HASH_EPOCHS	8	/* epochs before an entry expires */
+#define NM_BDG_AGEING_TIME	300	/* default ageing time (seconds) */
+#define NM_BDG_AGEING_MAX	86400
 
-/* XXX revise this */
 struct nm_hash_ent {
-	uint64_t	mac;	/* the top 2 bytes are the epoch */
-	uint64_t	ports;
+	uint64_t	mac;	/* low 48 bits */
+	uint32_t	ports;
+	uint32_t	epoch;	/* of the last refresh */
 };
+#define NM_HASH_MAC_MASK	0xffffffffffffULL
+#define NM_HASH_EPOCH_SHIFT	48	/* epoch in last_smac */
+#define NM_HASH_NOENT		(~0U)	/* ports value for an empty entry */
+
+struct nm_hash_table {
+	struct nm_hash_ent *ht_ents;	/* ht_buckets * NM_BDG_HASH_WAYS */
+	u_int		ht_buckets;	/* power of 2 */
+	u_int		ht_mask;	/* ht_buckets - 1 */
+	u_int		ht_ageing_time;	/* seconds */
+	u_int		ht_epoch_len;	/* seconds */
+	uint32_t	ht_last_sec;	/* time_second when ht_epoch was set */
+	uint32_t	ht_epoch;	/* current epoch */
+	/* counters of the ports that have left the bridge */
+	struct nm_vale_ft_stats ht_stats;
+};
+
+/* ----- FreeBSD if_bridge hash function ------- */
+
+/*
+ * The following hash function is adapted from "Hash Functions" by Bob Jenkins
+ * ("Algorithm Alley", Dr. Dobbs Journal, September 1997).
+ *
+ * http://www.burtleburtle.net/bob/hash/spooky.html
+ */
+#define nm_bdg_mix(a, b, c)                                             \
+do {                                                                    \
+	a -= b; a -= c; a ^= (c >> 13);                                 \
+	b -= c; b -= a; b ^= (a << 8);                                  \
+	c -= a; c -= b; c ^= (b >> 13);                                 \
+	a -= b; a -= c; a ^= (c >> 12);                                 \
+	b -= c; b -= a; b ^= (a << 16);                                 \
+	c -= a; c -= b; c ^= (b >> 5);                                  \
+	a -= b; a -= c; a ^= (c >> 3);                                  \
+	b -= c; b -= a; b ^= (a << 10);                                 \
+	c -= a; c -= b; c ^= (b >> 15);                                 \
+} while (/*CONSTCOND*/0)
+
+/* Hash of a MAC address, stored in the low 48 bits of 'mac'
+ * with the first byte in the least significant position.
+ */
+static inline uint32_t
+nm_bdg_mac_hash(uint64_t mac)
+{
+	uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0; // hask key
+
+	b += (uint32_t)(mac >> 32);
+	a += (uint32_t)mac;
+
+	nm_bdg_mix(a, b, c);
+	return c;
+}
+
+#undef nm_bdg_mix
+
+struct nm_hash_table *nm_hash_table_new(u_int buckets, u_int ageing_time);
+void nm_hash_table_delete(struct nm_hash_table *ht);
+void nm_hash_table_flush(struct nm_hash_table *ht);
+int nm_hash_table_resize(struct nm_hash_table *ht, u_int buckets);
+void nm_hash_table_set_ageing(struct nm_hash_table *ht, u_int ageing_time);
+u_int nm_hash_table_count(struct nm_hash_table *ht);
+
+/* first entry of the bucket for the given hash */
+static inline struct nm_hash_ent *
+nm_hash_bucket(struct nm_hash_table *ht, uint32_t hash)
+{
+	return ht->ht_ents + NM_BDG_HASH_WAYS * (hash & ht->ht_mask);
+}
+
+/* Return the current epoch of the table. Concurrent callers may
+ * race on the cached values, but they all compute the same result.
+ */
+static inline uint32_t
+nm_hash_epoch(struct nm_hash_table *ht)
+{
+	uint32_t now = time_second;
+
+	if (unlikely(now != ht->ht_last_sec)) {
+		ht->ht_epoch = now / ht->ht_epoch_len;
+		ht->ht_last_sec = now;
+	}
+	return ht->ht_epoch;
+}
+
+/* Number of epochs since the entry was last refreshed, or
+ * NM_BDG_HASH_EPOCHS if the entry is empty or expired.
+ */
+static inline u_int
+nm_hash_ent_age(const struct nm_hash_ent *e, uint32_t epoch)
+{
+	uint32_t age;
+
+	if (e->ports == NM_HASH_NOENT)
+		return NM_BDG_HASH_EPOCHS;
+	/* 32 bits do not wrap within the lifetime of a table */
+	age = epoch - e->epoch;
+	return age < NM_BDG_HASH_EPOCHS ? age : NM_BDG_HASH_EPOCHS;
+}
 
 /* Default size for the Maximum Frame Size. */
 #define NM_BDG_MFS_DEFAULT	1514
@@ -100,25 +250,39 @@ struct nm_hash_ent {
  * The bridge is non blocking on the transmit ports: excess
  * packets are dropped if there is no room on the output port.
  *
- * bdg_lock protects accesses to the bdg_ports array.
- * This is a rw lock (or equivalent).
+ * The forwarding path (nm_vale_preflush()) does not take bdg_lock,
+ * it runs within BDG_EPOCH_ENTER()/BDG_EPOCH_EXIT(). The control path
+ * serializes on the write side of bdg_lock, publishes new ports and
+ * a new bdg_port_index with BDG_SET_VAR(), and calls BDG_EPOCH_WAIT()
+ * before anything the forwarding path may still see goes away.
+ * Changes that cannot be published with a single store (a new lookup
+ * function or private data, a larger bdg_ports array) are made between
+ * nm_bdg_reconf_begin() and nm_bdg_reconf_end(): meanwhile forwarding
+ * falls back to the read side of bdg_lock.
  */
 #define NM_BDG_IFNAMSIZ IFNAMSIZ
 struct nm_bridge {
 	/* XXX what is the proper alignment/layout ? */
-	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ports */
+	BDG_RWLOCK_T	bdg_lock;	/* serializes the control path */
 	int		bdg_namelen;
 	uint32_t	bdg_active_ports;
 	char		bdg_basename[NM_BDG_IFNAMSIZ];
 
+	/* Size of the port arrays below, and max number of rx rings
+	 * (capped to NM_BDG_MAXRINGS) of the ports attached so far.
+	 * They never shrink while the bridge is in use.
+	 */
+	u_int		bdg_max_ports;
+	u_int		bdg_max_rings;
+
 	/* Indexes of active ports (up to active_ports)
 	 * and all other remaining ports.
 	 */
-	uint32_t	bdg_port_index[NM_BDG_MAXPORTS];
+	uint32_t	*bdg_port_index;
 	/* used by netmap_bdg_detach_common() */
-	uint32_t	tmp_bdg_port_index[NM_BDG_MAXPORTS];
+	uint32_t	*tmp_bdg_port_index;
 
-	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
+	struct netmap_vp_adapter **bdg_ports;
 
 	/*
 	 * Programmable lookup functions to figure out the destination port.
@@ -138,15 +302,19 @@ struct nm_bridge {
 	 * otherwise will point to the data structure received by netmap_bdg_regops().
 	 */
 	void *private_data;
-	struct nm_hash_ent *ht;
+	struct nm_hash_table *ht;
 
 	/* Currently used to specify if the bridge is still in use while empty and
 	 * if it has been put in exclusive mode by an external module, see netmap_bdg_regops()
-	 * and netmap_bdg_create().
+	 * and netmap_bdg_create(). NM_BDG_FLOW_STEERING and NM_BDG_GRO are
+	 * set through NETMAP_REQ_VALE_FTABLE.
 	 */
 #define NM_BDG_ACTIVE		1
 #define NM_BDG_EXCLUSIVE	2
 #define NM_BDG_NEED_BWRAP	4
+#define NM_BDG_FLOW_STEERING	8	/* spread flows over the rx rings */
+#define NM_BDG_RECONF		16	/* see nm_bdg_reconf_begin() */
+#define NM_BDG_GRO		32	/* coalesce TCP segments, see bdg_gro_datapath() */
 	uint8_t			bdg_flags;
 
 
@@ -170,12 +338,17 @@ nm_bdg_valid_auth_token(struct nm_bridge *b, void *auth_token)
 	return !(b->bdg_flags & NM_BDG_EXCLUSIVE) || b->ht == auth_token;
 }
 
+void nm_bdg_reconf_begin(struct nm_bridge *b);
+void nm_bdg_reconf_end(struct nm_bridge *b);
+
 int netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	struct netmap_mem_d *nmd, int create, struct netmap_bdg_ops *ops);
 
 struct nm_bridge *nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops);
 int netmap_bdg_free(struct nm_bridge *b);
 void netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw);
+void nm_vale_ft_stats_collect(struct netmap_vp_adapter *vpna,
+		struct nm_vale_ft_stats *dst, int reset);
 int netmap_vp_bdg_ctl(struct nmreq_header *hdr, struct netmap_adapter *na);
 int netmap_bwrap_reg(struct netmap_adapter *, int onoff);
 int netmap_vp_reg(struct netmap_adapter *na, int onoff);
@@ -43,10 +43,10 @@
  *	so we use it as an interrupt notification to wake up
  *	processes blocked on a poll().
  *
- *	For each receive ring we allocate one "struct mbq"
- *	(an mbuf tailq plus a spinlock). We intercept packets
+ *	For each receive ring we allocate a ring of mbuf pointers
+ *	(dev.netmap.generic_rxqueue entries). We intercept packets
  *	(through if_input)
- *	on the receive path and put them in the mbq from which
+ *	on the receive path and put them in the ring from which
  *	netmap receive routines can grab them.
  *
  * TX:
@@ -61,7 +61,20 @@
  *	the equivalent of a transmit interrupt.
  *
  * RX:
- *
+ *	in the generic_netmap_rxsync() routine, the mbufs queued by
+ *	generic_rx_handler() are copied into the netmap buffers
+ *	(spanning several slots with NS_MOREFRAG if rx scatter-gather
+ *	is enabled) and freed.
+ *	The copy cannot be avoided by flipping the mbuf pages into
+ *	the netmap pool: netmap buffers are mapped in the address
+ *	space of the applications at fixed offsets, so swapping a
+ *	page would require to rewrite the page tables of every
+ *	process mapping the pool (and a TLB shootdown) for each
+ *	packet, and the buffers would no longer be contiguous in
+ *	the clusters. Nor can the mbuf data be attached to a slot,
+ *	since slots can only refer to netmap memory. Zero-copy
+ *	receive needs a native adapter, where the NIC writes
+ *	directly into netmap buffers.
  */
 
 #ifdef __FreeBSD__
@@ -86,6 +99,7 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap_generic.c 274353 2014-11-10 20:19
 #include <dev/netmap/netmap_mem2.h>
 
 #define MBUF_RXQ(m)	((m)->m_pkthdr.flowid)
+#define MBUF_PREFETCH(m)	__builtin_prefetch(mtod(m, void *))
 #define smp_mb()
 
 #elif defined _WIN32
@@ -94,6 +108,7 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap_generic.c 274353 2014-11-10 20:19
 
 #define MBUF_TXQ(m) 	0//((m)->m_pkthdr.flowid)
 #define MBUF_RXQ(m)	    0//((m)->m_pkthdr.flowid)
+#define MBUF_PREFETCH(m)
 #define smp_mb()		//XXX: to be correctly defined
 
 #else /* linux */
@@ -103,6 +118,8 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap_generic.c 274353 2014-11-10 20:19
 #include <linux/ethtool.h>      /* struct ethtool_ops, get_ringparam */
 #include <linux/hrtimer.h>
 
+#define MBUF_PREFETCH(m)	prefetch((m)->data)
+
 static inline struct mbuf *
 nm_os_get_mbuf(struct ifnet *ifp, int len)
 {
@@ -133,6 +150,54 @@ nm_os_get_mbuf(struct ifnet *ifp, int len)
 		for_each_kring_n(_i, _k, (_na)->rx_rings, (_na)->num_rx_rings + 1)
 
 
+/* ========================== RX MBUF RING ================================= */
+
+static int
+generic_rx_mring_init(struct netmap_kring *kring)
+{
+	u_int sz = 64;
+
+	while (sz < netmap_generic_rxqueue && sz < 65536)
+		sz <<= 1;
+	kring->rx_mring = nm_os_malloc(sz * sizeof(struct mbuf *));
+	if (kring->rx_mring == NULL)
+		return ENOMEM;
+	kring->rx_mring_mask = sz - 1;
+	kring->rx_mring_prod = kring->rx_mring_cons = 0;
+	mtx_init(&kring->rx_mring_lock, "rx_mring_lock", NULL, MTX_SPIN);
+	return 0;
+}
+
+/* Free the mbufs still pending in the ring. Called when rxsync
+ * can no longer run on the kring, so we are the consumer. */
+static void
+generic_rx_mring_purge(struct netmap_kring *kring)
+{
+	u_int i, prod;
+
+	if (kring->rx_mring == NULL)
+		return;
+	mtx_lock_spin(&kring->rx_mring_lock);
+	prod = kring->rx_mring_prod;
+	mtx_unlock_spin(&kring->rx_mring_lock);
+	for (i = kring->rx_mring_cons; i != prod; i++) {
+		m_freem(kring->rx_mring[i & kring->rx_mring_mask]);
+	}
+	kring->rx_mring_cons = prod;
+}
+
+static void
+generic_rx_mring_fini(struct netmap_kring *kring)
+{
+	if (kring->rx_mring == NULL)
+		return;
+	generic_rx_mring_purge(kring);
+	mtx_destroy(&kring->rx_mring_lock);
+	nm_os_free(kring->rx_mring);
+	kring->rx_mring = NULL;
+}
+
+
 /* ======================== PERFORMANCE STATISTICS =========================== */
 
 #ifdef RATE_GENERIC
@@ -220,12 +285,59 @@ netmap_generic_irq(struct netmap_adapter *na, u_int q, u_int *work_done)
 #endif  /* RATE_GENERIC */
 }
 
+/* Number of spare mbufs kept by each tx kring. */
+#define NM_GENERIC_TX_SPARE	64
+
+/* Refill the spare stack of a tx kring. */
+static void
+generic_tx_pool_fill_spare(struct netmap_kring *kring, u_int len)
+{
+	while (kring->tx_nspare < NM_GENERIC_TX_SPARE) {
+		struct mbuf *m = nm_os_get_mbuf(kring->na->ifp, len);
+
+		if (m == NULL)
+			break;
+		kring->tx_spare[kring->tx_nspare++] = m;
+	}
+}
+
+/* Preallocate the missing mbufs of the tx pool and of the spare stack
+ * of a tx kring. Failures are not fatal, since txsync replenishes
+ * the pool on demand. */
+static void
+generic_tx_pool_fill(struct netmap_kring *kring, u_int len)
+{
+	u_int i;
+
+	for (i = 0; i < kring->nkr_num_slots; i++) {
+		if (kring->tx_pool[i] == NULL)
+			kring->tx_pool[i] = nm_os_get_mbuf(kring->na->ifp, len);
+	}
+	generic_tx_pool_fill_spare(kring, len);
+}
+
+/* Release all the mbufs of the tx pool and of the spare stack. */
+static void
+generic_tx_pool_free(struct netmap_kring *kring)
+{
+	u_int i;
+
+	for (i = 0; i < kring->nkr_num_slots; i++) {
+		if (kring->tx_pool[i]) {
+			m_freem(kring->tx_pool[i]);
+			kring->tx_pool[i] = NULL;
+		}
+	}
+	while (kring->tx_nspare > 0)
+		m_freem(kring->tx_spare[--kring->tx_nspare]);
+}
+
 static int
 generic_netmap_unregister(struct netmap_adapter *na)
 {
 	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	struct netmap_kring *kring = NULL;
-	int i, r;
+	int r;
 
 	if (na->active_fds == 0) {
 		na->na_flags &= ~NAF_NETMAP_ON;
@@ -243,7 +355,7 @@ generic_netmap_unregister(struct netmap_adapter *na)
 		/* Free the mbufs still pending in the RX queues,
 		 * that did not end up into the corresponding netmap
 		 * RX rings. */
-		mbq_safe_purge(&kring->rx_queue);
+		generic_rx_mring_purge(kring);
 		nm_os_mitigation_cleanup(&gna->mit[r]);
 	}
 
@@ -268,7 +380,7 @@ generic_netmap_unregister(struct netmap_adapter *na)
 		nm_os_free(gna->mit);
 
 		for_each_rx_kring(r, kring, na) {
-			mbq_safe_fini(&kring->rx_queue);
+			generic_rx_mring_fini(kring);
 		}
 
 		for_each_tx_kring(r, kring, na) {
@@ -277,13 +389,10 @@ generic_netmap_unregister(struct netmap_adapter *na)
 				continue;
 			}
 
-			for (i=0; i<na->num_tx_desc; i++) {
-				if (kring->tx_pool[i]) {
-					m_freem(kring->tx_pool[i]);
-				}
-			}
+			generic_tx_pool_free(kring);
 			nm_os_free(kring->tx_pool);
 			kring->tx_pool = NULL;
+			kring->tx_spare = NULL;
 		}
 
 #ifdef RATE_GENERIC
@@ -305,7 +414,7 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	struct netmap_kring *kring = NULL;
 	int error;
-	int i, r;
+	int r;
 
 	if (!na) {
 		return EINVAL;
@@ -333,41 +442,50 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 			/* Init mitigation support. */
 			nm_os_mitigation_init(&gna->mit[r], r, na);
 
+			kring->rx_mring = NULL;
+		}
+		for_each_rx_kring(r, kring, na) {
 			/* Initialize the rx queue, as generic_rx_handler() can
 			 * be called as soon as nm_os_catch_rx() returns.
 			 */
-			mbq_safe_init(&kring->rx_queue);
+			error = generic_rx_mring_init(kring);
+			if (error) {
+				nm_prerr("rx_mring allocation failed");
+				goto free_tx_pools;
+			}
 		}
 
 		/*
 		 * Prepare mbuf pools (parallel to the tx rings), for packet
-		 * transmission. Don't preallocate the mbufs here, it's simpler
-		 * to leave this task to txsync.
+		 * transmission, followed by the spare mbufs used to
+		 * replenish them. The mbufs are preallocated here, so
+		 * that txsync only needs to allocate when events or
+		 * slow drivers keep some of them busy.
 		 */
 		for_each_tx_kring(r, kring, na) {
 			kring->tx_pool = NULL;
 		}
 		for_each_tx_kring(r, kring, na) {
-			kring->tx_pool =
-				nm_os_malloc(na->num_tx_desc * sizeof(struct mbuf *));
+			kring->tx_pool = nm_os_malloc((na->num_tx_desc +
+				NM_GENERIC_TX_SPARE) * sizeof(struct mbuf *));
 			if (!kring->tx_pool) {
 				nm_prerr("tx_pool allocation failed");
 				error = ENOMEM;
 				goto free_tx_pools;
 			}
+			kring->tx_spare = kring->tx_pool + na->num_tx_desc;
+			kring->tx_nspare = 0;
 			mtx_init(&kring->tx_event_lock, "tx_event_lock",
 				 NULL, MTX_SPIN);
+			generic_tx_pool_fill(kring, NETMAP_BUF_SIZE(na));
 		}
 	}
 
 	netmap_krings_mode_commit(na, /*onoff=*/1);
 
 	for_each_tx_kring(r, kring, na) {
-		/* Initialize tx_pool and tx_event. */
-		for (i=0; i<na->num_tx_desc; i++) {
-			kring->tx_pool[i] = NULL;
-		}
-
+		/* Initialize tx_event. The pool entries are not reset,
+		 * since they may still be in use by active rings. */
 		kring->tx_event = NULL;
 	}
 
@@ -412,11 +530,13 @@ free_tx_pools:
 		if (kring->tx_pool == NULL) {
 			continue;
 		}
+		generic_tx_pool_free(kring);
 		nm_os_free(kring->tx_pool);
 		kring->tx_pool = NULL;
+		kring->tx_spare = NULL;
 	}
 	for_each_rx_kring(r, kring, na) {
-		mbq_safe_fini(&kring->rx_queue);
+		generic_rx_mring_fini(kring);
 	}
 	nm_os_free(gna->mit);
 out:
@@ -639,6 +759,25 @@ generic_set_tx_event(struct netmap_kring *kring, u_int hwcur)
 }
 
 
+/* Take an mbuf to replenish the tx pool, from the spare stack if
+ * possible. */
+static inline struct mbuf *
+generic_tx_get_mbuf(struct netmap_kring *kring, u_int len)
+{
+	if (likely(kring->tx_nspare > 0))
+		return kring->tx_spare[--kring->tx_nspare];
+	return nm_os_get_mbuf(kring->na->ifp, len);
+}
+
+/* Send the packets queued in a batch. Returns how many of them,
+ * at the end of the batch, were not sent. */
+static inline u_int
+generic_tx_flush(struct nm_os_gen_arg *a)
+{
+	a->addr = NULL;
+	return nm_os_generic_xmit_frame(a);
+}
+
 /*
  * generic_netmap_txsync() transforms netmap buffers into mbufs
  * and passes them to the standard device driver
@@ -683,6 +822,8 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 		a.ifp = ifp;
 		a.ring_nr = ring_nr;
 		a.head = a.tail = NULL;
+		a.batch = gna->txbatch;
+		a.count = 0;
 
 		while (nm_i != head) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
@@ -699,7 +840,7 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 			m = kring->tx_pool[nm_i];
 			if (unlikely(m == NULL)) {
 				kring->tx_pool[nm_i] = m =
-					nm_os_get_mbuf(ifp, NETMAP_BUF_SIZE(na));
+					generic_tx_get_mbuf(kring, NETMAP_BUF_SIZE(na));
 				if (m == NULL) {
 					nm_prlim(2, "Failed to replenish mbuf");
 					/* Here we could schedule a timer which
@@ -725,6 +866,23 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 			 * the latter case we also break early.
 			 */
 			tx_ret = nm_os_generic_xmit_frame(&a);
+			if (a.batch && !tx_ret) {
+				/* Queued. The batch goes to the driver when
+				 * full or when there is nothing else to send. */
+				slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+				nm_i = nm_next(nm_i, lim);
+				IFRATE(rate_ctx.new.txpkt++);
+				if (a.count < a.batch && nm_i != head) {
+					continue;
+				}
+				tx_ret = generic_tx_flush(&a);
+				if (likely(tx_ret == 0)) {
+					continue;
+				}
+				/* Go back to the first packet not sent, and
+				 * handle it as a single failed transmission. */
+				nm_i = (nm_i + lim + 1 - tx_ret) % (lim + 1);
+			}
 			if (unlikely(tx_ret)) {
 				if (!gna->txqdisc) {
 					/*
@@ -770,12 +928,22 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 			IFRATE(rate_ctx.new.txpkt++);
 		}
 		if (a.head != NULL) {
-			a.addr = NULL;
-			nm_os_generic_xmit_frame(&a);
+			/* With batches, this is only reached if the pool
+			 * could not be replenished. */
+			u_int unsent = generic_tx_flush(&a);
+
+			if (a.batch && unsent) {
+				nm_i = (nm_i + lim + 1 - unsent) % (lim + 1);
+			}
 		}
 		/* Update hwcur to the next slot to transmit. Here nm_i
 		 * is not necessarily head, we could break early. */
 		kring->nr_hwcur = nm_i;
+
+		/* Refill the spare mbufs now that the packets are gone. */
+		if (kring->tx_nspare < NM_GENERIC_TX_SPARE / 2) {
+			generic_tx_pool_fill_spare(kring, NETMAP_BUF_SIZE(na));
+		}
 	}
 
 	/*
@@ -801,8 +969,9 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
  * within the attached network interface
  * in the RX subsystem, so that every mbuf passed up by
  * the driver can be stolen to the network stack.
- * Stolen packets are put in a queue where the
- * generic_netmap_rxsync() callback can extract them.
+ * Stolen packets are put in a ring where the
+ * generic_netmap_rxsync() callback can extract them,
+ * or dropped (and counted) if the ring is full.
  * Returns 1 if the packet was stolen, 0 otherwise.
  */
 int
@@ -813,6 +982,7 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 	struct netmap_kring *kring;
 	u_int work_done;
 	u_int r = MBUF_RXQ(m); /* receive ring number */
+	u_int prod;
 
 	if (r >= na->num_rx_rings) {
 		r = r % na->num_rx_rings;
@@ -832,11 +1002,23 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 		 * support RX scatter-gather. */
 		nm_prlim(2, "Warning: driver pushed up big packet "
 				"(size=%d)", (int)MBUF_LEN(m));
-		m_freem(m);
-	} else if (unlikely(mbq_len(&kring->rx_queue) > 1024)) {
+		mtx_lock_spin(&kring->rx_mring_lock);
+		kring->nkr_rx_drops++;
+		mtx_unlock_spin(&kring->rx_mring_lock);
 		m_freem(m);
 	} else {
-		mbq_safe_enqueue(&kring->rx_queue, m);
+		mtx_lock_spin(&kring->rx_mring_lock);
+		prod = kring->rx_mring_prod;
+		if (unlikely(prod - kring->rx_mring_cons > kring->rx_mring_mask)) {
+			kring->nkr_rx_drops++;
+			mtx_unlock_spin(&kring->rx_mring_lock);
+			m_freem(m);
+		} else {
+			kring->rx_mring[prod & kring->rx_mring_mask] = m;
+			wmb(); /* store the mbuf before publishing it */
+			kring->rx_mring_prod = prod + 1;
+			mtx_unlock_spin(&kring->rx_mring_lock);
+		}
 	}
 
 	if (netmap_generic_mit < 32768) {
@@ -860,10 +1042,12 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 }
 
 /*
- * generic_netmap_rxsync() extracts mbufs from the queue filled by
+ * generic_netmap_rxsync() extracts mbufs from the ring filled by
  * generic_netmap_rx_handler() and puts their content in the netmap
  * receive ring.
- * Access must be protected because the rx handler is asynchronous,
+ * rxsync is the only consumer of the ring, so no lock is needed:
+ * the rx handler publishes new mbufs through rx_mring_prod, and we
+ * give back the room through rx_mring_cons.
  */
 static int
 generic_netmap_rxsync(struct netmap_kring *kring, int flags)
@@ -878,7 +1062,9 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 	/* Adapter-specific variables. */
 	u_int nm_buf_len = NETMAP_BUF_SIZE(na);
-	struct mbq tmpq;
+	struct mbuf **mring = kring->rx_mring;
+	u_int const mask = kring->rx_mring_mask;
+	u_int cons, prod;
 	struct mbuf *m;
 	int avail; /* in bytes */
 	int mlen;
@@ -923,34 +1109,45 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 		avail += lim + 1;
 	avail *= nm_buf_len;
 
-	/* First pass: While holding the lock on the RX mbuf queue,
-	 * extract as many mbufs as they fit the available space,
-	 * and put them in a temporary queue.
-	 * To avoid performing a per-mbuf division (mlen / nm_buf_len) to
-	 * to update avail, we do the update in a while loop that we
-	 * also use to set the RX slots, but without performing the copy. */
-	mbq_init(&tmpq);
-	mbq_lock(&kring->rx_queue);
-	for (n = 0;; n++) {
-		m = mbq_peek(&kring->rx_queue);
-		if (!m) {
-			/* No more packets from the driver. */
-			break;
-		}
+	/* Extract as many mbufs as they fit the available space,
+	 * and copy them into the slots. Only the mbufs published
+	 * before we read rx_mring_prod are considered, the others
+	 * will be picked up by the next rxsync. */
+	cons = kring->rx_mring_cons;
+	prod = kring->rx_mring_prod;
+	rmb(); /* read the mbufs after the producer index */
+	for (n = 0; cons != prod; n++, cons++) {
+		void *nmaddr;
+		int ofs = 0;
 
+		m = mring[cons & mask];
 		mlen = MBUF_LEN(m);
 		if (mlen > avail) {
 			/* No more space in the ring. */
 			break;
 		}
-
-		mbq_dequeue(&kring->rx_queue);
+		if (cons + 1 != prod) {
+			/* warm up the next packet while copying this one */
+			MBUF_PREFETCH(mring[(cons + 1) & mask]);
+		}
 
 		while (mlen) {
+			nmaddr = NMB(na, &ring->slot[nm_i]);
+			/* We only check the address here on generic rx rings. */
+			if (nmaddr == NETMAP_BUF_BASE(na)) { /* Bad buffer */
+				/* Drop the packet, it is not in the ring yet. */
+				m_freem(m);
+				mb();
+				kring->rx_mring_cons = cons + 1;
+				return netmap_ring_reinit(kring);
+			}
+
 			copy = nm_buf_len;
 			if (mlen < copy) {
 				copy = mlen;
 			}
+			m_copydata(m, ofs, copy, nmaddr);
+			ofs += copy;
 			mlen -= copy;
 			avail -= nm_buf_len;
 
@@ -959,47 +1156,16 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 			nm_i = nm_next(nm_i, lim);
 		}
 
-		mbq_enqueue(&tmpq, m);
-	}
-	mbq_unlock(&kring->rx_queue);
-
-	/* Second pass: Drain the temporary queue, going over the used RX slots,
-	 * and perform the copy out of the RX queue lock. */
-	nm_i = kring->nr_hwtail;
-
-	for (;;) {
-		void *nmaddr;
-		int ofs = 0;
-		int morefrag;
-
-		m = mbq_dequeue(&tmpq);
-		if (!m)	{
-			break;
-		}
-
-		do {
-			nmaddr = NMB(na, &ring->slot[nm_i]);
-			/* We only check the address here on generic rx rings. */
-			if (nmaddr == NETMAP_BUF_BASE(na)) { /* Bad buffer */
-				m_freem(m);
-				mbq_purge(&tmpq);
-				mbq_fini(&tmpq);
-				return netmap_ring_reinit(kring);
-			}
-
-			copy = ring->slot[nm_i].len;
-			m_copydata(m, ofs, copy, nmaddr);
-			ofs += copy;
-			morefrag = ring->slot[nm_i].flags & NS_MOREFRAG;
-			nm_i = nm_next(nm_i, lim);
-		} while (morefrag);
-
 		m_freem(m);
 	}
 
-	mbq_fini(&tmpq);
-
 	if (n) {
+		/* Give the room back to the rx handler once per batch.
+		 * The barrier orders our reads of the ring before the
+		 * producer can overwrite the entries. */
+		mb();
+		kring->rx_mring_cons = cons;
+		kring->nkr_rx_pkts += n;
 		kring->nr_hwtail = nm_i;
 		IFRATE(rate_ctx.new.rxpkt += n);
 	}
@@ -485,10 +485,28 @@ struct netmap_kring {
 
 	/* The following fields are for VALE switch support */
 	struct nm_bdg_fwd *nkr_ft;
+	/* ports and rings per port covered by nkr_ft */
+	uint16_t	nkr_ft_ports;
+	uint16_t	nkr_ft_rings;
 	uint32_t	*nkr_leases;
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
 	uint32_t	nkr_hwlease;
 	uint32_t	nkr_lease_idx;
+	/* packets received from the switch (or the driver, for
+	 * emulated adapters), and dropped because the ring or the
+	 * rx_mring was full. On VALE ports they are protected by
+	 * q_lock, on emulated adapters nkr_rx_pkts is updated by
+	 * rxsync and nkr_rx_drops under rx_mring_lock. */
+	uint64_t	nkr_rx_pkts;
+	uint64_t	nkr_rx_drops;
+	/* values of the above at the last stats reset. Only the
+	 * writers update the counters, so they are never zeroed;
+	 * the baselines are protected by NMG_LOCK. */
+	uint64_t	nkr_rx_pkts_base;
+	uint64_t	nkr_rx_drops_base;
+	/* segments coalesced by the VALE GRO into this ring, under
+	 * q_lock (see nm_vale_ft_stats_collect()) */
+	uint64_t	nkr_gro_merged;
 
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
@@ -501,13 +519,27 @@ struct netmap_kring {
 	/* Support for adapters without native netmap support.
 	 * On tx rings we preallocate an array of tx buffers
 	 * (same size as the netmap ring), on rx rings we
-	 * store incoming mbufs in a queue that is drained by
+	 * store incoming mbufs in a ring that is drained by
 	 * a rxsync.
+	 * tx_spare is a stack of preallocated mbufs used to
+	 * replenish tx_pool, refilled after transmission.
+	 * rx_mring is a single consumer ring (the size is a power
+	 * of 2, the indexes are free running): rxsync consumes
+	 * without locks, while rx_mring_lock serializes the
+	 * producers, since several driver queues may be steered
+	 * to the same kring.
 	 */
 	struct mbuf	**tx_pool;
+	struct mbuf	**tx_spare;
+	u_int		tx_nspare;
 	struct mbuf	*tx_event;	/* TX event used as a notification */
 	NM_LOCK_T	tx_event_lock;	/* protects the tx_event mbuf */
 	struct mbq	rx_queue;       /* intercepted rx mbufs. */
+	struct mbuf	**rx_mring;
+	u_int		rx_mring_mask;
+	volatile u_int	rx_mring_prod;
+	volatile u_int	rx_mring_cons;
+	NM_LOCK_T	rx_mring_lock;
 
 	uint32_t	users;		/* existing bindings for this ring */
 
@@ -534,6 +566,8 @@ struct netmap_kring {
 					 * pointer to the other end
 					 */
 	uint32_t pipe_tail;		/* hwtail updated by the other end */
+	uint32_t pipe_need_kick;	/* the owner may sleep, the other
+					 * end must notify it */
 #endif /* WITH_PIPES */
 
 	int (*save_notify)(struct netmap_kring *kring, int flags);
@@ -557,6 +591,16 @@ struct netmap_kring {
 	int (*mon_sync)(struct netmap_kring *kring, int flags);
 	int (*mon_notify)(struct netmap_kring *kring, int flags);
 
+	/* rx rings of copy monitors only: sampling state (see
+	 * NETMAP_REQ_OPT_MONITOR_SAMPLING) and counters, protected
+	 * by the q_lock */
+	uint32_t mon_skip;	/* packets to skip before the next sample */
+	uint32_t mon_tokens;	/* samples left in the current second */
+	uint64_t mon_sec;	/* the current second */
+	uint64_t mon_seen;
+	uint64_t mon_sampled;
+	uint64_t mon_drops;
+
 #endif
 }
 #ifdef _WIN32
@@ -947,6 +991,30 @@ int nma_intr_enable(struct netmap_adapter *na, int onoff);
 #define NETMAP_OWNED_BY_ANY(na) \
 	(NETMAP_OWNED_BY_KERN(na) || ((na)->active_fds > 0))
 
+/*
+ * Learning bridge counters, kept per source port so that senders on
+ * different ports do not share cache lines. NETMAP_REQ_VALE_FTABLE
+ * reports the sum over all the ports of the bridge.
+ */
+struct nm_vale_ft_stats {
+	uint64_t	hits;		/* unicast destination found */
+	uint64_t	misses;		/* unicast destination unknown */
+	uint64_t	evictions;	/* live entries replaced */
+	uint64_t	floods;		/* packets sent to all ports */
+	uint64_t	gro_merged;	/* see nkr_gro_merged */
+};
+
+static inline void
+nm_vale_ft_stats_add(struct nm_vale_ft_stats *dst,
+		const struct nm_vale_ft_stats *src)
+{
+	dst->hits += src->hits;
+	dst->misses += src->misses;
+	dst->evictions += src->evictions;
+	dst->floods += src->floods;
+	dst->gro_merged += src->gro_merged;
+}
+
 /*
  * derived netmap adapters for various types of ports
  */
@@ -966,8 +1034,11 @@ struct netmap_vp_adapter {	/* VALE software port */
 
 	/* Maximum Frame Size, used in bdg_mismatch_datapath() */
 	u_int mfs;
-	/* Last source MAC on this port */
+	/* Last source MAC on this port, with the low 16 bits of the
+	 * epoch of the last refresh in the top 2 bytes. Only a hint:
+	 * if they wrap, the refresh is delayed to the next epoch. */
 	uint64_t last_smac;
+	struct nm_vale_ft_stats ft_stats;
 };
 
 
@@ -1015,6 +1086,10 @@ struct netmap_generic_adapter {	/* emulated device */
 	/* Is the transmission path controlled by a netmap-aware
 	 * device queue (i.e. qdisc on linux)? */
 	int txqdisc;
+
+	/* Max number of frames passed to the driver in a single
+	 * batch, 0 if the OS sends them one by one. */
+	u_int txbatch;
 };
 #endif  /* WITH_GENERIC */
 
@@ -1104,6 +1179,8 @@ int nm_bdg_polling(struct nmreq_header *hdr);
 int netmap_vale_attach(struct nmreq_header *hdr, void *auth_token);
 int netmap_vale_detach(struct nmreq_header *hdr, void *auth_token);
 int netmap_vale_list(struct nmreq_header *hdr);
+int netmap_vale_ftable(struct nmreq_header *hdr);
+int netmap_vale_ring_stats(struct nmreq_header *hdr);
 int netmap_vi_create(struct nmreq_header *hdr, int);
 int nm_vi_create(struct nmreq_header *);
 int nm_vi_destroy(const char *name);
@@ -1176,6 +1253,135 @@ nm_kr_wouldblock(struct netmap_kring *kring)
 	return kring->rcur == kring->nr_hwtail;
 }
 
+/*
+ * Available space in the ring. Only used by VALE and copy monitors,
+ * and only with is_rx = 1
+ */
+static inline uint32_t
+nm_kr_space(struct netmap_kring *k, int is_rx)
+{
+	int space;
+
+	if (is_rx) {
+		int busy = k->nkr_hwlease - k->nr_hwcur;
+		if (busy < 0)
+			busy += k->nkr_num_slots;
+		space = k->nkr_num_slots - 1 - busy;
+	} else {
+		/* XXX never used in this branch */
+		space = k->nr_hwtail - k->nkr_hwlease;
+		if (space < 0)
+			space += k->nkr_num_slots;
+	}
+#if 0
+	// sanity check
+	if (k->nkr_hwlease >= k->nkr_num_slots ||
+		k->nr_hwcur >= k->nkr_num_slots ||
+		k->nr_tail >= k->nkr_num_slots ||
+		busy < 0 ||
+		busy >= k->nkr_num_slots) {
+		nm_prerr("invalid kring, cur %d tail %d lease %d lease_idx %d lim %d",
+		    k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
+		    k->nkr_lease_idx, k->nkr_num_slots);
+	}
+#endif
+	return space;
+}
+
+/* make a lease on the kring for N positions. return the
+ * lease index
+ * XXX only used by VALE and copy monitors, and with is_rx = 1
+ */
+static inline uint32_t
+nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
+{
+	uint32_t lim = k->nkr_num_slots - 1;
+	uint32_t lease_idx = k->nkr_lease_idx;
+
+	k->nkr_leases[lease_idx] = NR_NOSLOT;
+	k->nkr_lease_idx = nm_next(lease_idx, lim);
+
+#ifdef CONFIG_NETMAP_DEBUG
+	if (n > nm_kr_space(k, is_rx)) {
+		nm_prerr("invalid request for %d slots", n);
+		panic("x");
+	}
+#endif /* CONFIG NETMAP_DEBUG */
+	/* XXX verify that there are n slots */
+	k->nkr_hwlease += n;
+	if (k->nkr_hwlease > lim)
+		k->nkr_hwlease -= lim + 1;
+
+#ifdef CONFIG_NETMAP_DEBUG
+	if (k->nkr_hwlease >= k->nkr_num_slots ||
+		k->nr_hwcur >= k->nkr_num_slots ||
+		k->nr_hwtail >= k->nkr_num_slots ||
+		k->nkr_lease_idx >= k->nkr_num_slots) {
+		nm_prerr("invalid kring %s, cur %d tail %d lease %d lease_idx %d lim %d",
+			k->na->name,
+			k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
+			k->nkr_lease_idx, k->nkr_num_slots);
+	}
+#endif /* CONFIG_NETMAP_DEBUG */
+	return lease_idx;
+}
+
+/*
+ * Complete the lease obtained with nm_kr_lease(), where j is the
+ * first slot not filled and howmany the number of reserved slots
+ * left unused. Must be called with the q_lock held. Returns 1 if
+ * nr_hwtail has advanced and the receiver must be notified.
+ */
+static inline int
+nm_kr_lease_complete(struct netmap_kring *kring, uint32_t lease_idx,
+		uint32_t my_start, u_int j, u_int howmany)
+{
+	struct netmap_ring *ring = kring->ring;
+	uint32_t *p = kring->nkr_leases; /* shorthand */
+	u_int lim = kring->nkr_num_slots - 1;
+
+	if (unlikely(howmany > 0)) {
+		/* not used all bufs. If i am the last one
+		 * i can recover the slots, otherwise must
+		 * fill them with 0 to mark empty packets.
+		 */
+		nm_prdis("leftover %d bufs", howmany);
+		if (nm_next(lease_idx, lim) == kring->nkr_lease_idx) {
+			/* yes i am the last one */
+			nm_prdis("roll back nkr_hwlease to %d", j);
+			kring->nkr_hwlease = j;
+		} else {
+			while (howmany-- > 0) {
+				ring->slot[j].len = 0;
+				ring->slot[j].flags = 0;
+				j = nm_next(j, lim);
+			}
+		}
+	}
+	p[lease_idx] = j; /* report I am done */
+
+	if (my_start == kring->nr_hwtail) {
+		/* all slots before my_start have been reported,
+		 * so scan subsequent leases to see if other ranges
+		 * have been completed.
+		 */
+		while (lease_idx != kring->nkr_lease_idx &&
+			p[lease_idx] != NR_NOSLOT) {
+			j = p[lease_idx];
+			p[lease_idx] = NR_NOSLOT;
+			lease_idx = nm_next(lease_idx, lim);
+		}
+		/* j is the new 'write' position. j != my_start
+		 * means there are new buffers to report
+		 */
+		if (likely(j != my_start)) {
+			kring->nr_hwtail = j;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /*
  * protect against multiple threads using the same ring.
  * also check that the ring has not been stopped or locked
@@ -1477,10 +1683,15 @@ int netmap_get_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 void netmap_unget_na(struct netmap_adapter *na, struct ifnet *ifp);
 int netmap_get_hw_na(struct ifnet *ifp,
 		struct netmap_mem_d *nmd, struct netmap_adapter **na);
+void netmap_ring_stats_get(struct netmap_adapter *na,
+		struct nmreq_vale_ring_stats *req);
 
 #ifdef WITH_VALE
 uint32_t netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		struct netmap_vp_adapter *, void *private_data);
+void netmap_vale_learning_batch(struct nm_bdg_fwd **ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *, void *private_data);
 
 /* these are redefined in case of no VALE support */
 int netmap_get_vale_na(struct nmreq_header *hdr, struct netmap_adapter **na,
@@ -1513,6 +1724,7 @@ int netmap_get_pipe_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 int netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		struct netmap_mem_d *nmd, int create);
 void netmap_monitor_stop(struct netmap_adapter *na);
+int netmap_monitor_stats(struct netmap_priv_d *priv, struct nmreq_header *hdr);
 #else
 #define netmap_get_monitor_na(hdr, _2, _3, _4) \
 	(((struct nmreq_register *)(uintptr_t)hdr->nr_body)->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX) ? EOPNOTSUPP : 0)
@@ -1532,11 +1744,13 @@ void netmap_bns_put(struct net *);
 void netmap_bns_getbridges(struct nm_bridge **, u_int *);
 #else
 extern struct nm_bridge *nm_bridges;
+extern u_int nm_num_bridges;
 #define netmap_bns_get()
 #define netmap_bns_put(_1)
 #define netmap_bns_getbridges(b, n) \
-	do { *b = nm_bridges; *n = NM_BRIDGES; } while (0)
+	do { *b = nm_bridges; *n = nm_num_bridges; } while (0)
 #endif
+u_int netmap_bdg_num_bridges(void);
 
 /* Various prototypes */
 int netmap_poll(struct netmap_priv_d *, int events, NM_SELRECORD_T *td);
@@ -1619,8 +1833,10 @@ extern int netmap_generic_hwcsum;
 extern int netmap_generic_mit;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
+extern int netmap_generic_rxqueue;
 #ifdef linux
 extern int netmap_generic_txqdisc;
+extern int netmap_generic_txbatch;
 #endif
 
 /*
@@ -1668,6 +1884,10 @@ extern int netmap_generic_txqdisc;
  * Returns -ENOMEM in case the domain is different */
 #define nm_iommu_group_id(dev) (0)
 
+/* NUMA node of the device, -1 if unknown. 'dev' is a dma tag here,
+ * which does not carry the domain, so we never infer one. */
+#define nm_numa_node(dev) (-1)
+
 /* Callback invoked by the dma machinery after a successful dmamap_load */
 static void netmap_dmamap_cb(__unused void *arg,
     __unused bus_dma_segment_t * segs, __unused int nseg, __unused int error)
@@ -1714,6 +1934,7 @@ netmap_reload_map(struct netmap_adapter *na,
 #else /* linux */
 
 int nm_iommu_group_id(bus_dma_tag_t dev);
+int nm_numa_node(bus_dma_tag_t dev);
 #include <linux/dma-mapping.h>
 
 /*
@@ -1934,6 +2155,9 @@ struct netmap_priv_d {
 #define NM_SYNC_KLOOP_RUNNING	(1 << 0)
 #define NM_SYNC_KLOOP_STOPPING	(1 << 1)
 	int             np_sync_flags; /* to be passed to nm_sync */
+	/* counters of the running kloop, use with NMG_LOCK held */
+	struct sync_kloop_worker *np_kloop_workers;
+	u_int		np_kloop_nworkers;
 
 	int		np_refs;	/* use with NMG_LOCK held */
 
@@ -2009,6 +2233,13 @@ struct netmap_monitor_adapter {
 
 	struct netmap_priv_d priv;
 	uint32_t flags;
+
+	/* copy monitors only, see NETMAP_REQ_OPT_MONITOR_* */
+	struct nm_bpf_insn *filter;	/* NULL to copy everything */
+	uint32_t filter_len;
+	uint32_t snaplen;		/* 0 for no limit */
+	uint32_t sample_rate;		/* 1 to sample all packets */
+	uint32_t sample_pps;		/* 0 for no limit */
 };
 
 #endif /* WITH_MONITOR */
@@ -2036,11 +2267,18 @@ int na_is_generic(struct netmap_adapter *na);
  * At the end, if head is non-null, there will be an additional call
  * to the function with addr = NULL; this should tell the OS-specific
  * routine to send the queue and free any resources. Failure is ignored.
+ *
+ * If batch is not zero, the routine may just queue the packet (counting
+ * it in count), and the caller issues the call with addr = NULL as soon
+ * as batch packets are queued. That call returns the number of packets,
+ * at the end of the queue, that could not be sent.
  */
 struct nm_os_gen_arg {
 	struct ifnet *ifp;
 	void *m;	/* os-specific mbuf-like object */
 	void *head, *tail; /* tailq, if the OS-specific routine needs to build one */
+	u_int batch;	/* max packets to queue, 0 to send each one */
+	u_int count;	/* packets in the queue */
 	void *addr;	/* payload of current packet */
 	u_int len;	/* packet length */
 	u_int ring_nr;	/* packet length */
@@ -2187,6 +2425,12 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   const struct nm_bdg_fwd *ft_p,
 			   struct netmap_ring *dst_ring,
 			   u_int *j, u_int lim, u_int *howmany);
+u_int bdg_gro_datapath(struct netmap_vp_adapter *na,
+			   struct netmap_vp_adapter *dst_na,
+			   struct nm_bdg_fwd *ft, const struct nm_bdg_fwd *ft_p,
+			   u_int *next, u_int brd_next,
+			   struct netmap_ring *dst_ring,
+			   u_int *j, u_int lim, u_int *howmany);
 
 /* persistent virtual port routines */
 int nm_os_vi_persist(const char *, struct ifnet **);
@@ -2218,6 +2462,8 @@ u_int nm_os_ncpus(void);
 int netmap_sync_kloop(struct netmap_priv_d *priv,
 		      struct nmreq_header *hdr);
 int netmap_sync_kloop_stop(struct netmap_priv_d *priv);
+int netmap_sync_kloop_stats(struct netmap_priv_d *priv,
+			    struct nmreq_header *hdr);
 
 #ifdef WITH_PTNETMAP
 /* ptnetmap guest routines */
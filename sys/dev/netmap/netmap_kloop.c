@@ -155,9 +155,18 @@ struct sync_kloop_ring_args {
 	bool busy_wait;
 	/* Are we processing in the context of VM exit ? */
 	bool direct;
+
+	/* State of the adaptive mode, owned by the worker that
+	 * serves the ring. */
+	bool armed;		/* waiting for a notification */
+	uint32_t idle_us;	/* since the ring last had some work,
+				 * up to spin_us */
+	uint32_t backoff_us;	/* current interval between polls */
+	uint32_t wait_us;	/* left before the next poll */
 };
 
-static void
+/* Returns the number of txsync calls. */
+static u_int
 netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 {
 	struct netmap_kring *kring = a->kring;
@@ -166,10 +175,11 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 	struct netmap_ring shadow_ring; /* shadow copy of the netmap_ring */
 	bool more_txspace = false;
 	uint32_t num_slots;
+	u_int syncs = 0;
 	int batch;
 
 	if (unlikely(nm_kr_tryget(kring, 1, NULL))) {
-		return;
+		return 0;
 	}
 
 	num_slots = kring->nkr_num_slots;
@@ -220,6 +230,7 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 			sync_kloop_kring_dump("pre txsync", kring);
 		}
 
+		syncs++;
 		if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
 			if (!a->busy_wait) {
 				/* Reenable notifications. */
@@ -296,6 +307,8 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 		eventfd_signal(a->irq_ctx, 1);
 	}
 #endif /* SYNC_KLOOP_POLL */
+
+	return syncs;
 }
 
 /* RX cycle without receive any packets */
@@ -308,7 +321,8 @@ sync_kloop_norxslots(struct netmap_kring *kring, uint32_t g_head)
 				kring->nkr_num_slots - 1));
 }
 
-static void
+/* Returns the number of rxsync calls. */
+static u_int
 netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 {
 
@@ -319,9 +333,10 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 	int dry_cycles = 0;
 	bool some_recvd = false;
 	uint32_t num_slots;
+	u_int syncs = 0;
 
 	if (unlikely(nm_kr_tryget(kring, 1, NULL))) {
-		return;
+		return 0;
 	}
 
 	num_slots = kring->nkr_num_slots;
@@ -354,6 +369,7 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 			sync_kloop_kring_dump("pre rxsync", kring);
 		}
 
+		syncs++;
 		if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
 			if (!a->busy_wait) {
 				/* Reenable notifications. */
@@ -435,6 +451,209 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 		eventfd_signal(a->irq_ctx, 1);
 	}
 #endif /* SYNC_KLOOP_POLL */
+
+	return syncs;
+}
+
+/* A thread serving a subset of the rings of a kloop: the TX and RX
+ * rings whose index is congruent to id modulo num_workers. Without
+ * NETMAP_REQ_OPT_SYNC_KLOOP_WORKERS there is a single worker, run by
+ * the thread that started the kloop.
+ */
+struct sync_kloop_worker {
+	struct sync_kloop_ring_args *args;
+	int num_tx_rings;
+	int num_rx_rings;
+	u_int id;
+	u_int num_workers;
+	uint32_t sleep_us;
+	bool direct_tx;
+	bool direct_rx;
+	bool can_arm;		/* the rings can wait for notifications */
+	bool adaptive;
+	uint32_t spin_us;
+	uint32_t backoff_max_us;
+	struct nm_kctx *nmk;	/* NULL for the calling thread */
+	struct timeval start;	/* start of the previous pass */
+	struct timeval last;	/* end of the previous pass */
+
+	/* Counters reported by NETMAP_REQ_SYNC_KLOOP_STATS. */
+	uint64_t busy_us;
+	uint64_t idle_us;
+	uint64_t txsyncs;
+	uint64_t rxsyncs;
+};
+
+static inline uint64_t
+sync_kloop_tv_us(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000LL + b->tv_usec - a->tv_usec;
+}
+
+/* Returned by sync_kloop_worker_pass() when all the rings wait for
+ * a notification. */
+#define SYNC_KLOOP_WAIT_NOTIFY	((uint32_t)~0)
+
+static u_int
+sync_kloop_ring_sync(struct sync_kloop_worker *w,
+		     struct sync_kloop_ring_args *a, bool tx)
+{
+	u_int syncs;
+
+	if (tx) {
+		syncs = netmap_sync_kloop_tx_ring(a);
+		w->txsyncs += syncs;
+	} else {
+		syncs = netmap_sync_kloop_rx_ring(a);
+		w->rxsyncs += syncs;
+	}
+	return syncs;
+}
+
+/* Poll ring a in adaptive mode, elapsed microseconds after the
+ * previous pass. Rings that had some work are polled again on the
+ * next pass; idle rings are left alone for an interval that doubles
+ * up to backoff_max_us, and then they wait for a kick from the
+ * application (or an interrupt from the adapter). Returns how long
+ * the ring can be left alone.
+ */
+static uint32_t
+sync_kloop_adaptive_ring(struct sync_kloop_worker *w,
+			 struct sync_kloop_ring_args *a, uint32_t elapsed,
+			 bool tx)
+{
+	struct netmap_kring *kring = a->kring;
+	uint32_t hwcur, hwtail;
+
+	if (!a->armed && a->wait_us > elapsed) {
+		a->wait_us -= elapsed;
+		return a->wait_us;
+	}
+
+	/* Armed rings are synced as in notification mode, so that
+	 * kicks are enabled again (with a double check) if there is
+	 * still nothing to do. */
+	hwcur = kring->nr_hwcur;
+	hwtail = NM_ACCESS_ONCE(kring->nr_hwtail);
+	a->busy_wait = !a->armed;
+	sync_kloop_ring_sync(w, a, tx);
+	if (kring->nr_hwcur == hwcur &&
+	    NM_ACCESS_ONCE(kring->nr_hwtail) == hwtail) {
+		if (a->armed)
+			return SYNC_KLOOP_WAIT_NOTIFY;
+		if (a->idle_us < w->spin_us) {
+			/* saturate at spin_us, a ring that cannot be
+			 * armed may stay idle for hours */
+			if (elapsed < w->spin_us - a->idle_us) {
+				a->idle_us += elapsed;
+				return 0;
+			}
+			a->idle_us = w->spin_us;
+		}
+		a->backoff_us = a->backoff_us ? 2 * a->backoff_us : 1;
+		if (a->backoff_us < w->backoff_max_us || !w->can_arm) {
+			if (a->backoff_us > w->backoff_max_us)
+				a->backoff_us = w->backoff_max_us;
+			a->wait_us = a->backoff_us;
+			return a->wait_us;
+		}
+		/* Idle for long enough, sync once more to enable the
+		 * notifications. */
+		a->busy_wait = false;
+		sync_kloop_ring_sync(w, a, tx);
+		if (kring->nr_hwcur == hwcur &&
+		    NM_ACCESS_ONCE(kring->nr_hwtail) == hwtail) {
+			a->armed = true;
+			return SYNC_KLOOP_WAIT_NOTIFY;
+		}
+	}
+
+	/* Some work, spin. */
+	if (a->armed || !a->busy_wait) {
+		csb_ktoa_kick_enable(a->csb_ktoa, 0);
+	}
+	a->armed = false;
+	a->idle_us = a->backoff_us = a->wait_us = 0;
+	return 0;
+}
+
+/* Process once the rings of worker w. The time since the previous
+ * pass is accounted as idle. Returns how long to sleep before the
+ * next pass, or SYNC_KLOOP_WAIT_NOTIFY.
+ */
+static uint32_t
+sync_kloop_worker_pass(struct sync_kloop_worker *w)
+{
+	uint32_t next = w->can_arm ? SYNC_KLOOP_WAIT_NOTIFY : w->sleep_us;
+	uint32_t elapsed = 0;
+	struct timeval t0, t1;
+	int i;
+
+	microtime(&t0);
+	if (w->last.tv_sec) {
+		elapsed = sync_kloop_tv_us(&w->last, &t0);
+		w->idle_us += elapsed;
+	}
+	if (w->adaptive) {
+		/* the sleep is chosen by the rings */
+		next = SYNC_KLOOP_WAIT_NOTIFY;
+		elapsed += sync_kloop_tv_us(&w->start, &w->last);
+	}
+
+	/* Process the TX rings of this worker. */
+	for (i = w->id; !w->direct_tx && i < w->num_tx_rings;
+			i += w->num_workers) {
+		struct sync_kloop_ring_args *a = w->args + i;
+
+		if (w->adaptive) {
+			uint32_t wait = sync_kloop_adaptive_ring(w, a,
+						elapsed, true);
+
+			if (wait < next)
+				next = wait;
+		} else {
+			sync_kloop_ring_sync(w, a, true);
+		}
+	}
+
+	/* Process the RX rings of this worker. */
+	for (i = w->id; !w->direct_rx && i < w->num_rx_rings;
+			i += w->num_workers) {
+		struct sync_kloop_ring_args *a = w->args +
+						w->num_tx_rings + i;
+
+		if (w->adaptive) {
+			uint32_t wait = sync_kloop_adaptive_ring(w, a,
+						elapsed, false);
+
+			if (wait < next)
+				next = wait;
+		} else {
+			sync_kloop_ring_sync(w, a, false);
+		}
+	}
+
+	microtime(&t1);
+	w->busy_us += sync_kloop_tv_us(&t0, &t1);
+	w->start = t0;
+	w->last = t1;
+
+	if (next == SYNC_KLOOP_WAIT_NOTIFY && !w->can_arm) {
+		/* all the rings are handled directly */
+		next = w->sleep_us;
+	}
+	return next;
+}
+
+/* Body of the kernel threads, called in a loop by nm_kctx. */
+static void
+sync_kloop_worker_fn(void *data)
+{
+	struct sync_kloop_worker *w = data;
+	uint32_t next;
+
+	next = sync_kloop_worker_pass(w);
+	usleep_range(next, next);
 }
 
 #ifdef SYNC_KLOOP_POLL
@@ -563,12 +782,16 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 	struct nmreq_sync_kloop_start *req =
 		(struct nmreq_sync_kloop_start *)(uintptr_t)hdr->nr_body;
 	struct nmreq_opt_sync_kloop_eventfds *eventfds_opt = NULL;
+	struct nmreq_opt_sync_kloop_workers *workers_opt = NULL;
+	struct sync_kloop_worker *workers = NULL;
+	u_int num_workers = 1;
 #ifdef SYNC_KLOOP_POLL
 	struct sync_kloop_poll_ctx *poll_ctx = NULL;
 #endif  /* SYNC_KLOOP_POLL */
 	int num_rx_rings, num_tx_rings, num_rings;
 	struct sync_kloop_ring_args *args = NULL;
 	uint32_t sleep_us = req->sleep_us;
+	uint32_t next_us;
 	struct nm_csb_atok* csb_atok_base;
 	struct nm_csb_ktoa* csb_ktoa_base;
 	struct netmap_adapter *na;
@@ -577,6 +800,8 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 	bool busy_wait = true;
 	bool direct_tx = false;
 	bool direct_rx = false;
+	bool adaptive = false;
+	uint32_t spin_us = 0, backoff_max_us = 0;
 	int err = 0;
 	int i;
 
@@ -656,11 +881,22 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 
 		direct_tx = !!(mode_opt->mode & NM_OPT_SYNC_KLOOP_DIRECT_TX);
 		direct_rx = !!(mode_opt->mode & NM_OPT_SYNC_KLOOP_DIRECT_RX);
+		adaptive = !!(mode_opt->mode & NM_OPT_SYNC_KLOOP_ADAPTIVE);
 		if (mode_opt->mode & ~(NM_OPT_SYNC_KLOOP_DIRECT_TX |
-		    NM_OPT_SYNC_KLOOP_DIRECT_RX)) {
+		    NM_OPT_SYNC_KLOOP_DIRECT_RX | NM_OPT_SYNC_KLOOP_ADAPTIVE)) {
 			opt->nro_status = err = EINVAL;
 			goto out;
 		}
+		if (adaptive) {
+			if (opt->nro_size < sizeof(*mode_opt) ||
+			    mode_opt->spin_us > 1000000 ||
+			    mode_opt->backoff_max_us > 1000000) {
+				opt->nro_status = err = EINVAL;
+				goto out;
+			}
+			spin_us = mode_opt->spin_us;
+			backoff_max_us = mode_opt->backoff_max_us;
+		}
 		opt->nro_status = 0;
 	}
 	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_SYNC_KLOOP_EVENTFDS);
@@ -809,9 +1045,86 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 #endif  /* SYNC_KLOOP_POLL */
 	}
 
+	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_SYNC_KLOOP_WORKERS);
+	if (opt != NULL) {
+		int first_cpu;
+
+		workers_opt = (struct nmreq_opt_sync_kloop_workers *)opt;
+		num_workers = workers_opt->nro_num_workers;
+		first_cpu = workers_opt->nro_first_cpu;
+		if (eventfds_opt != NULL || num_workers == 0 ||
+		    num_workers > NM_SYNC_KLOOP_WORKERS_MAX ||
+		    (num_workers > num_tx_rings && num_workers > num_rx_rings) ||
+		    (first_cpu >= 0 &&
+		     first_cpu + num_workers > nm_os_ncpus())) {
+			/* Workers only support the sleeping strategy,
+			 * and each of them must have some rings. */
+			opt->nro_status = err = EINVAL;
+			goto out;
+		}
+		opt->nro_status = 0;
+	}
+
+	workers = nm_os_malloc(num_workers * sizeof(workers[0]));
+	if (!workers) {
+		err = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_workers; i++) {
+		struct sync_kloop_worker *w = workers + i;
+
+		w->args = args;
+		w->num_tx_rings = num_tx_rings;
+		w->num_rx_rings = num_rx_rings;
+		w->id = i;
+		w->num_workers = num_workers;
+		w->sleep_us = sleep_us;
+		w->direct_tx = direct_tx;
+		w->direct_rx = direct_rx;
+		w->can_arm = !busy_wait;
+		w->adaptive = adaptive;
+		w->spin_us = spin_us;
+		w->backoff_max_us = backoff_max_us;
+	}
+	NMG_LOCK();
+	priv->np_kloop_workers = workers;
+	priv->np_kloop_nworkers = num_workers;
+	NMG_UNLOCK();
+
+	if (workers_opt != NULL) {
+		struct nm_kctx_cfg kcfg;
+
+		bzero(&kcfg, sizeof(kcfg));
+		kcfg.worker_fn = sync_kloop_worker_fn;
+		kcfg.attach_user = 1; /* to access the CSB */
+		for (i = 0; i < num_workers; i++) {
+			struct sync_kloop_worker *w = workers + i;
+
+			kcfg.type = i;
+			kcfg.worker_private = w;
+			w->nmk = nm_os_kctx_create(&kcfg, NULL);
+			if (w->nmk == NULL) {
+				err = ENOMEM;
+				goto out;
+			}
+			if (workers_opt->nro_first_cpu >= 0) {
+				nm_os_kctx_worker_setaff(w->nmk,
+				    workers_opt->nro_first_cpu + i);
+			}
+			err = nm_os_kctx_worker_start(w->nmk);
+			if (err) {
+				nm_prerr("kloop worker %d failed to start (%d)",
+				    i, err);
+				goto out;
+			}
+		}
+	}
+
 	nm_prinf("kloop busy_wait %u, direct_tx %u, direct_rx %u, "
-	    "na_could_sleep %u", busy_wait, direct_tx, direct_rx,
-	    na_could_sleep);
+	    "na_could_sleep %u, workers %u, adaptive %u (%u/%u us)",
+	    busy_wait, direct_tx, direct_rx, na_could_sleep,
+	    workers_opt ? num_workers : 0, adaptive, spin_us,
+	    backoff_max_us);
 
 	/* Main loop. */
 	for (;;) {
@@ -819,6 +1132,13 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 			break;
 		}
 
+		if (workers_opt != NULL) {
+			/* The rings are served by the workers, we only
+			 * wait for NETMAP_REQ_SYNC_KLOOP_STOP. */
+			usleep_range(1000, 1500);
+			continue;
+		}
+
 #ifdef SYNC_KLOOP_POLL
 		if (!busy_wait) {
 			/* It is important to set the task state as
@@ -834,21 +1154,19 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 		}
 #endif  /* SYNC_KLOOP_POLL */
 
-		/* Process all the TX rings bound to this file descriptor. */
-		for (i = 0; !direct_tx && i < num_tx_rings; i++) {
-			struct sync_kloop_ring_args *a = args + i;
-			netmap_sync_kloop_tx_ring(a);
-		}
-
-		/* Process all the RX rings bound to this file descriptor. */
-		for (i = 0; !direct_rx && i < num_rx_rings; i++) {
-			struct sync_kloop_ring_args *a = args + num_tx_rings + i;
-			netmap_sync_kloop_rx_ring(a);
-		}
+		/* Process all the rings bound to this file descriptor. */
+		next_us = sync_kloop_worker_pass(workers);
 
-		if (busy_wait) {
-			/* Default synchronization method: sleep for a while. */
-			usleep_range(sleep_us, sleep_us);
+		if (next_us != SYNC_KLOOP_WAIT_NOTIFY) {
+			/* Default synchronization method: sleep for a while,
+			 * or until the next ring must be polled in adaptive
+			 * mode. */
+#ifdef SYNC_KLOOP_POLL
+			if (!busy_wait) {
+				__set_current_state(TASK_RUNNING);
+			}
+#endif /* SYNC_KLOOP_POLL */
+			usleep_range(next_us, next_us);
 		}
 #ifdef SYNC_KLOOP_POLL
 		else {
@@ -859,6 +1177,19 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 #endif /* SYNC_KLOOP_POLL */
 	}
 out:
+	if (workers) {
+		/* Stop the workers before the ring arguments go away. */
+		for (i = 0; i < num_workers; i++) {
+			nm_os_kctx_destroy(workers[i].nmk);
+		}
+		NMG_LOCK();
+		priv->np_kloop_workers = NULL;
+		priv->np_kloop_nworkers = 0;
+		NMG_UNLOCK();
+		nm_os_free(workers);
+		workers = NULL;
+	}
+
 #ifdef SYNC_KLOOP_POLL
 	if (poll_ctx) {
 		/* Stop polling from netmap and the eventfds, and deallocate
@@ -942,6 +1273,36 @@ netmap_sync_kloop_stop(struct netmap_priv_d *priv)
 	return err;
 }
 
+/* Process NETMAP_REQ_SYNC_KLOOP_STATS. The counters are updated by
+ * the workers without locks, so they may be slightly stale. */
+int
+netmap_sync_kloop_stats(struct netmap_priv_d *priv, struct nmreq_header *hdr)
+{
+	struct nmreq_sync_kloop_stats *req =
+		(struct nmreq_sync_kloop_stats *)(uintptr_t)hdr->nr_body;
+	int err = 0;
+	u_int i;
+
+	NMG_LOCK();
+	if (priv->np_kloop_workers == NULL) {
+		err = ENOENT;
+		goto out;
+	}
+	for (i = 0; i < priv->np_kloop_nworkers; i++) {
+		struct sync_kloop_worker *w = priv->np_kloop_workers + i;
+
+		req->nr_workers[i].nr_busy_us = w->busy_us;
+		req->nr_workers[i].nr_idle_us = w->idle_us;
+		req->nr_workers[i].nr_txsyncs = w->txsyncs;
+		req->nr_workers[i].nr_rxsyncs = w->rxsyncs;
+	}
+	req->nr_num_workers = i;
+out:
+	NMG_UNLOCK();
+
+	return err;
+}
+
 #ifdef WITH_PTNETMAP
 /*
  * Guest ptnetmap txsync()/rxsync() routines, used in ptnet device drivers.
@@ -53,6 +53,17 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 241723 2012-10-19 09:41:45Z gle
 #include <net/if_var.h>
 #include <net/vnet.h>
 #include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/domainset.h>
+#include <vm/vm_phys.h>	/* vm_ndomains */
+
+/* prefer memory from NUMA domain 'node' (-1 means any) */
+#define contigmalloc_node(sz, ty, flags, node, align)			\
+	((node) < 0 || (node) >= vm_ndomains ?				\
+	    contigmalloc(sz, ty, flags, (size_t)0, -1UL, align, 0) :	\
+	    contigmalloc_domainset(sz, ty, DOMAINSET_PREF(node), flags,	\
+		(size_t)0, -1UL, align, 0))
+/* NUMA domain of memory returned by contigmalloc_node() */
+#define contig_node(va)	vm_phys_domain(vtophys(va))
 
 /* M_NETMAP only used in here */
 MALLOC_DECLARE(M_NETMAP);
@@ -89,11 +100,20 @@ enum {
 struct netmap_obj_params {
 	u_int size;
 	u_int num;
+	u_int huge;	/* use NM_HUGEPAGE_SIZE clusters if possible */
 
 	u_int last_size;
 	u_int last_num;
+	u_int last_huge;
 };
 
+/* size of the clusters used in hugepage mode */
+#ifdef linux
+#define NM_HUGEPAGE_SIZE	PMD_SIZE
+#else
+#define NM_HUGEPAGE_SIZE	(1U << 21)	/* 2 MB */
+#endif
+
 struct netmap_obj_pool {
 	char name[NETMAP_POOL_MAX_NAMSZ];	/* name of the allocator */
 
@@ -110,7 +130,11 @@ struct netmap_obj_pool {
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
 	uint32_t *invalid_bitmap;/* one bit per buffer, 1 means invalid */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
+	uint32_t bitmap_hint;	/* no free objects in the entries before this */
 	int	alloc_done;	/* we have allocated the memory */
+	int	numa_node;	/* node the clusters were requested on, or -1 */
+	int	numa_used;	/* node they are on, -1 if unknown or mixed */
+	int	huge;		/* clusters are aligned NM_HUGEPAGE_SIZE pages */
 	/* ---------------------------------------------------*/
 
 	/* limits */
@@ -172,6 +196,8 @@ struct netmap_mem_d {
 
 	nm_memid_t nm_id;	/* allocator identifier */
 	int nm_grp;	/* iommu groupd id */
+	int nm_numa;	/* NUMA node of the first device, -1 if unknown */
+	int numa_node;	/* requested NUMA node, -1 to follow nm_numa */
 
 	/* list of all existing allocators, sorted by nm_id */
 	struct netmap_mem_d *prev, *next;
@@ -388,6 +414,21 @@ nm_isset(uint32_t *bitmap, u_int i)
 	return bitmap[ (i>>5) ] & ( 1U << (i & 31U) );
 }
 
+/* index of the lowest bit set in x, which must not be 0 */
+static inline u_int
+nm_ffs32(uint32_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctz(x);
+#else
+	u_int i;
+
+	for (i = 0; (x & 1) == 0; i++)
+		x >>= 1;
+	return i;
+#endif
+}
+
 
 static int
 netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
@@ -409,19 +450,29 @@ netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
 	}
 
 	p->objfree = 0;
+	p->bitmap_hint = 0;
 	/*
 	 * Set all the bits in the bitmap that have
 	 * corresponding buffers to 1 to indicate they are
 	 * free.
 	 */
-	for (j = 0; j < p->objtotal; j++) {
-		if (p->invalid_bitmap && nm_isset(p->invalid_bitmap, j)) {
-			if (netmap_debug & NM_DEBUG_MEM)
-				nm_prinf("skipping %s %d", p->name, j);
-			continue;
+	if (p->invalid_bitmap == NULL) {
+		/* whole words first, then the tail */
+		for (j = 0; j < p->objtotal / 32; j++)
+			p->bitmap[j] = ~0U;
+		if (p->objtotal % 32)
+			p->bitmap[j] = (1U << (p->objtotal % 32)) - 1;
+		p->objfree = p->objtotal;
+	} else {
+		for (j = 0; j < p->objtotal; j++) {
+			if (nm_isset(p->invalid_bitmap, j)) {
+				if (netmap_debug & NM_DEBUG_MEM)
+					nm_prinf("skipping %s %d", p->name, j);
+				continue;
+			}
+			p->bitmap[ (j>>5) ] |=  ( 1U << (j & 31U) );
+			p->objfree++;
 		}
-		p->bitmap[ (j>>5) ] |=  ( 1U << (j & 31U) );
-		p->objfree++;
 	}
 
 	if (netmap_verbose)
@@ -488,6 +539,7 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 	nmd->active--;
 	if (last_user) {
 		nmd->nm_grp = -1;
+		nmd->nm_numa = -1;
 		nmd->lasterr = 0;
 	}
 
@@ -574,6 +626,8 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 
 	.nm_id = 1,
 	.nm_grp = -1,
+	.nm_numa = -1,
+	.numa_node = -1,
 
 	.prev = &nm_mem,
 	.next = &nm_mem,
@@ -612,6 +666,8 @@ static const struct netmap_mem_d nm_blueprint = {
 	},
 
 	.nm_grp = -1,
+	.nm_numa = -1,
+	.numa_node = -1,
 
 	.flags = NETMAP_MEM_PRIVATE,
 
@@ -646,6 +702,15 @@ DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
 
+SYSBEGIN(mem2_numa);
+SYSCTL_INT(_dev_netmap, OID_AUTO, numa_node,
+    CTLFLAG_RW, &nm_mem.numa_node, 0,
+    "NUMA node for the global allocator (-1: node of the first device)");
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_hugepages,
+    CTLFLAG_RW, &nm_mem.params[NETMAP_BUF_POOL].huge, 0,
+    "Build the global buffer pool out of hugepage clusters");
+SYSEND;
+
 /* call with nm_mem_list_lock held */
 static int
 nm_mem_assign_id_locked(struct netmap_mem_d *nmd)
@@ -736,6 +801,9 @@ nm_mem_assign_group(struct netmap_mem_d *nmd, struct device *dev)
 	if (nmd->nm_grp < 0)
 		nmd->nm_grp = id;
 
+	if (nmd->nm_numa < 0 && dev)
+		nmd->nm_numa = nm_numa_node(dev);
+
 	if (nmd->nm_grp != id) {
 		if (netmap_verbose)
 			nm_prerr("iommu group mismatch: %u vs %u",
@@ -1005,6 +1073,9 @@ netmap_mem2_if_offset(struct netmap_mem_d *nmd, const void *addr)
 /*
  * report the index, and use start position as a hint,
  * otherwise buffer allocation becomes terribly expensive.
+ * The scan never starts before p->bitmap_hint, which skips the
+ * entries filled up by previous allocations (e.g. the rings of
+ * other ports), and advances it when it started from there.
  */
 static void *
 netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_t *index)
@@ -1012,6 +1083,7 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 	uint32_t i = 0;			/* index in the bitmap */
 	uint32_t mask, j = 0;		/* slot counter */
 	void *vaddr = NULL;
+	int from_hint;
 
 	if (len > p->_objsize) {
 		nm_prerr("%s request size %d too large", p->name, len);
@@ -1024,6 +1096,9 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 	}
 	if (start)
 		i = *start;
+	if (i <= p->bitmap_hint)
+		i = p->bitmap_hint;
+	from_hint = (i == p->bitmap_hint);
 
 	/* termination is guaranteed by p->free, but better check bounds on i */
 	while (vaddr == NULL && i < p->bitmap_slots)  {
@@ -1033,8 +1108,8 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 			continue;
 		}
 		/* locate a slot */
-		for (j = 0, mask = 1; (cur & mask) == 0; j++, mask <<= 1)
-			;
+		j = nm_ffs32(cur);
+		mask = 1U << j;
 
 		p->bitmap[i] &= ~mask; /* mark object as in use */
 		p->objfree--;
@@ -1045,6 +1120,8 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 	}
 	nm_prdis("%s allocator: allocated object @ [%d][%d]: vaddr %p",p->name, i, j, vaddr);
 
+	if (from_hint)
+		p->bitmap_hint = i;
 	if (start)
 		*start = i;
 	return vaddr;
@@ -1072,6 +1149,8 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 	} else {
 		*ptr |= mask;
 		p->objfree++;
+		if (j / 32 < p->bitmap_hint)
+			p->bitmap_hint = j / 32;
 		return 0;
 	}
 }
@@ -1314,7 +1393,8 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
 
 /* call with NMA_LOCK held */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+		u_int objsize, int huge)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -1348,13 +1428,28 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 			objtotal, p->nummin, p->nummax);
 		return EINVAL;
 	}
+	/*
+	 * In hugepage mode each cluster is exactly one hugepage,
+	 * which must then hold an integer number of objects.
+	 */
+	p->huge = 0;
+	if (huge) {
+		if (NM_HUGEPAGE_SIZE <= MAX_CLUSTSIZE &&
+		    NM_HUGEPAGE_SIZE % objsize == 0) {
+			p->huge = 1;
+		} else {
+			nm_prerr("%d bytes objects do not fit hugepages, "
+				"using regular clusters for '%s'",
+				objsize, p->name);
+		}
+	}
 	/*
 	 * Compute number of objects using a brute-force approach:
 	 * given a max cluster size,
 	 * we try to fill it with objects keeping track of the
 	 * wasted space to the next page boundary.
 	 */
-	for (clustentries = 0, i = 1;; i++) {
+	for (clustentries = 0, i = 1; !p->huge; i++) {
 		u_int delta, used = i * objsize;
 		if (used > MAX_CLUSTSIZE)
 			break;
@@ -1364,6 +1459,8 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 			break;
 		}
 	}
+	if (p->huge)
+		clustentries = NM_HUGEPAGE_SIZE / objsize;
 	/* exact solution not found */
 	if (clustentries == 0) {
 		nm_prerr("unsupported allocation for %d bytes", objsize);
@@ -1392,7 +1489,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 
 /* call with NMA_LOCK held */
 static int
-netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
+netmap_finalize_obj_allocator(struct netmap_obj_pool *p, int node)
 {
 	int i; /* must be signed */
 	size_t n;
@@ -1412,6 +1509,8 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
 	p->alloc_done = 1;
+	p->numa_node = node;
+	p->numa_used = -1;
 
 	p->lut = nm_alloc_lut(p->objtotal);
 	if (p->lut == NULL) {
@@ -1435,15 +1534,15 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * can live with standard malloc, because the hardware will not
 		 * access the pages directly.
 		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		clust = contigmalloc_node(n, M_NETMAP, M_NOWAIT | M_ZERO, node,
+		    p->huge ? n : PAGE_SIZE);
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
 			 * so halve the allocated memory to reclaim some.
 			 */
-			nm_prerr("Unable to create cluster at %d for '%s' allocator",
-			    i, p->name);
+			nm_prerr("Unable to create %scluster at %d for '%s' allocator",
+			    p->huge ? "hugepage " : "", i, p->name);
 			if (i < 2) /* nothing to halve */
 				goto out;
 			lim = i / 2;
@@ -1459,6 +1558,11 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 			p->numclusters = (i + p->_clustentries - 1) / p->_clustentries;
 			break;
 		}
+		/* the allocator may fall back to other nodes */
+		if (i == 0)
+			p->numa_used = contig_node(clust);
+		else if (p->numa_used != contig_node(clust))
+			p->numa_used = -1;
 		/*
 		 * Set lut state for all buffers in the current cluster.
 		 *
@@ -1496,9 +1600,11 @@ netmap_mem_params_changed(struct netmap_obj_params* p)
 	int i, rv = 0;
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		if (p[i].last_size != p[i].size || p[i].last_num != p[i].num) {
+		if (p[i].last_size != p[i].size || p[i].last_num != p[i].num ||
+		    p[i].last_huge != p[i].huge) {
 			p[i].last_size = p[i].size;
 			p[i].last_num = p[i].num;
+			p[i].last_huge = p[i].huge;
 			rv = 1;
 		}
 	}
@@ -1618,16 +1724,26 @@ netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
 	return error;
 }
 
+/* NUMA node for the next allocation: an explicit request
+ * wins over the node of the device. Call with lock held. */
+static inline int
+netmap_mem_numa_node(struct netmap_mem_d *nmd)
+{
+	return nmd->numa_node >= 0 ? nmd->numa_node : nmd->nm_numa;
+}
+
 static int
 netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 {
-	int i;
+	int i, node;
 	if (nmd->flags & NETMAP_MEM_FINALIZED)
 		return 0;
 	nmd->lasterr = 0;
 	nmd->nm_totalsize = 0;
+	node = netmap_mem_numa_node(nmd);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
+		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i],
+				node);
 		if (nmd->lasterr)
 			goto error;
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
@@ -1639,10 +1755,10 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	nmd->flags |= NETMAP_MEM_FINALIZED;
 
 	if (netmap_verbose)
-		nm_prinf("interfaces %d KB, rings %d KB, buffers %d MB",
+		nm_prinf("interfaces %d KB, rings %d KB, buffers %d MB, node %d",
 		    nmd->pools[NETMAP_IF_POOL].memtotal >> 10,
 		    nmd->pools[NETMAP_RING_POOL].memtotal >> 10,
-		    nmd->pools[NETMAP_BUF_POOL].memtotal >> 20);
+		    nmd->pools[NETMAP_BUF_POOL].memtotal >> 20, node);
 
 	if (netmap_verbose)
 		nm_prinf("Free buffers: %d", nmd->pools[NETMAP_BUF_POOL].objfree);
@@ -1770,9 +1886,14 @@ netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
 static int
 netmap_mem2_config(struct netmap_mem_d *nmd)
 {
-	int i;
+	int i, node, numa_changed;
 
-	if (!netmap_mem_params_changed(nmd->params))
+	/* idle pools sitting on the wrong node are reallocated too */
+	node = netmap_mem_numa_node(nmd);
+	numa_changed = node >= 0 && (nmd->flags & NETMAP_MEM_FINALIZED) &&
+		nmd->pools[NETMAP_BUF_POOL].alloc_done &&
+		nmd->pools[NETMAP_BUF_POOL].numa_node != node;
+	if (!netmap_mem_params_changed(nmd->params) && !numa_changed)
 		goto out;
 
 	nm_prdis("reconfiguring");
@@ -1787,7 +1908,8 @@ netmap_mem2_config(struct netmap_mem_d *nmd)
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				nmd->params[i].num, nmd->params[i].size);
+				nmd->params[i].num, nmd->params[i].size,
+				nmd->params[i].huge);
 		if (nmd->lasterr)
 			goto out;
 	}
@@ -2087,6 +2209,38 @@ struct netmap_mem_ops netmap_mem_global_ops = {
 	.nmd_rings_delete = netmap_mem2_rings_delete
 };
 
+/*
+ * Report the range of the shared memory made of hugepage clusters
+ * (each *pgsz bytes long and aligned), so that the OS can map it
+ * with large pages. Returns ENOENT if there is no such range.
+ */
+int
+netmap_mem_get_hugepages(struct netmap_mem_d *nmd, uint64_t *ofs,
+		uint64_t *len, u_int *pgsz)
+{
+	struct netmap_obj_pool *p;
+	uint64_t o = 0;
+	int i, ret = ENOENT;
+
+	NMA_LOCK(nmd);
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED))
+		goto out;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		p = &nmd->pools[i];
+		if (p->huge && p->alloc_done) {
+			*ofs = o;
+			*len = p->memtotal;
+			*pgsz = p->_clustsize;
+			ret = 0;
+			break;
+		}
+		o += p->memtotal;
+	}
+out:
+	NMA_UNLOCK(nmd);
+	return ret;
+}
+
 int
 netmap_mem_pools_info_get(struct nmreq_pools_info *req,
 				struct netmap_mem_d *nmd)
@@ -2112,6 +2266,21 @@ netmap_mem_pools_info_get(struct nmreq_pools_info *req,
 			     nmd->pools[NETMAP_RING_POOL].memtotal;
 	req->nr_buf_pool_objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
 	req->nr_buf_pool_objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+
+	/* all the pools are allocated together. Report the node the
+	 * buffers actually ended up on, which may differ from the
+	 * requested one (fallbacks, invalid nodes) */
+	req->nr_pools_flags = 0;
+	req->nr_numa_node = 0;
+	if (nmd->pools[NETMAP_BUF_POOL].alloc_done &&
+	    nmd->pools[NETMAP_BUF_POOL].numa_node >= 0 &&
+	    nmd->pools[NETMAP_BUF_POOL].numa_used >= 0) {
+		req->nr_pools_flags |= NR_POOLS_NUMA_NODE;
+		req->nr_numa_node = nmd->pools[NETMAP_BUF_POOL].numa_used;
+	}
+	if (nmd->pools[NETMAP_BUF_POOL].alloc_done &&
+	    nmd->pools[NETMAP_BUF_POOL].huge)
+		req->nr_pools_flags |= NR_POOLS_BUF_HUGEPAGES;
 	NMA_UNLOCK(nmd);
 
 	return 0;
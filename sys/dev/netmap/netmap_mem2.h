@@ -169,6 +169,8 @@ int netmap_mem_pt_guest_ifp_del(struct netmap_mem_d *, struct ifnet *);
 
 int netmap_mem_pools_info_get(struct nmreq_pools_info *,
 				struct netmap_mem_d *);
+int netmap_mem_get_hugepages(struct netmap_mem_d *, uint64_t *ofs,
+				uint64_t *len, u_int *pgsz);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
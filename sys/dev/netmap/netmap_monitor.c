@@ -165,15 +165,29 @@ netmap_monitor_rxsync(struct netmap_kring *kring, int flags)
 }
 
 /* nm_krings_create callbacks for monitors.
+ * Copy monitors also get leases on their rx rings, since several
+ * monitored krings may be copying into them at the same time.
  */
 static int
 netmap_monitor_krings_create(struct netmap_adapter *na)
 {
-	int error = netmap_krings_create(na, 0);
+	u_int nrx = netmap_real_rings(na, NR_RX);
+	u_int tailroom = nm_is_zmon(na) ? 0 :
+		sizeof(uint32_t) * na->num_rx_desc * nrx;
+	int error = netmap_krings_create(na, tailroom);
 	enum txrx t;
 
 	if (error)
 		return error;
+	if (tailroom) {
+		uint32_t *leases = na->tailroom;
+		u_int i;
+
+		for (i = 0; i < nrx; i++) {
+			na->rx_rings[i]->nkr_leases = leases;
+			leases += na->num_rx_desc;
+		}
+	}
 	/* override the host rings callbacks */
 	for_rx_tx(t) {
 		int i;
@@ -716,79 +730,607 @@ netmap_zmon_dtor(struct netmap_adapter *na)
 	netmap_adapter_put(pna);
 }
 
+/*
+ ****************************************************************
+ * packet filters for copy monitors
+ ****************************************************************
+ */
+
+/*
+ * A classic BPF machine, enough to run the programs produced by
+ * pcap_compile(). Programs are checked by nm_bpf_validate() when the
+ * monitor is registered, so nm_bpf_run() only needs to check the
+ * packet accesses.
+ */
+#define NM_BPF_MEMWORDS	16
+
+/* instruction classes */
+#define NM_BPF_LD	0x00
+#define NM_BPF_LDX	0x01
+#define NM_BPF_ST	0x02
+#define NM_BPF_STX	0x03
+#define NM_BPF_ALU	0x04
+#define NM_BPF_JMP	0x05
+#define NM_BPF_RET	0x06
+#define NM_BPF_MISC	0x07
+#define NM_BPF_CLASS(code)	((code) & 0x07)
+/* ld/ldx sizes and modes */
+#define NM_BPF_W	0x00
+#define NM_BPF_H	0x08
+#define NM_BPF_B	0x10
+#define NM_BPF_IMM	0x00
+#define NM_BPF_ABS	0x20
+#define NM_BPF_IND	0x40
+#define NM_BPF_MEM	0x60
+#define NM_BPF_LEN	0x80
+#define NM_BPF_MSH	0xa0
+/* alu and jmp operations */
+#define NM_BPF_ADD	0x00
+#define NM_BPF_SUB	0x10
+#define NM_BPF_MUL	0x20
+#define NM_BPF_DIV	0x30
+#define NM_BPF_OR	0x40
+#define NM_BPF_AND	0x50
+#define NM_BPF_LSH	0x60
+#define NM_BPF_RSH	0x70
+#define NM_BPF_NEG	0x80
+#define NM_BPF_MOD	0x90
+#define NM_BPF_XOR	0xa0
+#define NM_BPF_JA	0x00
+#define NM_BPF_JEQ	0x10
+#define NM_BPF_JGT	0x20
+#define NM_BPF_JGE	0x30
+#define NM_BPF_JSET	0x40
+/* operands */
+#define NM_BPF_K	0x00
+#define NM_BPF_X	0x08
+#define NM_BPF_A	0x10
+#define NM_BPF_TAX	0x00
+#define NM_BPF_TXA	0x80
+
+#define NM_BPF_ALU_CASES(op)					\
+	case NM_BPF_ALU | (op) | NM_BPF_K:			\
+	case NM_BPF_ALU | (op) | NM_BPF_X
+#define NM_BPF_JMP_CASES(op)					\
+	case NM_BPF_JMP | (op) | NM_BPF_K:			\
+	case NM_BPF_JMP | (op) | NM_BPF_X
+
+static int
+nm_bpf_validate(const struct nm_bpf_insn *f, u_int n)
+{
+	u_int i;
+
+	if (n == 0 || n > NM_BPF_MAXINSNS)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		const struct nm_bpf_insn *p = &f[i];
+		u_int left = n - i - 1; /* instructions after this one */
+
+		switch (p->code) {
+		case NM_BPF_LD | NM_BPF_W | NM_BPF_ABS:
+		case NM_BPF_LD | NM_BPF_H | NM_BPF_ABS:
+		case NM_BPF_LD | NM_BPF_B | NM_BPF_ABS:
+		case NM_BPF_LD | NM_BPF_W | NM_BPF_IND:
+		case NM_BPF_LD | NM_BPF_H | NM_BPF_IND:
+		case NM_BPF_LD | NM_BPF_B | NM_BPF_IND:
+		case NM_BPF_LD | NM_BPF_W | NM_BPF_LEN:
+		case NM_BPF_LD | NM_BPF_IMM:
+		case NM_BPF_LDX | NM_BPF_W | NM_BPF_IMM:
+		case NM_BPF_LDX | NM_BPF_W | NM_BPF_LEN:
+		case NM_BPF_LDX | NM_BPF_B | NM_BPF_MSH:
+		NM_BPF_ALU_CASES(NM_BPF_ADD):
+		NM_BPF_ALU_CASES(NM_BPF_SUB):
+		NM_BPF_ALU_CASES(NM_BPF_MUL):
+		NM_BPF_ALU_CASES(NM_BPF_OR):
+		NM_BPF_ALU_CASES(NM_BPF_AND):
+		NM_BPF_ALU_CASES(NM_BPF_XOR):
+		NM_BPF_ALU_CASES(NM_BPF_LSH):
+		NM_BPF_ALU_CASES(NM_BPF_RSH):
+		case NM_BPF_ALU | NM_BPF_DIV | NM_BPF_X:
+		case NM_BPF_ALU | NM_BPF_MOD | NM_BPF_X:
+		case NM_BPF_ALU | NM_BPF_NEG:
+		case NM_BPF_MISC | NM_BPF_TAX:
+		case NM_BPF_MISC | NM_BPF_TXA:
+		case NM_BPF_RET | NM_BPF_K:
+		case NM_BPF_RET | NM_BPF_A:
+			break;
+		case NM_BPF_LD | NM_BPF_MEM:
+		case NM_BPF_LDX | NM_BPF_W | NM_BPF_MEM:
+		case NM_BPF_ST:
+		case NM_BPF_STX:
+			if (p->k >= NM_BPF_MEMWORDS)
+				return 0;
+			break;
+		case NM_BPF_ALU | NM_BPF_DIV | NM_BPF_K:
+		case NM_BPF_ALU | NM_BPF_MOD | NM_BPF_K:
+			if (p->k == 0)
+				return 0;
+			break;
+		case NM_BPF_JMP | NM_BPF_JA:
+			if (p->k >= left)
+				return 0;
+			break;
+		NM_BPF_JMP_CASES(NM_BPF_JEQ):
+		NM_BPF_JMP_CASES(NM_BPF_JGT):
+		NM_BPF_JMP_CASES(NM_BPF_JGE):
+		NM_BPF_JMP_CASES(NM_BPF_JSET):
+			if (p->jt >= left || p->jf >= left)
+				return 0;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return NM_BPF_CLASS(f[n - 1].code) == NM_BPF_RET;
+}
+
+/* true if 'sz' bytes at offset 'k' are within the packet */
+#define NM_BPF_INPKT(k, sz, len)	((k) < (len) && (sz) <= (len) - (k))
+
+static u_int
+nm_bpf_run(const struct nm_bpf_insn *pc, const uint8_t *p, u_int len)
+{
+	uint32_t A = 0, X = 0, k;
+	/* programs may load from mem before storing to it */
+	uint32_t mem[NM_BPF_MEMWORDS] = { 0 };
+
+	for (;; pc++) {
+		switch (pc->code) {
+		default:
+			return 0; /* not reached on validated programs */
+		case NM_BPF_RET | NM_BPF_K:
+			return pc->k;
+		case NM_BPF_RET | NM_BPF_A:
+			return A;
+
+		case NM_BPF_LD | NM_BPF_W | NM_BPF_ABS:
+			k = pc->k;
+		ld_w:
+			if (!NM_BPF_INPKT(k, 4, len))
+				return 0;
+			A = ((uint32_t)p[k] << 24) | ((uint32_t)p[k + 1] << 16) |
+				((uint32_t)p[k + 2] << 8) | p[k + 3];
+			break;
+		case NM_BPF_LD | NM_BPF_H | NM_BPF_ABS:
+			k = pc->k;
+		ld_h:
+			if (!NM_BPF_INPKT(k, 2, len))
+				return 0;
+			A = ((uint32_t)p[k] << 8) | p[k + 1];
+			break;
+		case NM_BPF_LD | NM_BPF_B | NM_BPF_ABS:
+			k = pc->k;
+		ld_b:
+			if (!NM_BPF_INPKT(k, 1, len))
+				return 0;
+			A = p[k];
+			break;
+		case NM_BPF_LD | NM_BPF_W | NM_BPF_IND:
+			k = X + pc->k;
+			if (k < X)
+				return 0;
+			goto ld_w;
+		case NM_BPF_LD | NM_BPF_H | NM_BPF_IND:
+			k = X + pc->k;
+			if (k < X)
+				return 0;
+			goto ld_h;
+		case NM_BPF_LD | NM_BPF_B | NM_BPF_IND:
+			k = X + pc->k;
+			if (k < X)
+				return 0;
+			goto ld_b;
+		case NM_BPF_LD | NM_BPF_W | NM_BPF_LEN:
+			A = len;
+			break;
+		case NM_BPF_LD | NM_BPF_IMM:
+			A = pc->k;
+			break;
+		case NM_BPF_LD | NM_BPF_MEM:
+			A = mem[pc->k];
+			break;
+		case NM_BPF_LDX | NM_BPF_W | NM_BPF_IMM:
+			X = pc->k;
+			break;
+		case NM_BPF_LDX | NM_BPF_W | NM_BPF_LEN:
+			X = len;
+			break;
+		case NM_BPF_LDX | NM_BPF_W | NM_BPF_MEM:
+			X = mem[pc->k];
+			break;
+		case NM_BPF_LDX | NM_BPF_B | NM_BPF_MSH:
+			if (!NM_BPF_INPKT(pc->k, 1, len))
+				return 0;
+			X = (p[pc->k] & 0xf) << 2;
+			break;
+		case NM_BPF_ST:
+			mem[pc->k] = A;
+			break;
+		case NM_BPF_STX:
+			mem[pc->k] = X;
+			break;
+
+		case NM_BPF_JMP | NM_BPF_JA:
+			pc += pc->k;
+			break;
+		case NM_BPF_JMP | NM_BPF_JEQ | NM_BPF_K:
+			pc += (A == pc->k) ? pc->jt : pc->jf;
+			break;
+		case NM_BPF_JMP | NM_BPF_JGT | NM_BPF_K:
+			pc += (A > pc->k) ? pc->jt : pc->jf;
+			break;
+		case NM_BPF_JMP | NM_BPF_JGE | NM_BPF_K:
+			pc += (A >= pc->k) ? pc->jt : pc->jf;
+			break;
+		case NM_BPF_JMP | NM_BPF_JSET | NM_BPF_K:
+			pc += (A & pc->k) ? pc->jt : pc->jf;
+			break;
+		case NM_BPF_JMP | NM_BPF_JEQ | NM_BPF_X:
+			pc += (A == X) ? pc->jt : pc->jf;
+			break;
+		case NM_BPF_JMP | NM_BPF_JGT | NM_BPF_X:
+			pc += (A > X) ? pc->jt : pc->jf;
+			break;
+		case NM_BPF_JMP | NM_BPF_JGE | NM_BPF_X:
+			pc += (A >= X) ? pc->jt : pc->jf;
+			break;
+		case NM_BPF_JMP | NM_BPF_JSET | NM_BPF_X:
+			pc += (A & X) ? pc->jt : pc->jf;
+			break;
+
+		case NM_BPF_ALU | NM_BPF_ADD | NM_BPF_K:
+			A += pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_SUB | NM_BPF_K:
+			A -= pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_MUL | NM_BPF_K:
+			A *= pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_DIV | NM_BPF_K:
+			A /= pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_MOD | NM_BPF_K:
+			A %= pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_OR | NM_BPF_K:
+			A |= pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_AND | NM_BPF_K:
+			A &= pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_XOR | NM_BPF_K:
+			A ^= pc->k;
+			break;
+		case NM_BPF_ALU | NM_BPF_LSH | NM_BPF_K:
+			A = pc->k < 32 ? A << pc->k : 0;
+			break;
+		case NM_BPF_ALU | NM_BPF_RSH | NM_BPF_K:
+			A = pc->k < 32 ? A >> pc->k : 0;
+			break;
+		case NM_BPF_ALU | NM_BPF_ADD | NM_BPF_X:
+			A += X;
+			break;
+		case NM_BPF_ALU | NM_BPF_SUB | NM_BPF_X:
+			A -= X;
+			break;
+		case NM_BPF_ALU | NM_BPF_MUL | NM_BPF_X:
+			A *= X;
+			break;
+		case NM_BPF_ALU | NM_BPF_DIV | NM_BPF_X:
+			if (X == 0)
+				return 0;
+			A /= X;
+			break;
+		case NM_BPF_ALU | NM_BPF_MOD | NM_BPF_X:
+			if (X == 0)
+				return 0;
+			A %= X;
+			break;
+		case NM_BPF_ALU | NM_BPF_OR | NM_BPF_X:
+			A |= X;
+			break;
+		case NM_BPF_ALU | NM_BPF_AND | NM_BPF_X:
+			A &= X;
+			break;
+		case NM_BPF_ALU | NM_BPF_XOR | NM_BPF_X:
+			A ^= X;
+			break;
+		case NM_BPF_ALU | NM_BPF_LSH | NM_BPF_X:
+			A = X < 32 ? A << X : 0;
+			break;
+		case NM_BPF_ALU | NM_BPF_RSH | NM_BPF_X:
+			A = X < 32 ? A >> X : 0;
+			break;
+		case NM_BPF_ALU | NM_BPF_NEG:
+			A = -A;
+			break;
+
+		case NM_BPF_MISC | NM_BPF_TAX:
+			X = A;
+			break;
+		case NM_BPF_MISC | NM_BPF_TXA:
+			A = X;
+			break;
+		}
+	}
+}
+
+/* parse NETMAP_REQ_OPT_MONITOR_FILTER, NETMAP_REQ_OPT_MONITOR_SNAPLEN
+ * and NETMAP_REQ_OPT_MONITOR_SAMPLING */
+static int
+netmap_monitor_options(struct nmreq_header *hdr,
+		struct netmap_monitor_adapter *mna, int zcopy)
+{
+	struct nmreq_option *opt;
+
+	mna->sample_rate = 1;
+	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_MONITOR_SAMPLING);
+	if (opt != NULL) {
+		struct nmreq_opt_monitor_sampling *s =
+			(struct nmreq_opt_monitor_sampling *)opt;
+
+		if (zcopy) {
+			opt->nro_status = EINVAL;
+			return EINVAL;
+		}
+		if (s->nro_rate > 1)
+			mna->sample_rate = s->nro_rate;
+		mna->sample_pps = s->nro_pps;
+		opt->nro_status = 0;
+	}
+
+	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_MONITOR_SNAPLEN);
+	if (opt != NULL) {
+		struct nmreq_opt_monitor_snaplen *s =
+			(struct nmreq_opt_monitor_snaplen *)opt;
+
+		/* zero-copy monitors see the actual buffers */
+		if (zcopy || s->nro_snaplen == 0) {
+			opt->nro_status = EINVAL;
+			return EINVAL;
+		}
+		mna->snaplen = s->nro_snaplen;
+		opt->nro_status = 0;
+	}
+
+	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_MONITOR_FILTER);
+	if (opt != NULL) {
+		struct nmreq_opt_monitor_filter *f =
+			(struct nmreq_opt_monitor_filter *)opt;
+		size_t sz;
+
+		if (zcopy || f->nro_ninsns == 0 ||
+		    f->nro_ninsns > NM_BPF_MAXINSNS) {
+			opt->nro_status = EINVAL;
+			return EINVAL;
+		}
+		sz = f->nro_ninsns * sizeof(struct nm_bpf_insn);
+		if (sizeof(*f) + sz > opt->nro_size ||
+		    !nm_bpf_validate(f->nro_insns, f->nro_ninsns)) {
+			nm_prerr("invalid monitor filter");
+			opt->nro_status = EINVAL;
+			return EINVAL;
+		}
+		mna->filter = nm_os_malloc(sz);
+		if (mna->filter == NULL) {
+			opt->nro_status = ENOMEM;
+			return ENOMEM;
+		}
+		memcpy(mna->filter, f->nro_insns, sz);
+		mna->filter_len = f->nro_ninsns;
+		opt->nro_status = 0;
+	}
+
+	return 0;
+}
+
 /*
  ****************************************************************
  * functions specific for copy monitors
  ****************************************************************
  */
 
+/* packets examined for each reservation in the monitor ring */
+#define NM_MON_BATCH	32
+
+/* a packet of the monitored ring, as seen before copying it */
+struct nm_mon_pkt {
+	u_int bytes;	/* bytes to copy, 0 if filtered out */
+	u_int slots;	/* slots of the packet in the monitored ring */
+	u_int need;	/* slots needed in the monitor ring */
+};
+
+/*
+ * Runs the filter on the packet that starts at slot b of the monitored
+ * ring and spans at most n slots, and computes how many monitor slots
+ * are needed to copy it. The monitored ring is owned by the caller,
+ * so no lock is needed.
+ */
+static void
+nm_mon_inspect(struct netmap_kring *kring, struct netmap_monitor_adapter *mna,
+		u_int b, u_int n, u_int max_len, struct nm_mon_pkt *p)
+{
+	struct netmap_slot *s = &kring->ring->slot[b];
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int left = mna->snaplen ? mna->snaplen : ~0U; /* per packet */
+
+	if (mna->filter != NULL) {
+		u_int ret = nm_bpf_run(mna->filter,
+				(const uint8_t *)NMB(kring->na, s), s->len);
+
+		if (left > ret)
+			left = ret;
+	}
+	p->bytes = left;
+	p->slots = p->need = 0;
+	for (;;) {
+		u_int len = s->len;
+
+		if (left > 0) {
+			/* same arithmetic as the copy loop */
+			if (len > max_len)
+				len = max_len;
+			if (len > left)
+				len = left;
+			left -= len;
+			p->need++;
+		}
+		p->slots++;
+		if (p->slots == n || !(s->flags & NS_MOREFRAG))
+			break;
+		b = nm_next(b, lim);
+		s = &kring->ring->slot[b];
+	}
+}
+
+/*
+ * Sampling decision for the next packet of the monitored ring.
+ * Called with the q_lock of the monitor ring held.
+ */
+static int
+nm_mon_sample(struct netmap_kring *mkring, struct netmap_monitor_adapter *mna)
+{
+	if (mkring->mon_skip > 0) {
+		mkring->mon_skip--;
+		return 0;
+	}
+	mkring->mon_skip = mna->sample_rate - 1;
+	if (mna->sample_pps) {
+		if (mkring->mon_tokens == 0)
+			return 0;
+		mkring->mon_tokens--;
+	}
+	return 1;
+}
+
 static void
 netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_slots)
 {
+	struct nm_mon_pkt pkt[NM_MON_BATCH];
+	struct netmap_ring *ring = kring->ring;
+	u_int lim = kring->nkr_num_slots - 1;
 	u_int j;
 
 	for (j = 0; j < kring->n_monitors; j++) {
 		struct netmap_kring *mkring = kring->monitors[j];
-		u_int i, mlim, beg;
-		int free_slots, busy, sent = 0, m;
-		u_int lim = kring->nkr_num_slots - 1;
-		struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
-		u_int max_len = NETMAP_BUF_SIZE(mkring->na);
-
-		mlim = mkring->nkr_num_slots - 1;
-
-		/* we need to lock the monitor receive ring, since it
-		 * is the target of bot tx and rx traffic from the monitored
-		 * adapter
-		 */
-		mtx_lock(&mkring->q_lock);
-		/* get the free slots available on the monitor ring */
-		i = mkring->nr_hwtail;
-		busy = i - mkring->nr_hwcur;
-		if (busy < 0)
-			busy += mkring->nkr_num_slots;
-		free_slots = mlim - busy;
-
-		if (!free_slots)
-			goto out;
-
-		/* copy min(free_slots, new_slots) slots */
-		m = new_slots;
-		beg = first_new;
-		if (free_slots < m) {
-			beg += (m - free_slots);
-			if (beg >= kring->nkr_num_slots)
-				beg -= kring->nkr_num_slots;
-			m = free_slots;
-		}
-
-		for ( ; m; m--) {
-			struct netmap_slot *s = &ring->slot[beg];
-			struct netmap_slot *ms = &mring->slot[i];
-			u_int copy_len = s->len;
-			char *src = NMB(kring->na, s),
-			     *dst = NMB(mkring->na, ms);
-
-			if (unlikely(copy_len > max_len)) {
-				nm_prlim(5, "%s->%s: truncating %d to %d", kring->name,
-						mkring->name, copy_len, max_len);
-				copy_len = max_len;
+		struct netmap_monitor_adapter *mna =
+			(struct netmap_monitor_adapter *)mkring->na;
+		struct netmap_ring *mring = mkring->ring;
+		u_int mlim = mkring->nkr_num_slots - 1;
+		u_int max_len = NETMAP_BUF_SIZE(mkring->na); /* per slot */
+		int sampling = mna->sample_rate > 1 || mna->sample_pps;
+		u_int beg = first_new, m = new_slots;
+		int notify = 0;
+		struct timeval now;
+
+		if (mna->sample_pps)
+			microtime(&now);
+
+		while (m > 0) {
+			u_int npkts, k, b, n, i, want, space, sent = 0, drops = 0;
+			uint32_t lease_idx = 0, my_start = 0;
+
+			/* filter verdicts and sizes first, so that
+			 * we reserve exactly the slots we fill */
+			for (npkts = 0, b = beg, n = m;
+			    n > 0 && npkts < NM_MON_BATCH; npkts++) {
+				nm_mon_inspect(kring, mna, b, n, max_len,
+						&pkt[npkts]);
+				n -= pkt[npkts].slots;
+				b += pkt[npkts].slots;
+				if (b > lim)
+					b -= lim + 1;
 			}
 
-			memcpy(dst, src, copy_len);
-			ms->len = copy_len;
-			ms->flags = s->flags;
-			sent++;
-
-			beg = nm_next(beg, lim);
-			i = nm_next(i, mlim);
+			/* the monitor receive ring is the target of both tx
+			 * and rx traffic from the monitored adapter. As in
+			 * VALE, the lock is only held to reserve a range of
+			 * slots and to publish it, and the copies are done
+			 * without it.
+			 */
+			mtx_lock(&mkring->q_lock);
+			if (mna->sample_pps &&
+			    mkring->mon_sec != (uint64_t)now.tv_sec) {
+				/* a new second, a new budget */
+				mkring->mon_sec = now.tv_sec;
+				mkring->mon_tokens = mna->sample_pps;
+			}
+			space = nm_kr_space(mkring, 1);
+			for (want = 0, k = 0; k < npkts; k++) {
+				struct nm_mon_pkt *p = &pkt[k];
+
+				/* sampling is applied before the filter */
+				if (sampling && !nm_mon_sample(mkring, mna)) {
+					p->need = 0;
+				} else if (p->need > 0 &&
+				    want + p->need > space) {
+					drops++;
+					p->need = 0;
+				} else if (p->need > 0) {
+					want += p->need;
+					sent++;
+				}
+			}
+			if (want > 0) {
+				my_start = mkring->nkr_hwlease;
+				lease_idx = nm_kr_lease(mkring, want, 1);
+			}
+			mkring->mon_seen += npkts;
+			mkring->mon_sampled += sent;
+			mkring->mon_drops += drops;
+			mtx_unlock(&mkring->q_lock);
+
+			for (i = my_start, k = 0; k < npkts; k++) {
+				struct nm_mon_pkt *p = &pkt[k];
+				u_int pass = p->bytes, ns;
+
+				b = beg;
+				beg += p->slots;
+				if (beg > lim)
+					beg -= lim + 1;
+				m -= p->slots;
+				for (ns = 0; ns < p->need; ns++) {
+					struct netmap_slot *s = &ring->slot[b];
+					struct netmap_slot *ms = &mring->slot[i];
+					u_int copy_len = s->len;
+
+					if (unlikely(copy_len > max_len)) {
+						nm_prlim(5, "%s->%s: truncating %d to %d",
+							kring->name, mkring->name,
+							copy_len, max_len);
+						copy_len = max_len;
+					}
+					if (copy_len > pass)
+						copy_len = pass;
+
+					memcpy(NMB(mkring->na, ms),
+						NMB(kring->na, s), copy_len);
+					ms->len = copy_len;
+					ms->flags = s->flags;
+					pass -= copy_len;
+					if (pass == 0) {
+						/* this is the last slot we copy */
+						ms->flags &= ~NS_MOREFRAG;
+					}
+					b = nm_next(b, lim);
+					i = nm_next(i, mlim);
+				}
+			}
+			if (want == 0)
+				continue;
+
+			mb();
+			mtx_lock(&mkring->q_lock);
+			if (nm_kr_lease_complete(mkring, lease_idx,
+					my_start, i, 0))
+				notify = 1;
+			mtx_unlock(&mkring->q_lock);
 		}
-		mb();
-		mkring->nr_hwtail = i;
-	out:
-		mtx_unlock(&mkring->q_lock);
 
-		if (sent) {
+		if (notify) {
 			/* notify the new frames to the monitor */
 			mkring->nm_notify(mkring, 0);
 		}
@@ -880,6 +1422,44 @@ netmap_monitor_reg(struct netmap_adapter *na, int onoff)
 	return netmap_monitor_reg_common(na, onoff, 0 /* no zcopy */);
 }
 
+/* Process NETMAP_REQ_MONITOR_STATS on a control device bound to a
+ * copy monitor. */
+int
+netmap_monitor_stats(struct netmap_priv_d *priv, struct nmreq_header *hdr)
+{
+	struct nmreq_monitor_stats *req =
+		(struct nmreq_monitor_stats *)(uintptr_t)hdr->nr_body;
+	struct netmap_adapter *na;
+	int error = 0;
+	u_int i;
+
+	NMG_LOCK();
+	na = priv->np_na;
+	if (na == NULL || na->nm_register != netmap_monitor_reg ||
+	    na->rx_rings == NULL) {
+		error = EINVAL;
+		goto out;
+	}
+	req->nr_seen = req->nr_sampled = req->nr_drops = 0;
+	for (i = 0; i < netmap_real_rings(na, NR_RX); i++) {
+		struct netmap_kring *kring = na->rx_rings[i];
+
+		mtx_lock(&kring->q_lock);
+		req->nr_seen += kring->mon_seen;
+		req->nr_sampled += kring->mon_sampled;
+		req->nr_drops += kring->mon_drops;
+		if (req->nr_flags & NR_MONITOR_STATS_RESET) {
+			kring->mon_seen = 0;
+			kring->mon_sampled = 0;
+			kring->mon_drops = 0;
+		}
+		mtx_unlock(&kring->q_lock);
+	}
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
 static void
 netmap_monitor_dtor(struct netmap_adapter *na)
 {
@@ -888,6 +1468,8 @@ netmap_monitor_dtor(struct netmap_adapter *na)
 	struct netmap_priv_d *priv = &mna->priv;
 	struct netmap_adapter *pna = priv->np_na;
 
+	if (mna->filter)
+		nm_os_free(mna->filter);
 	netmap_adapter_put(pna);
 }
 
@@ -949,6 +1531,10 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	}
 	mna->priv.np_na = pna;
 
+	error = netmap_monitor_options(hdr, mna, zcopy);
+	if (error)
+		goto free_out;
+
 	/* grab all the rings we need in the parent */
 	error = netmap_interp_ringid(&mna->priv, req->nr_mode, req->nr_ringid,
 					req->nr_flags);
@@ -1034,6 +1620,8 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 mem_put_out:
 	netmap_mem_put(mna->up.nm_mem);
 free_out:
+	if (mna->filter)
+		nm_os_free(mna->filter);
 	nm_os_free(mna);
 put_out:
 	netmap_unget_na(pna, ifp);
@@ -64,71 +64,286 @@
 
 
 
-/* This routine is called by bdg_mismatch_datapath() when it finishes
- * accumulating bytes for a segment, in order to fix some fields in the
- * segment headers (which still contain the same content as the header
- * of the original GSO packet). 'pkt' points to the beginning of the IP
- * header of the segment, while 'len' is the length of the IP packet.
+/*
+ * Internet checksum (RFC 1071) of data being copied. The sum is
+ * accumulated in memory order over 64 bit words with end-around
+ * carry, so it does not depend on the host byte order and the folded
+ * value can be stored as is. Folding the sum into the copy saves the
+ * second pass over the segment that the nm_os_csum_*() helpers need.
  */
-static void
-gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
-		u_int idx, u_int segmented_bytes, u_int last_segment)
+typedef uint64_t nm_csum_t;
+
+static inline nm_csum_t
+nm_csum_add(nm_csum_t sum, uint64_t w)
 {
-	struct nm_iphdr *iph = (struct nm_iphdr *)(pkt);
-	struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(pkt);
-	uint16_t *check = NULL;
-	uint8_t *check_data = NULL;
+	sum += w;
+	return sum + (sum < w);
+}
 
-	if (ipv4) {
-		/* Set the IPv4 "Total Length" field. */
-		iph->tot_len = htobe16(len);
-		nm_prdis("ip total length %u", be16toh(ip->tot_len));
+/* Fold to 16 bits, not complemented. */
+static inline uint16_t
+nm_csum_fold(nm_csum_t sum)
+{
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t)sum;
+}
 
-		/* Set the IPv4 "Identification" field. */
-		iph->id = htobe16(be16toh(iph->id) + idx);
-		nm_prdis("ip identification %u", be16toh(iph->id));
+/* Add the partial sum of a block that starts at offset 'ofs' of the
+ * checksummed data: blocks at odd offsets are byte swapped.
+ */
+static inline nm_csum_t
+nm_csum_block_add(nm_csum_t sum, nm_csum_t part, u_int ofs)
+{
+	if (ofs & 1) {
+		uint16_t p = nm_csum_fold(part);
 
-		/* Compute and insert the IPv4 header checksum. */
-		iph->check = 0;
-		iph->check = nm_os_csum_ipv4(iph);
-		nm_prdis("IP csum %x", be16toh(iph->check));
+		part = (uint16_t)((p << 8) | (p >> 8));
+	}
+	return nm_csum_add(sum, part);
+}
+
+/* Copy 'len' bytes from 'src' to 'dst' and add them to 'sum'.
+ * Unaligned accesses go through memcpy() of constant size, which
+ * compiles to plain loads and stores.
+ */
+static nm_csum_t
+nm_csum_copy(uint8_t *dst, const uint8_t *src, size_t len, nm_csum_t sum)
+{
+	uint64_t w[4];
+
+	for (; len >= sizeof(w); len -= sizeof(w)) {
+		memcpy(w, src, sizeof(w));
+		memcpy(dst, w, sizeof(w));
+		sum = nm_csum_add(sum, w[0]);
+		sum = nm_csum_add(sum, w[1]);
+		sum = nm_csum_add(sum, w[2]);
+		sum = nm_csum_add(sum, w[3]);
+		src += sizeof(w);
+		dst += sizeof(w);
+	}
+	for (; len >= sizeof(w[0]); len -= sizeof(w[0])) {
+		memcpy(w, src, sizeof(w[0]));
+		memcpy(dst, w, sizeof(w[0]));
+		sum = nm_csum_add(sum, w[0]);
+		src += sizeof(w[0]);
+		dst += sizeof(w[0]);
+	}
+	if (len) {
+		/* the tail is summed as a zero padded word */
+		w[0] = 0;
+		memcpy(w, src, len);
+		memcpy(dst, w, len);
+		sum = nm_csum_add(sum, w[0]);
+	}
+	return sum;
+}
+
+/* Same as above, without the copy (for headers). */
+static nm_csum_t
+nm_csum_buf(const uint8_t *buf, size_t len, nm_csum_t sum)
+{
+	uint64_t w;
+
+	for (; len >= sizeof(w); len -= sizeof(w)) {
+		memcpy(&w, buf, sizeof(w));
+		sum = nm_csum_add(sum, w);
+		buf += sizeof(w);
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, buf, len);
+		sum = nm_csum_add(sum, w);
+	}
+	return sum;
+}
+
+/*
+ * Header template of a GSO packet. It is built once per packet by
+ * gso_tmpl_init(), copied in front of every segment and then patched
+ * by gso_tmpl_finish() with the fields that change per segment.
+ */
+struct gso_tmpl {
+	const uint8_t	*hdr;		/* headers in the source frag */
+	u_int		hdr_len;	/* Ethernet + IP + TCP/UDP */
+	u_int		ethhlen;	/* 14, or 18 with 802.1q */
+	u_int		iphlen;		/* including IPv4 options */
+	u_int		ipv4;
+	u_int		tcp;
+	u_int		seg_len;	/* max bytes per segment */
+	uint16_t	ip_id;		/* host order, IPv4 only */
+	uint32_t	tcp_seq;	/* host order */
+	nm_csum_t	pseudo;		/* pseudo header, but the length */
+};
+
+/* Parse the headers of a GSO packet, which must be all contained in
+ * the first source fragment. Returns 0 on success, -1 if the packet
+ * must be dropped.
+ */
+static int
+gso_tmpl_init(struct gso_tmpl *t, const struct nm_vnet_hdr *vh,
+		const uint8_t *src, size_t src_len, u_int mfs)
+{
+	uint16_t ethertype;
+	uint16_t proto;
+
+	memset(t, 0, sizeof(*t));
+	t->hdr = src;
+	t->ethhlen = 14;
+	t->tcp = ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
+			== VIRTIO_NET_HDR_GSO_UDP) ? 0 : 1;
+	proto = t->tcp ? 6 : 17;
+
+	/* Look at the 'Ethertype' field to see if this packet is IPv4
+	 * or IPv6, taking into account VLAN encapsulation. */
+	for (;;) {
+		if (src_len < t->ethhlen) {
+			nm_prlim(1, "Short GSO fragment [eth], dropping");
+			return -1;
+		}
+		memcpy(&ethertype, src + t->ethhlen - 2, sizeof(ethertype));
+		ethertype = be16toh(ethertype);
+		if (ethertype != 0x8100) /* not 802.1q */
+			break;
+		t->ethhlen += 4;
+	}
+	nm_prdis(3, "type=%04x", ethertype);
+
+	switch (ethertype) {
+	case 0x0800:  /* IPv4 */
+	{
+		struct nm_iphdr iph;
+
+		if (src_len < t->ethhlen + sizeof(iph)) {
+			nm_prlim(1, "Short GSO fragment [IPv4], dropping");
+			return -1;
+		}
+		memcpy(&iph, src + t->ethhlen, sizeof(iph));
+		t->ipv4 = 1;
+		t->iphlen = 4 * (iph.version_ihl & 0x0F);
+		if (t->iphlen < sizeof(iph)) {
+			nm_prlim(1, "Bad IPv4 header length, dropping");
+			return -1;
+		}
+		t->ip_id = be16toh(iph.id);
+		t->pseudo = nm_csum_buf((const uint8_t *)&iph.saddr, 8, 0);
+		break;
+	}
+	case 0x86DD:  /* IPv6 */
+		t->iphlen = 40;
+		if (src_len < t->ethhlen + t->iphlen) {
+			nm_prlim(1, "Short GSO fragment [IPv6], dropping");
+			return -1;
+		}
+		t->pseudo = nm_csum_buf(src + t->ethhlen +
+			offsetof(struct nm_ipv6hdr, saddr), 32, 0);
+		break;
+	default:
+		nm_prlim(1, "Unsupported ethertype, dropping GSO packet");
+		return -1;
+	}
+	t->pseudo = nm_csum_add(t->pseudo, htobe16(proto));
+
+	if (src_len < t->ethhlen + t->iphlen) {
+		nm_prlim(1, "Short GSO fragment [IP], dropping");
+		return -1;
+	}
+
+	/* For TCP we need to read the content of the 'Data Offset' field. */
+	if (t->tcp) {
+		struct nm_tcphdr tcph;
+
+		if (src_len < t->ethhlen + t->iphlen + sizeof(tcph)) {
+			nm_prlim(1, "Short GSO fragment [TCP], dropping");
+			return -1;
+		}
+		memcpy(&tcph, src + t->ethhlen + t->iphlen, sizeof(tcph));
+		t->hdr_len = t->ethhlen + t->iphlen + 4 * (tcph.doff >> 4);
+		t->tcp_seq = be32toh(tcph.seq);
+	} else {
+		t->hdr_len = t->ethhlen + t->iphlen + 8; /* UDP */
+	}
+
+	if (src_len < t->hdr_len) {
+		nm_prlim(1, "Short GSO fragment [TCP/UDP], dropping");
+		return -1;
+	}
+	if (t->hdr_len >= mfs) {
+		nm_prlim(1, "GSO headers longer than the MFS, dropping");
+		return -1;
+	}
+
+	/* Segment to the size requested by the sender, if the
+	 * destination port can take it. */
+	t->seg_len = mfs;
+	if (vh->gso_size && t->hdr_len + vh->gso_size < mfs)
+		t->seg_len = t->hdr_len + vh->gso_size;
+
+	nm_prdis(3, "gso_hdr_len %u seg_len %u", t->hdr_len, t->seg_len);
+	return 0;
+}
+
+/* Fix the headers of a segment, once its payload has been copied
+ * behind the template. 'pkt' points to the Ethernet header, 'len' is
+ * the length of the frame, 'paysum' is the partial checksum of the
+ * payload, accumulated during the copy.
+ */
+static void
+gso_tmpl_finish(const struct gso_tmpl *t, uint8_t *pkt, u_int len,
+		u_int idx, u_int segmented_bytes, u_int last_segment,
+		nm_csum_t paysum)
+{
+	uint8_t *iph = pkt + t->ethhlen;
+	uint8_t *l4h = iph + t->iphlen;
+	u_int l4len = len - t->ethhlen - t->iphlen;
+	uint16_t *check;
+	uint16_t csum;
+
+	if (t->ipv4) {
+		struct nm_iphdr *ip4h = (struct nm_iphdr *)iph;
+
+		/* Set the IPv4 "Total Length" and "Identification"
+		 * fields, then the header checksum. */
+		ip4h->tot_len = htobe16(len - t->ethhlen);
+		ip4h->id = htobe16(t->ip_id + idx);
+		ip4h->check = 0;
+		ip4h->check = ~nm_csum_fold(nm_csum_buf(iph, t->iphlen, 0));
+		nm_prdis("IP csum %x", be16toh(ip4h->check));
 	} else {
 		/* Set the IPv6 "Payload Len" field. */
-		ip6h->payload_len = htobe16(len-iphlen);
+		((struct nm_ipv6hdr *)iph)->payload_len = htobe16(l4len);
 	}
 
-	if (tcp) {
-		struct nm_tcphdr *tcph = (struct nm_tcphdr *)(pkt + iphlen);
+	if (t->tcp) {
+		struct nm_tcphdr *tcph = (struct nm_tcphdr *)l4h;
 
 		/* Set the TCP sequence number. */
-		tcph->seq = htobe32(be32toh(tcph->seq) + segmented_bytes);
-		nm_prdis("tcp seq %u", be32toh(tcph->seq));
-
+		tcph->seq = htobe32(t->tcp_seq + segmented_bytes);
 		/* Zero the PSH and FIN TCP flags if this is not the last
 		   segment. */
 		if (!last_segment)
 			tcph->flags &= ~(0x8 | 0x1);
-		nm_prdis("last_segment %u", last_segment);
-
 		check = &tcph->check;
-		check_data = (uint8_t *)tcph;
 	} else { /* UDP */
-		struct nm_udphdr *udph = (struct nm_udphdr *)(pkt + iphlen);
+		struct nm_udphdr *udph = (struct nm_udphdr *)l4h;
 
 		/* Set the UDP 'Length' field. */
-		udph->len = htobe16(len-iphlen);
-
+		udph->len = htobe16(l4len);
 		check = &udph->check;
-		check_data = (uint8_t *)udph;
 	}
 
-	/* Compute and insert TCP/UDP checksum. */
+	/* The payload is already summed, add the TCP/UDP header and
+	 * the pseudo header. */
 	*check = 0;
-	if (ipv4)
-		nm_os_csum_tcpudp_ipv4(iph, check_data, len-iphlen, check);
-	else
-		nm_os_csum_tcpudp_ipv6(ip6h, check_data, len-iphlen, check);
-
+	paysum = nm_csum_add(paysum, t->pseudo);
+	paysum = nm_csum_add(paysum, htobe16(l4len));
+	paysum = nm_csum_buf(l4h, t->hdr_len - t->ethhlen - t->iphlen, paysum);
+	csum = ~nm_csum_fold(paysum);
+	if (csum == 0 && !t->tcp)
+		csum = 0xFFFF; /* zero means no checksum for UDP */
+	*check = csum;
 	nm_prdis("TCP/UDP csum %x", be16toh(*check));
 }
 
@@ -240,157 +455,75 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	}
 
 	if (vh && vh->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+		struct gso_tmpl t;
+		/* Bytes in the current segment, headers included. */
 		u_int gso_bytes = 0;
-		/* Length of the GSO packet header. */
-		u_int gso_hdr_len = 0;
-		/* Pointer to the GSO packet header. Assume it is in a single fragment. */
-		uint8_t *gso_hdr = NULL;
 		/* Index of the current segment. */
 		u_int gso_idx = 0;
 		/* Payload data bytes segmented so far (e.g. TCP data bytes). */
 		u_int segmented_bytes = 0;
-		/* Is this an IPv4 or IPv6 GSO packet? */
-		u_int ipv4 = 0;
-		/* Length of the IP header (20 if IPv4, 40 if IPv6). */
-		u_int iphlen = 0;
-		/* Length of the Ethernet header (18 if 802.1q, otherwise 14). */
-		u_int ethhlen = 14;
-		/* Is this a TCP or an UDP GSO packet? */
-		u_int tcp = ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
-				== VIRTIO_NET_HDR_GSO_UDP) ? 0 : 1;
-
-		/* Segment the GSO packet contained into the input slots (frags). */
-		for (;;) {
-			size_t copy;
+		/* Partial checksum of the payload of the current segment. */
+		nm_csum_t paysum = 0;
 
-			if (dst_slots >= *howmany) {
-				/* We still have work to do, but we've run out of
-				 * dst slots, so we have to drop the packet. */
-				nm_prdis(1, "Not enough slots, dropping GSO packet");
-				return;
-			}
-
-			/* Grab the GSO header if we don't have it. */
-			if (!gso_hdr) {
-				uint16_t ethertype;
-
-				gso_hdr = src;
-
-				/* Look at the 'Ethertype' field to see if this packet
-				 * is IPv4 or IPv6, taking into account VLAN
-				 * encapsulation. */
-				for (;;) {
-					if (src_len < ethhlen) {
-						nm_prlim(1, "Short GSO fragment [eth], dropping");
-						return;
-					}
-					ethertype = be16toh(*((uint16_t *)
-							    (gso_hdr + ethhlen - 2)));
-					if (ethertype != 0x8100) /* not 802.1q */
-						break;
-					ethhlen += 4;
-				}
-				switch (ethertype) {
-					case 0x0800:  /* IPv4 */
-					{
-						struct nm_iphdr *iph = (struct nm_iphdr *)
-									(gso_hdr + ethhlen);
-
-						if (src_len < ethhlen + 20) {
-							nm_prlim(1, "Short GSO fragment "
-							      "[IPv4], dropping");
-							return;
-						}
-						ipv4 = 1;
-						iphlen = 4 * (iph->version_ihl & 0x0F);
-						break;
-					}
-					case 0x86DD:  /* IPv6 */
-						ipv4 = 0;
-						iphlen = 40;
-						break;
-					default:
-						nm_prlim(1, "Unsupported ethertype, "
-						      "dropping GSO packet");
-						return;
-				}
-				nm_prdis(3, "type=%04x", ethertype);
+		if (gso_tmpl_init(&t, vh, src, src_len, dst_na->mfs))
+			return;
 
-				if (src_len < ethhlen + iphlen) {
-					nm_prlim(1, "Short GSO fragment [IP], dropping");
-					return;
-				}
+		/* Skip the headers and any empty source slot. */
+		src += t.hdr_len;
+		src_len -= t.hdr_len;
+		while (src_len == 0 && ++ft_p != ft_end) {
+			src = ft_p->ft_buf;
+			src_len = ft_p->ft_len;
+		}
 
-				/* Compute gso_hdr_len. For TCP we need to read the
-				 * content of the 'Data Offset' field.
-				 */
-				if (tcp) {
-					struct nm_tcphdr *tcph = (struct nm_tcphdr *)
-								(gso_hdr + ethhlen + iphlen);
-
-					if (src_len < ethhlen + iphlen + 20) {
-						nm_prlim(1, "Short GSO fragment "
-								"[TCP], dropping");
-						return;
-					}
-					gso_hdr_len = ethhlen + iphlen +
-						      4 * (tcph->doff >> 4);
-				} else {
-					gso_hdr_len = ethhlen + iphlen + 8; /* UDP */
-				}
+		/* Segment the GSO payload contained into the input slots
+		 * (frags), copying as much as possible at each step. */
+		while (ft_p != ft_end) {
+			size_t copy;
 
-				if (src_len < gso_hdr_len) {
-					nm_prlim(1, "Short GSO fragment [TCP/UDP], dropping");
+			/* Start a new segment from the template. */
+			if (gso_bytes == 0) {
+				if (dst_slots >= *howmany) {
+					/* We still have work to do, but we've
+					 * run out of dst slots, so we have to
+					 * drop the packet. */
+					nm_prdis(1, "Not enough slots, dropping GSO packet");
 					return;
 				}
-
-				nm_prdis(3, "gso_hdr_len %u gso_mtu %d", gso_hdr_len,
-								   dst_na->mfs);
-
-				/* Advance source pointers. */
-				src += gso_hdr_len;
-				src_len -= gso_hdr_len;
-				if (src_len == 0) {
-					ft_p++;
-					if (ft_p == ft_end)
-						break;
-					src = ft_p->ft_buf;
-					src_len = ft_p->ft_len;
-				}
-			}
-
-			/* Fill in the header of the current segment. */
-			if (gso_bytes == 0) {
-				memcpy(dst, gso_hdr, gso_hdr_len);
-				gso_bytes = gso_hdr_len;
+				memcpy(dst, t.hdr, t.hdr_len);
+				gso_bytes = t.hdr_len;
+				paysum = 0;
 			}
 
 			/* Fill in data and update source and dest pointers. */
 			copy = src_len;
-			if (gso_bytes + copy > dst_na->mfs)
-				copy = dst_na->mfs - gso_bytes;
-			memcpy(dst + gso_bytes, src, copy);
+			if (gso_bytes + copy > t.seg_len)
+				copy = t.seg_len - gso_bytes;
+			paysum = nm_csum_block_add(paysum,
+				nm_csum_copy(dst + gso_bytes, src, copy, 0),
+				gso_bytes - t.hdr_len);
 			gso_bytes += copy;
 			src += copy;
 			src_len -= copy;
 
+			/* Next non-empty input slot. */
+			while (src_len == 0 && ++ft_p != ft_end) {
+				src = ft_p->ft_buf;
+				src_len = ft_p->ft_len;
+			}
+
 			/* A segment is complete or we have processed all the
 			   the GSO payload bytes. */
-			if (gso_bytes >= dst_na->mfs ||
-				(src_len == 0 && ft_p + 1 == ft_end)) {
-				/* After raw segmentation, we must fix some header
-				 * fields and compute checksums, in a protocol dependent
-				 * way. */
-				gso_fix_segment(dst + ethhlen, gso_bytes - ethhlen,
-						ipv4, iphlen, tcp,
-						gso_idx, segmented_bytes,
-						src_len == 0 && ft_p + 1 == ft_end);
+			if (gso_bytes >= t.seg_len || ft_p == ft_end) {
+				gso_tmpl_finish(&t, dst, gso_bytes, gso_idx,
+						segmented_bytes, ft_p == ft_end,
+						paysum);
 
 				nm_prdis("frame %u completed with %d bytes", gso_idx, (int)gso_bytes);
 				dst_slot->len = gso_bytes;
 				dst_slot->flags = 0;
 				dst_slots++;
-				segmented_bytes += gso_bytes - gso_hdr_len;
+				segmented_bytes += gso_bytes - t.hdr_len;
 
 				gso_bytes = 0;
 				gso_idx++;
@@ -400,15 +533,6 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				dst_slot = &dst_ring->slot[j_cur];
 				dst = NMB(&dst_na->up, dst_slot);
 			}
-
-			/* Next input slot. */
-			if (src_len == 0) {
-				ft_p++;
-				if (ft_p == ft_end)
-					break;
-				src = ft_p->ft_buf;
-				src_len = ft_p->ft_len;
-			}
 		}
 		nm_prdis(3, "%d bytes segmented", segmented_bytes);
 
@@ -490,3 +614,255 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	*j = j_cur;
 	*howmany -= dst_slots;
 }
+
+/*
+ * VALE GRO: TCP segments sent by a port without virtio-net headers to a
+ * port that has them are coalesced into a single GSO frame, as long as
+ * they are consecutive in the destination queue, belong to the same
+ * flow and are in sequence. Only untagged single-slot IPv4 (without
+ * options) and IPv6 (without extension headers) segments are merged.
+ * Checksums of the segments are not verified, the frame is delivered
+ * with VIRTIO_NET_HDR_F_NEEDS_CSUM.
+ */
+#define NM_GRO_MAX_SEGS	64
+
+#define NM_TCP_PSH	0x08
+#define NM_TCP_ACK	0x10
+
+struct gro_seg {
+	const uint8_t	*buf;
+	u_int		len;	/* frame length, without Ethernet padding */
+	u_int		hlen;	/* Ethernet + IP + TCP headers */
+	u_int		iphlen;
+	u_int		ipv4;
+	u_int		paylen;
+	uint32_t	seq;
+	uint8_t		flags;
+};
+
+/* Returns 0 if 'ft_p' is a TCP segment that may be coalesced. */
+static int
+gro_parse(const struct nm_bdg_fwd *ft_p, struct gro_seg *s)
+{
+	const uint8_t *buf = ft_p->ft_buf;
+	u_int len = ft_p->ft_len;
+	struct nm_tcphdr tcph;
+	uint16_t ethertype;
+	u_int iplen;
+
+	if (ft_p->ft_frags != 1 || (ft_p->ft_flags & NS_INDIRECT) ||
+			len < 14 + 20 + sizeof(tcph))
+		return -1;
+	memcpy(&ethertype, buf + 12, sizeof(ethertype));
+	if (ethertype == htobe16(0x0800)) {
+		struct nm_iphdr iph;
+
+		memcpy(&iph, buf + 14, sizeof(iph));
+		if (iph.version_ihl != 0x45 || iph.protocol != 6 ||
+				(iph.frag_off & htobe16(0x3FFF)))
+			return -1;
+		s->ipv4 = 1;
+		s->iphlen = sizeof(iph);
+		iplen = be16toh(iph.tot_len);
+	} else if (ethertype == htobe16(0x86DD)) {
+		struct nm_ipv6hdr ip6h;
+
+		if (len < 14 + sizeof(ip6h) + sizeof(tcph))
+			return -1;
+		memcpy(&ip6h, buf + 14, sizeof(ip6h));
+		if (ip6h.nexthdr != 6)
+			return -1;
+		s->ipv4 = 0;
+		s->iphlen = sizeof(ip6h);
+		iplen = sizeof(ip6h) + be16toh(ip6h.payload_len);
+	} else {
+		return -1;
+	}
+
+	memcpy(&tcph, buf + 14 + s->iphlen, sizeof(tcph));
+	s->hlen = 14 + s->iphlen + 4 * (tcph.doff >> 4);
+	s->len = 14 + iplen;
+	if ((tcph.doff >> 4) < 5 || s->len > len || s->len <= s->hlen)
+		return -1;
+	/* only pure data segments, PSH ends a train */
+	s->flags = tcph.flags;
+	if ((s->flags & ~NM_TCP_PSH) != NM_TCP_ACK)
+		return -1;
+	s->buf = buf;
+	s->paylen = s->len - s->hlen;
+	s->seq = be32toh(tcph.seq);
+	return 0;
+}
+
+/* Can 'c' be appended to the train started by 'f'? Everything must
+ * match but the lengths, the IPv4 id, the checksums, the sequence
+ * number and the PSH flag. */
+static int
+gro_same_flow(const struct gro_seg *f, const struct gro_seg *c)
+{
+	const uint8_t *a = f->buf + 14, *b = c->buf + 14;
+
+	if (c->hlen != f->hlen || c->ipv4 != f->ipv4 ||
+			memcmp(f->buf, c->buf, 14))
+		return 0;
+	if (f->ipv4) {
+		/* version/ihl, tos; frag_off, ttl, protocol; addresses */
+		if (memcmp(a, b, 2) || memcmp(a + 6, b + 6, 4) ||
+				memcmp(a + 12, b + 12, 8))
+			return 0;
+	} else {
+		/* version/class/flow; nexthdr, hop limit, addresses */
+		if (memcmp(a, b, 4) || memcmp(a + 6, b + 6, 34))
+			return 0;
+	}
+	a += f->iphlen;
+	b += f->iphlen;
+	/* ports; ack; data offset; window; options */
+	return !memcmp(a, b, 4) && !memcmp(a + 8, b + 8, 5) &&
+		!memcmp(a + 14, b + 14, 2) &&
+		!memcmp(a + 20, b + 20, f->hlen - 14 - f->iphlen - 20);
+}
+
+/*
+ * Deliver the unicast packet 'ft_p' to 'dst_na', together with the
+ * following packets in the queue (starting from '*next') that continue
+ * its TCP stream. Packets before 'brd_next' only are considered, to
+ * keep the order with the broadcast queue. The merged frame is made of
+ * the virtio-net header, the headers of the first segment and all the
+ * payloads, packed into as few destination slots as possible.
+ * Returns the number of packets merged into the first one, which are
+ * removed from the queue. Packets that cannot be merged go through
+ * bdg_mismatch_datapath().
+ */
+u_int
+bdg_gro_datapath(struct netmap_vp_adapter *na,
+		 struct netmap_vp_adapter *dst_na,
+		 struct nm_bdg_fwd *ft, const struct nm_bdg_fwd *ft_p,
+		 u_int *next, u_int brd_next,
+		 struct netmap_ring *dst_ring,
+		 u_int *j, u_int lim, u_int *howmany)
+{
+	u_int bufsz = NETMAP_BUF_SIZE(&dst_na->up);
+	u_int vhl = dst_na->up.virt_hdr_len;
+	uint16_t paylen[NM_GRO_MAX_SEGS];
+	struct gro_seg f, l, c;
+	u_int total, nsegs = 1, k;
+	struct netmap_slot *dst_slot;
+	struct nm_vnet_hdr *vh;
+	uint8_t *dst, *hdr;
+	u_int dst_len, slots;
+	nm_csum_t sum;
+
+	if (gro_parse(ft_p, &f) || (f.flags & NM_TCP_PSH) ||
+			vhl + f.len > bufsz)
+		goto nomerge;
+
+	/* Find the train. */
+	total = f.len;
+	l = f;
+	while (*next < brd_next && nsegs < NM_GRO_MAX_SEGS) {
+		const struct nm_bdg_fwd *c_ft = ft + *next;
+
+		if (gro_parse(c_ft, &c) || !gro_same_flow(&f, &c) ||
+				c.seq != l.seq + l.paylen ||
+				c.paylen > f.paylen ||
+				total + c.paylen - 14 > 0xFFFF ||
+				(vhl + total + c.paylen + bufsz - 1) / bufsz >
+				*howmany)
+			break;
+		paylen[nsegs++] = c.paylen;
+		total += c.paylen;
+		*next = c_ft->ft_next;
+		l = c;
+		/* a short segment or PSH end the train */
+		if (c.paylen < f.paylen || (c.flags & NM_TCP_PSH))
+			break;
+	}
+	if (nsegs == 1)
+		goto nomerge;
+
+	/* The first slot gets the virtio-net header and the whole
+	 * first segment. */
+	dst_slot = &dst_ring->slot[*j];
+	dst = NMB(&dst_na->up, dst_slot);
+	vh = (struct nm_vnet_hdr *)dst;
+	bzero(dst, vhl);
+	hdr = dst + vhl;
+	memcpy(hdr, f.buf, f.len);
+	dst_len = vhl + f.len;
+	slots = 1;
+
+	/* Then the payloads of the others, filling every buffer. */
+	for (k = 1, ft_p = ft + ft_p->ft_next; k < nsegs;
+			k++, ft_p = ft + ft_p->ft_next) {
+		const uint8_t *src = (const uint8_t *)ft_p->ft_buf + f.hlen;
+		u_int left = paylen[k];
+
+		while (left) {
+			u_int copy;
+
+			if (dst_len == bufsz) {
+				dst_slot->len = dst_len;
+				dst_slot->flags = NS_MOREFRAG;
+				*j = nm_next(*j, lim);
+				dst_slot = &dst_ring->slot[*j];
+				dst = NMB(&dst_na->up, dst_slot);
+				dst_len = 0;
+				slots++;
+			}
+			copy = bufsz - dst_len;
+			if (copy > left)
+				copy = left;
+			memcpy(dst + dst_len, src, copy);
+			dst_len += copy;
+			src += copy;
+			left -= copy;
+		}
+	}
+	dst_slot->len = dst_len;
+	dst_slot->flags = 0;
+	*j = nm_next(*j, lim);
+	*howmany -= slots;
+
+	/* Fix the headers of the merged frame. The TCP checksum field
+	 * gets the pseudo header sum, the receiver completes it. */
+	if (f.ipv4) {
+		struct nm_iphdr *iph = (struct nm_iphdr *)(hdr + 14);
+
+		iph->tot_len = htobe16(total - 14);
+		iph->check = 0;
+		iph->check = ~nm_csum_fold(nm_csum_buf((uint8_t *)iph,
+					f.iphlen, 0));
+		sum = nm_csum_buf((uint8_t *)&iph->saddr, 8, 0);
+	} else {
+		struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(hdr + 14);
+
+		ip6h->payload_len = htobe16(total - 14 - f.iphlen);
+		sum = nm_csum_buf(ip6h->saddr, 32, 0);
+	}
+	sum = nm_csum_add(sum, htobe16(6));
+	sum = nm_csum_add(sum, htobe16(total - 14 - f.iphlen));
+	{
+		struct nm_tcphdr *tcph =
+			(struct nm_tcphdr *)(hdr + 14 + f.iphlen);
+
+		tcph->flags = l.flags;
+		tcph->check = nm_csum_fold(sum);
+	}
+
+	vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vh->gso_type = f.ipv4 ? VIRTIO_NET_HDR_GSO_TCPV4 :
+				VIRTIO_NET_HDR_GSO_TCPV6;
+	vh->hdr_len = f.hlen;
+	vh->gso_size = f.paylen;
+	vh->csum_start = 14 + f.iphlen;
+	vh->csum_offset = offsetof(struct nm_tcphdr, check);
+	nm_prdis(3, "merged %u segments, %u bytes in %u slots", nsegs,
+			total, slots);
+
+	return nsegs - 1;
+
+nomerge:
+	bdg_mismatch_datapath(na, dst_na, ft_p, dst_ring, j, lim, howmany);
+	return 0;
+}
@@ -181,13 +181,47 @@ netmap_pipe_remove(struct netmap_adapter *parent, struct netmap_pipe_adapter *na
 	parent->na_pipes[n] = NULL;
 }
 
+/*
+ * Wakeups between the two ends of a pipe use the same handshake as the
+ * CSB-based sync kloop: the owner of a kring sets pipe_need_kick when a
+ * sync leaves it with nothing to do (so that it may go to sleep), and
+ * the other end only calls nm_notify() when it sees the flag.
+ */
+static inline void
+netmap_pipe_arm_kick(struct netmap_kring *kring)
+{
+	if (kring->nr_hwtail != kring->nr_hwcur) {
+		/* the user has work to do and will sync again */
+		if (kring->pipe_need_kick)
+			kring->pipe_need_kick = 0;
+		return;
+	}
+	kring->pipe_need_kick = 1;
+	mb(); /* set need_kick before checking pipe_tail again */
+	kring->nr_hwtail = NM_ACCESS_ONCE(kring->pipe_tail);
+}
+
+static inline void
+netmap_pipe_kick(struct netmap_kring *kring)
+{
+	mb(); /* publish pipe_tail before reading need_kick */
+	if (!NM_ACCESS_ONCE(kring->pipe_need_kick)
+#ifdef WITH_MONITOR
+	    /* monitors intercept nm_notify() and must always see it */
+	    && kring->mon_notify == NULL
+#endif /* WITH_MONITOR */
+	   )
+		return;
+	kring->pipe_need_kick = 0;
+	kring->nm_notify(kring, 0);
+}
+
 int
 netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 {
 	struct netmap_kring *rxkring = txkring->pipe;
-	u_int k, lim = txkring->nkr_num_slots - 1, nk;
+	u_int k, lim = txkring->nkr_num_slots - 1, nk, n, j;
 	int m; /* slots to transfer */
-	int complete; /* did we see a complete packet ? */
 	struct netmap_ring *txring = txkring->ring, *rxring = rxkring->ring;
 
 	nm_prdis("%p: %s %x -> %s", txkring, txkring->name, flags, rxkring->name);
@@ -204,19 +238,32 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 
 	if (m == 0) {
 		/* nothing to send */
-		return 0;
+		goto out;
 	}
 
-	for (k = txkring->nr_hwcur, nk = lim + 1, complete = 0; m;
-			m--, k = nm_next(k, lim), nk = (complete ? k : nk)) {
-		struct netmap_slot *rs = &rxring->slot[k];
-		struct netmap_slot *ts = &txring->slot[k];
+	/* copy the slots in (at most) two contiguous segments */
+	for (k = txkring->nr_hwcur, n = m; n; ) {
+		u_int seg = lim + 1 - k;
+
+		if (seg > n)
+			seg = n;
+		memcpy(&rxring->slot[k], &txring->slot[k],
+			seg * sizeof(struct netmap_slot));
+		for (j = k; j < k + seg; j++)
+			txring->slot[j].flags &= ~NS_BUF_CHANGED;
+		n -= seg;
+		k += seg;
+		if (k > lim)
+			k = 0;
+	}
 
-		*rs = *ts;
-		if (ts->flags & NS_BUF_CHANGED) {
-			ts->flags &= ~NS_BUF_CHANGED;
-		}
-		complete = !(ts->flags & NS_MOREFRAG);
+	/* only publish complete packets: look back for the last slot
+	 * without NS_MOREFRAG, which normally is the very last one */
+	for (nk = k; m; m--) {
+		j = nm_prev(nk, lim);
+		if (!(txring->slot[j].flags & NS_MOREFRAG))
+			break;
+		nk = j;
 	}
 
 	txkring->nr_hwcur = k;
@@ -225,12 +272,14 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 		txkring->nr_hwcur, txkring->nr_hwtail,
 		txkring->rcur, txkring->rhead, txkring->rtail, k);
 
-	if (likely(nk <= lim)) {
+	if (likely(m)) {
 		mb(); /* make sure the slots are updated before publishing them */
 		rxkring->pipe_tail = nk; /* only publish complete packets */
-		rxkring->nm_notify(rxkring, 0);
+		netmap_pipe_kick(rxkring);
 	}
 
+out:
+	netmap_pipe_arm_kick(txkring);
 	return 0;
 }
 
@@ -238,7 +287,7 @@ int
 netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
 {
 	struct netmap_kring *txkring = rxkring->pipe;
-	u_int k, lim = rxkring->nkr_num_slots - 1;
+	u_int k, lim = rxkring->nkr_num_slots - 1, j;
 	int m; /* slots to release */
 	struct netmap_ring *txring = txkring->ring, *rxring = rxkring->ring;
 
@@ -256,18 +305,27 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
 
 	if (m == 0) {
 		/* nothing to release */
-		return 0;
+		goto out;
 	}
 
-	for (k = rxkring->nr_hwcur; m; m--, k = nm_next(k, lim)) {
-		struct netmap_slot *rs = &rxring->slot[k];
-		struct netmap_slot *ts = &txring->slot[k];
+	for (k = rxkring->nr_hwcur; m; ) {
+		u_int seg = lim + 1 - k;
 
-		if (rs->flags & NS_BUF_CHANGED) {
-			/* copy the slot and report the buffer change */
-			*ts = *rs;
-			rs->flags &= ~NS_BUF_CHANGED;
+		if (seg > (u_int)m)
+			seg = m;
+		for (j = k; j < k + seg; j++) {
+			struct netmap_slot *rs = &rxring->slot[j];
+
+			if (unlikely(rs->flags & NS_BUF_CHANGED)) {
+				/* copy the slot and report the buffer change */
+				txring->slot[j] = *rs;
+				rs->flags &= ~NS_BUF_CHANGED;
+			}
 		}
+		m -= seg;
+		k += seg;
+		if (k > lim)
+			k = 0;
 	}
 
 	mb(); /* make sure the slots are updated before publishing them */
@@ -278,8 +336,10 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
 		rxkring->nr_hwcur, rxkring->nr_hwtail,
 		rxkring->rcur, rxkring->rhead, rxkring->rtail, k);
 
-	txkring->nm_notify(txkring, 0);
+	netmap_pipe_kick(txkring);
 
+out:
+	netmap_pipe_arm_kick(rxkring);
 	return 0;
 }
 
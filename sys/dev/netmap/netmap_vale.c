@@ -85,9 +85,9 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 /*
  * system parameters (most of them in netmap_kern.h)
  * NM_BDG_NAME	prefix for switch port names, default "vale"
- * NM_BDG_MAXPORTS	number of ports
- * NM_BRIDGES	max number of switches in the system.
- *	XXX should become a sysctl or tunable
+ * NM_BDG_MAXPORTS	max number of ports of a switch
+ * NM_BRIDGES	default number of switches in the system,
+ *	see the max_bridges sysctl
  *
  * Switch ports are named valeX:Y where X is the switch name and Y
  * is the port. If Y matches a physical interface name, the port is
@@ -99,7 +99,6 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * In the tx loop, we aggregate traffic in batches to make all operations
  * faster. The batch size is bridge_batch.
  */
-#define NM_BDG_MAXRINGS		16	/* XXX unclear how many. */
 #define NM_BDG_MAXSLOTS		4096	/* XXX same as above */
 #define NM_BRIDGE_RINGSIZE	1024	/* in the device */
 #define NM_BDG_BATCH		1024	/* entries in the forwarding buffer */
@@ -107,6 +106,10 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NETMAP_MAX_FRAGS)
 /* NM_FT_NULL terminates a list of slots in the ft */
 #define NM_FT_NULL		NM_BDG_BATCH_MAX
+/* packets classified by each call to lookup_batch() */
+#define NM_BDG_LOOKUP_BATCH	16
+/* destinations served together by a broadcast */
+#define NM_BDG_BCAST_BATCH	16
 
 
 /*
@@ -141,6 +144,7 @@ struct nm_vale_q {
 /* Holds the default callbacks */
 struct netmap_bdg_ops vale_bdg_ops = {
 	.lookup = netmap_vale_learning,
+	.lookup_batch = netmap_vale_learning_batch,
 	.config = NULL,
 	.dtor = NULL,
 	.vp_create = netmap_vale_vp_create,
@@ -194,45 +198,98 @@ nm_free_bdgfwd(struct netmap_adapter *na)
 		if (kring[i]->nkr_ft) {
 			nm_os_free(kring[i]->nkr_ft);
 			kring[i]->nkr_ft = NULL; /* protect from freeing twice */
+			kring[i]->nkr_ft_ports = kring[i]->nkr_ft_rings = 0;
 		}
 	}
 }
 
 
+/*
+ * The forwarding table (scratchpad) of a tx ring contains the
+ * NM_BDG_BATCH_MAX ft entries, a queue for each rx ring of each
+ * port plus one per ring for the broadcast traffic, and the list of
+ * destinations to be scanned (at most one per packet plus one
+ * per port and ring), see nm_vale_flush().
+ * It is sized for the ports and rings of the bridge, and is
+ * replaced by a larger one if the bridge grows.
+ */
+static struct nm_bdg_fwd *
+nm_bdgfwd_new(u_int nports, u_int nrings)
+{
+	struct nm_bdg_fwd *ft;
+	struct nm_vale_q *dstq;
+	u_int j, num_dstq = (nports + 1) * nrings;
+	size_t l;
+
+	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
+	l += sizeof(struct nm_vale_q) * num_dstq;
+	l += sizeof(uint16_t) * (NM_BDG_BATCH_MAX + nports * nrings);
+
+	ft = nm_os_malloc(l);
+	if (!ft)
+		return NULL;
+	dstq = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
+	for (j = 0; j < num_dstq; j++) {
+		dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
+		dstq[j].bq_len = 0;
+	}
+	return ft;
+}
+
+/*
+ * Make sure that the forwarding table of kring covers all the
+ * ports and rings of bridge b. Called by the owner of the kring,
+ * with the bridge lock held.
+ */
+static int
+nm_bdgfwd_fit(struct netmap_kring *kring, struct nm_bridge *b)
+{
+	struct nm_bdg_fwd *ft;
+
+	if (likely(kring->nkr_ft_ports >= b->bdg_max_ports &&
+			kring->nkr_ft_rings >= b->bdg_max_rings))
+		return 0;
+	ft = nm_bdgfwd_new(b->bdg_max_ports, b->bdg_max_rings);
+	if (!ft)
+		return ENOMEM;
+	if (kring->nkr_ft)
+		nm_os_free(kring->nkr_ft);
+	kring->nkr_ft = ft;
+	kring->nkr_ft_ports = b->bdg_max_ports;
+	kring->nkr_ft_rings = b->bdg_max_rings;
+	return 0;
+}
+
 /*
  * Allocate the forwarding tables for the rings attached to the bridge ports.
  */
 static int
 nm_alloc_bdgfwd(struct netmap_adapter *na)
 {
-	int nrings, l, i, num_dstq;
+	struct nm_bridge *b = ((struct netmap_vp_adapter *)na)->na_bdg;
+	u_int nports = NM_BDG_PORTS_INIT, nrings = 1;
+	int num_rings, i;
 	struct netmap_kring **kring;
 
 	NMG_LOCK_ASSERT();
-	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
-	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
-	l += sizeof(struct nm_vale_q) * num_dstq;
-	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
+	if (b) {
+		nports = b->bdg_max_ports;
+		nrings = b->bdg_max_rings;
+	}
 
-	nrings = netmap_real_rings(na, NR_TX);
+	num_rings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
-	for (i = 0; i < nrings; i++) {
+	for (i = 0; i < num_rings; i++) {
 		struct nm_bdg_fwd *ft;
-		struct nm_vale_q *dstq;
-		int j;
 
-		ft = nm_os_malloc(l);
+		ft = nm_bdgfwd_new(nports, nrings);
 		if (!ft) {
 			nm_free_bdgfwd(na);
 			return ENOMEM;
 		}
-		dstq = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
-		for (j = 0; j < num_dstq; j++) {
-			dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
-			dstq[j].bq_len = 0;
-		}
 		kring[i]->nkr_ft = ft;
+		kring[i]->nkr_ft_ports = nports;
+		kring[i]->nkr_ft_rings = nrings;
 	}
 	return 0;
 }
@@ -364,9 +421,9 @@ netmap_vale_list(struct nmreq_header *hdr)
 		j = req->nr_port_idx;
 
 		NMG_LOCK();
-		for (error = ENOENT; i < NM_BRIDGES; i++) {
+		for (error = ENOENT; i < num_bridges; i++) {
 			b = bridges + i;
-			for ( ; j < NM_BDG_MAXPORTS; j++) {
+			for ( ; j < b->bdg_max_ports; j++) {
 				if (b->bdg_ports[j] == NULL)
 					continue;
 				vpna = b->bdg_ports[j];
@@ -387,6 +444,148 @@ netmap_vale_list(struct nmreq_header *hdr)
 	return error;
 }
 
+/* Process NETMAP_REQ_VALE_FTABLE.
+ */
+int
+netmap_vale_ftable(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_ftable *req =
+		(struct nmreq_vale_ftable *)(uintptr_t)hdr->nr_body;
+	struct nm_vale_ft_stats stats;
+	struct nm_hash_table *ht;
+	struct nm_bridge *b;
+	int error = 0, i, j, reconf;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+		return EINVAL;
+	}
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (!b) {
+		error = ENOENT;
+		goto unlock_exit;
+	}
+	if (!nm_bdg_valid_auth_token(b, NULL)) {
+		error = EACCES;
+		goto unlock_exit;
+	}
+
+	if ((req->nr_flags & NR_VALE_FTABLE_SET_STEERING) &&
+			req->nr_steering != NR_VALE_STEER_SRC_RING &&
+			req->nr_steering != NR_VALE_STEER_FLOW_HASH) {
+		error = EINVAL;
+		goto unlock_exit;
+	}
+	if ((req->nr_flags & NR_VALE_FTABLE_SET_GRO) && req->nr_gro > 1) {
+		error = EINVAL;
+		goto unlock_exit;
+	}
+
+	ht = b->ht;
+	/* resizing the table replaces the buckets under the forwarders */
+	reconf = (req->nr_buckets != 0);
+	if (reconf)
+		nm_bdg_reconf_begin(b);
+	else
+		BDG_WLOCK(b);
+	if (req->nr_flags & NR_VALE_FTABLE_SET_STEERING) {
+		if (req->nr_steering == NR_VALE_STEER_FLOW_HASH)
+			b->bdg_flags |= NM_BDG_FLOW_STEERING;
+		else
+			b->bdg_flags &= ~NM_BDG_FLOW_STEERING;
+	}
+	if (req->nr_flags & NR_VALE_FTABLE_SET_GRO) {
+		if (req->nr_gro)
+			b->bdg_flags |= NM_BDG_GRO;
+		else
+			b->bdg_flags &= ~NM_BDG_GRO;
+	}
+	if (req->nr_buckets) {
+		error = nm_hash_table_resize(ht, req->nr_buckets);
+		if (error)
+			goto wunlock_exit;
+	}
+	if (req->nr_ageing_time) {
+		nm_hash_table_set_ageing(ht, req->nr_ageing_time);
+	}
+	if (req->nr_flags & NR_VALE_FTABLE_FLUSH) {
+		nm_hash_table_flush(ht);
+	}
+	if (req->nr_flags & NR_VALE_FTABLE_RESET_STATS) {
+		bzero(&ht->ht_stats, sizeof(ht->ht_stats));
+	}
+	stats = ht->ht_stats;
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		struct netmap_vp_adapter *vpna;
+
+		i = b->bdg_port_index[j];
+		vpna = b->bdg_ports[i];
+		if (vpna == NULL)
+			continue;
+		nm_vale_ft_stats_collect(vpna, &stats,
+			req->nr_flags & NR_VALE_FTABLE_RESET_STATS);
+	}
+	req->nr_buckets = ht->ht_buckets;
+	req->nr_ways = NM_BDG_HASH_WAYS;
+	req->nr_ageing_time = ht->ht_ageing_time;
+	req->nr_entries = nm_hash_table_count(ht);
+	req->nr_hits = stats.hits;
+	req->nr_misses = stats.misses;
+	req->nr_evictions = stats.evictions;
+	req->nr_floods = stats.floods;
+	req->nr_steering = (b->bdg_flags & NM_BDG_FLOW_STEERING) ?
+		NR_VALE_STEER_FLOW_HASH : NR_VALE_STEER_SRC_RING;
+	req->nr_gro = !!(b->bdg_flags & NM_BDG_GRO);
+	req->nr_gro_merged = stats.gro_merged;
+wunlock_exit:
+	if (reconf)
+		nm_bdg_reconf_end(b);
+	else
+		BDG_WUNLOCK(b);
+unlock_exit:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_REQ_VALE_RING_STATS.
+ */
+int
+netmap_vale_ring_stats(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_ring_stats *req =
+		(struct nmreq_vale_ring_stats *)(uintptr_t)hdr->nr_body;
+	struct netmap_vp_adapter *vpna = NULL;
+	struct nm_bridge *b;
+	int error = 0, i, j;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+		return EINVAL;
+	}
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (!b) {
+		error = ENOENT;
+		goto unlock_exit;
+	}
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		i = b->bdg_port_index[j];
+		if (b->bdg_ports[i] != NULL &&
+				!strcmp(b->bdg_ports[i]->up.name, hdr->nr_name)) {
+			vpna = b->bdg_ports[i];
+			break;
+		}
+	}
+	if (vpna == NULL) {
+		error = ENOENT;
+		goto unlock_exit;
+	}
+
+	netmap_ring_stats_get(&vpna->up, req);
+unlock_exit:
+	NMG_UNLOCK();
+	return error;
+}
+
 /* Process NETMAP_REQ_VALE_ATTACH.
  */
 int
@@ -594,14 +793,19 @@ netmap_vale_vp_krings_create(struct netmap_adapter *na)
 static void
 netmap_vale_vp_krings_delete(struct netmap_adapter *na)
 {
+	struct netmap_vp_adapter *vpna = (struct netmap_vp_adapter *)na;
+	u_int i;
+
+	/* the port may outlive its rings */
+	for (i = 0; i < na->num_rx_rings; i++)
+		vpna->ft_stats.gro_merged += na->rx_rings[i]->nkr_gro_merged;
 	nm_free_bdgfwd(na);
 	netmap_krings_delete(na);
 }
 
 
 static int
-nm_vale_flush(struct nm_bdg_fwd *ft, u_int n,
-	struct netmap_vp_adapter *na, u_int ring_nr);
+nm_vale_flush(struct netmap_kring *src_kring, u_int n);
 
 
 /*
@@ -618,22 +822,33 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		(struct netmap_vp_adapter*)kring->na;
 	struct netmap_ring *ring = kring->ring;
 	struct nm_bdg_fwd *ft;
-	u_int ring_nr = kring->ring_id;
 	u_int j = kring->nr_hwcur, lim = kring->nkr_num_slots - 1;
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
 	struct nm_bridge *b = na->na_bdg;
+	BDG_EPOCH_T et;
+	int locked = 0;
 
-	/* To protect against modifications to the bridge we acquire a
-	 * shared lock, waiting if we can sleep (if the source port is
+	/* Modifications to the bridge wait for us to leave the epoch.
+	 * While the bridge is being reconfigured we acquire a shared
+	 * lock instead, waiting if we can sleep (if the source port is
 	 * attached to a user process) or with a trylock otherwise (NICs).
 	 */
-	nm_prdis("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
-		BDG_RLOCK(b);
-	else if (!BDG_RTRYLOCK(b))
-		return j;
-	nm_prdis(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	BDG_EPOCH_ENTER(b, et);
+	if (unlikely(b->bdg_flags & NM_BDG_RECONF)) {
+		BDG_EPOCH_EXIT(b, et);
+		nm_prdis("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+		if (na->up.na_flags & NAF_BDG_MAYSLEEP)
+			BDG_RLOCK(b);
+		else if (!BDG_RTRYLOCK(b))
+			return j;
+		locked = 1;
+	}
+	nm_ldld_barrier();
+	if (unlikely(nm_bdgfwd_fit(kring, b))) {
+		nm_prlim(1, "%s: cannot grow the forwarding table", kring->name);
+		goto unlock;
+	}
 	ft = kring->nkr_ft;
 
 	for (; likely(j != end); j = nm_next(j, lim)) {
@@ -671,7 +886,7 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
 		if (unlikely((int)ft_i >= bridge_batch))
-			ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
+			ft_i = nm_vale_flush(kring, ft_i);
 	}
 	if (frags > 1) {
 		/* Here ft_i > 0, ft[ft_i-1].flags has NS_MOREFRAG, and we
@@ -682,186 +897,476 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		nm_prlim(5, "Truncate incomplete fragment at %d (%d frags)", ft_i, frags);
 	}
 	if (ft_i)
-		ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
-	BDG_RUNLOCK(b);
+		ft_i = nm_vale_flush(kring, ft_i);
+unlock:
+	if (locked)
+		BDG_RUNLOCK(b);
+	else
+		BDG_EPOCH_EXIT(b, et);
 	return j;
 }
 
 
-/* ----- FreeBSD if_bridge hash function ------- */
-
 /*
- * The following hash function is adapted from "Hash Functions" by Bob Jenkins
- * ("Algorithm Alley", Dr. Dobbs Journal, September 1997).
- *
- * http://www.burtleburtle.net/bob/hash/spooky.html
+ * Update the entry for 'smac' in its bucket 'e', or replace the entry
+ * that has gone without refresh for the longest time.
  */
-#define mix(a, b, c)                                                    \
-do {                                                                    \
-	a -= b; a -= c; a ^= (c >> 13);                                 \
-	b -= c; b -= a; b ^= (a << 8);                                  \
-	c -= a; c -= b; c ^= (b >> 13);                                 \
-	a -= b; a -= c; a ^= (c >> 12);                                 \
-	b -= c; b -= a; b ^= (a << 16);                                 \
-	c -= a; c -= b; c ^= (b >> 5);                                  \
-	a -= b; a -= c; a ^= (c >> 3);                                  \
-	b -= c; b -= a; b ^= (a << 10);                                 \
-	c -= a; c -= b; c ^= (b >> 15);                                 \
-} while (/*CONSTCOND*/0)
-
-
-static __inline uint32_t
-nm_vale_rthash(const uint8_t *addr)
+static inline void
+nm_vale_ht_learn(struct nm_hash_ent *e, uint64_t smac, u_int port,
+		uint32_t epoch, struct nm_vale_ft_stats *stats)
 {
-	uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0; // hask key
-
-	b += addr[5] << 8;
-	b += addr[4];
-	a += addr[3] << 24;
-	a += addr[2] << 16;
-	a += addr[1] << 8;
-	a += addr[0];
-
-	mix(a, b, c);
-#define BRIDGE_RTHASH_MASK	(NM_BDG_HASH-1)
-	return (c & BRIDGE_RTHASH_MASK);
+	struct nm_hash_ent *victim = NULL;
+	u_int i, age, oldest = 0;
+
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++, e++) {
+		if (e->mac == smac && e->ports != NM_HASH_NOENT) {
+			victim = e;
+			oldest = NM_BDG_HASH_EPOCHS; /* not an eviction */
+			break;
+		}
+		age = nm_hash_ent_age(e, epoch);
+		if (victim == NULL || age > oldest) {
+			victim = e;
+			oldest = age;
+		}
+	}
+	if (oldest < NM_BDG_HASH_EPOCHS)
+		stats->evictions++;
+	victim->mac = smac;
+	victim->ports = port;
+	victim->epoch = epoch;
 }
 
-#undef mix
+/* Return the port where 'dmac' was last seen, or NM_BDG_BROADCAST
+ * if the address is not in bucket 'e' or its entry has expired.
+ */
+static inline u_int
+nm_vale_ht_lookup(struct nm_hash_ent *e, uint64_t dmac, uint32_t epoch)
+{
+	u_int i;
 
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++, e++) {
+		if (e->mac == dmac &&
+				nm_hash_ent_age(e, epoch) < NM_BDG_HASH_EPOCHS)
+			return e->ports;
+	}
+	return NM_BDG_BROADCAST;
+}
 
 /*
- * Lookup function for a learning bridge.
- * Update the hash table with the source address,
- * and then returns the destination port index, and the
- * ring in *dst_ring (at the moment, always use ring 0)
+ * Extract destination and source MAC from the frame in 'ft'.
+ * Returns 0 on success, or -1 if the frame must be dropped.
  */
-uint32_t
-netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
-		struct netmap_vp_adapter *na, void *private_data)
+static inline int
+nm_vale_parse_macs(struct nm_bdg_fwd *ft, uint64_t *dmac, uint64_t *smac)
 {
 	uint8_t *buf = ((uint8_t *)ft->ft_buf) + ft->ft_offset;
 	u_int buf_len = ft->ft_len - ft->ft_offset;
-	struct nm_hash_ent *ht = private_data;
-	uint32_t sh, dh;
-	u_int dst, mysrc = na->bdg_port;
-	uint64_t smac, dmac;
 	uint8_t indbuf[12];
 
 	if (buf_len < 14) {
-		return NM_BDG_NOPORT;
+		return -1;
 	}
 
 	if (ft->ft_flags & NS_INDIRECT) {
 		if (copyin(buf, indbuf, sizeof(indbuf))) {
-			return NM_BDG_NOPORT;
+			return -1;
 		}
 		buf = indbuf;
 	}
 
-	dmac = le64toh(*(uint64_t *)(buf)) & 0xffffffffffff;
-	smac = le64toh(*(uint64_t *)(buf + 4));
-	smac >>= 16;
+	*dmac = le64toh(*(uint64_t *)(buf)) & NM_HASH_MAC_MASK;
+	*smac = le64toh(*(uint64_t *)(buf + 4));
+	*smac >>= 16;
+	return 0;
+}
+
+/* multicast/broadcast bit of a MAC address extracted as above */
+#define NM_VALE_MAC_GROUP(mac)	((mac) & 1)
+
+static inline void
+nm_vale_learn_debug(uint64_t smac, u_int port)
+{
+	if (netmap_debug & NM_DEBUG_VALE)
+	    nm_prinf("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
+		(u_int)(smac & 0xff), (u_int)((smac >> 8) & 0xff),
+		(u_int)((smac >> 16) & 0xff), (u_int)((smac >> 24) & 0xff),
+		(u_int)((smac >> 32) & 0xff), (u_int)((smac >> 40) & 0xff),
+		port);
+}
+
+/*
+ * Symmetric flow hash, used to pick the destination ring when the
+ * bridge has NM_BDG_FLOW_STEERING set. Source and destination IP
+ * addresses and TCP/UDP/SCTP ports are combined with XOR, so that both
+ * directions of a flow get the same value. IP fragments only use the
+ * addresses, and frames that are not IP (or are in indirect buffers)
+ * use the MAC addresses.
+ */
+static inline uint32_t
+nm_vale_flow_hash(struct nm_bdg_fwd *ft, uint64_t dmac, uint64_t smac)
+{
+	const uint8_t *buf = ((uint8_t *)ft->ft_buf) + ft->ft_offset;
+	u_int len = ft->ft_len - ft->ft_offset;
+	u_int l3 = 14, l4 = 0, proto = 0, i;
+	uint32_t addrs = 0, w;
+	uint16_t ethertype, p[2];
+
+	if (ft->ft_flags & NS_INDIRECT)
+		goto l2;
+	ethertype = (buf[12] << 8) | buf[13];
+	if (ethertype == 0x8100 && len >= 18) { /* 802.1Q */
+		ethertype = (buf[16] << 8) | buf[17];
+		l3 = 18;
+	}
+	if (ethertype == 0x0800 && len >= l3 + 20) {
+		const uint8_t *ip = buf + l3;
+
+		memcpy(&w, ip + 12, sizeof(w));
+		addrs = w;
+		memcpy(&w, ip + 16, sizeof(w));
+		addrs ^= w;
+		proto = ip[9];
+		/* no MF flag and no fragment offset */
+		if ((ip[6] & 0x3f) == 0 && ip[7] == 0)
+			l4 = l3 + (ip[0] & 0xf) * 4;
+	} else if (ethertype == 0x86DD && len >= l3 + 40) {
+		const uint8_t *ip6 = buf + l3;
+
+		for (i = 8; i < 40; i += 4) {
+			memcpy(&w, ip6 + i, sizeof(w));
+			addrs ^= w;
+		}
+		proto = ip6[6];
+		l4 = l3 + 40;
+	} else {
+		goto l2;
+	}
+	p[0] = p[1] = 0;
+	if (l4 && (proto == 6 || proto == 17 || proto == 132) &&
+			len >= l4 + 4)
+		memcpy(p, buf + l4, sizeof(p));
+	return nm_bdg_mac_hash(((uint64_t)(p[0] ^ p[1] ^ proto) << 32) |
+			addrs);
+l2:
+	return nm_bdg_mac_hash(dmac ^ smac);
+}
+
+/*
+ * Lookup function for a learning bridge.
+ * Update the hash table with the source address,
+ * and then returns the destination port index, and the
+ * ring in *dst_ring (unchanged unless the bridge does flow steering)
+ */
+uint32_t
+netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_hash_table *ht = private_data;
+	u_int dst, mysrc = na->bdg_port;
+	uint64_t smac, dmac, stamp;
+	uint32_t epoch;
+
+	if (nm_vale_parse_macs(ft, &dmac, &smac)) {
+		return NM_BDG_NOPORT;
+	}
+	epoch = nm_hash_epoch(ht);
+	if (na->na_bdg->bdg_flags & NM_BDG_FLOW_STEERING)
+		*dst_ring = (uint8_t)nm_vale_flow_hash(ft, dmac, smac);
 
 	/*
-	 * The hash is somewhat expensive, there might be some
-	 * worthwhile optimizations here.
+	 * The hash is somewhat expensive, so we only refresh the
+	 * source entry when the source MAC changes or a new epoch
+	 * begins.
 	 */
-	if (((buf[6] & 1) == 0) && (na->last_smac != smac)) { /* valid src */
-		uint8_t *s = buf+6;
-		sh = nm_vale_rthash(s); /* hash of source */
+	stamp = smac | ((uint64_t)epoch << NM_HASH_EPOCH_SHIFT);
+	if (!NM_VALE_MAC_GROUP(smac) && na->last_smac != stamp) { /* valid src */
 		/* update source port forwarding entry */
-		na->last_smac = ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
-		if (netmap_debug & NM_DEBUG_VALE)
-		    nm_prinf("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
-			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
+		nm_vale_ht_learn(nm_hash_bucket(ht, nm_bdg_mac_hash(smac)),
+				smac, mysrc, epoch, &na->ft_stats);
+		na->last_smac = stamp;
+		nm_vale_learn_debug(smac, mysrc);
 	}
 	dst = NM_BDG_BROADCAST;
-	if ((buf[0] & 1) == 0) { /* unicast */
-		dh = nm_vale_rthash(buf); /* hash of dst */
-		if (ht[dh].mac == dmac) {	/* found dst */
-			dst = ht[dh].ports;
-		}
+	if (!NM_VALE_MAC_GROUP(dmac)) { /* unicast */
+		dst = nm_vale_ht_lookup(nm_hash_bucket(ht, nm_bdg_mac_hash(dmac)),
+				dmac, epoch);
+		if (dst == NM_BDG_BROADCAST)
+			na->ft_stats.misses++;
+		else
+			na->ft_stats.hits++;
 	}
+	if (dst == NM_BDG_BROADCAST)
+		na->ft_stats.floods++;
 	return dst;
 }
 
-
 /*
- * Available space in the ring. Only used in VALE code
- * and only with is_rx = 1
+ * Batched lookup function for a learning bridge, equivalent to
+ * calling netmap_vale_learning() on each packet.
+ * A first pass extracts the addresses, computes all the hashes and
+ * prefetches the buckets; a second pass updates and looks up the
+ * table, by then hopefully in cache.
  */
-static inline uint32_t
-nm_kr_space(struct netmap_kring *k, int is_rx)
+void
+netmap_vale_learning_batch(struct nm_bdg_fwd **ft, u_int n,
+		uint16_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na, void *private_data)
 {
-	int space;
+	struct nm_hash_table *ht = private_data;
+	struct nm_hash_ent *sb[NM_BDG_LOOKUP_BATCH], *db[NM_BDG_LOOKUP_BATCH];
+	uint64_t smac[NM_BDG_LOOKUP_BATCH], dmac[NM_BDG_LOOKUP_BATCH];
+	uint64_t stamp, last_smac = na->last_smac;
+	u_int i, mysrc = na->bdg_port;
+	uint32_t epoch = nm_hash_epoch(ht);
+	int steer = na->na_bdg->bdg_flags & NM_BDG_FLOW_STEERING;
+
+	if (unlikely(n > NM_BDG_LOOKUP_BATCH)) {
+		/* not expected from nm_vale_flush() */
+		for (i = 0; i < n; i++)
+			dst_port[i] = netmap_vale_learning(ft[i], &dst_ring[i],
+					na, private_data);
+		return;
+	}
 
-	if (is_rx) {
-		int busy = k->nkr_hwlease - k->nr_hwcur;
-		if (busy < 0)
-			busy += k->nkr_num_slots;
-		space = k->nkr_num_slots - 1 - busy;
-	} else {
-		/* XXX never used in this branch */
-		space = k->nr_hwtail - k->nkr_hwlease;
-		if (space < 0)
-			space += k->nkr_num_slots;
-	}
-#if 0
-	// sanity check
-	if (k->nkr_hwlease >= k->nkr_num_slots ||
-		k->nr_hwcur >= k->nkr_num_slots ||
-		k->nr_tail >= k->nkr_num_slots ||
-		busy < 0 ||
-		busy >= k->nkr_num_slots) {
-		nm_prerr("invalid kring, cur %d tail %d lease %d lease_idx %d lim %d",
-		    k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
-		    k->nkr_lease_idx, k->nkr_num_slots);
-	}
-#endif
-	return space;
+	for (i = 0; i < n; i++) {
+		sb[i] = db[i] = NULL;
+		if (nm_vale_parse_macs(ft[i], &dmac[i], &smac[i])) {
+			dst_port[i] = NM_BDG_NOPORT;
+			continue;
+		}
+		dst_port[i] = NM_BDG_BROADCAST;
+		if (steer)
+			dst_ring[i] = (uint8_t)nm_vale_flow_hash(ft[i],
+					dmac[i], smac[i]);
+		/* same rule as netmap_vale_learning(), so only the
+		 * first packet of a run from the same source is learned */
+		stamp = smac[i] | ((uint64_t)epoch << NM_HASH_EPOCH_SHIFT);
+		if (!NM_VALE_MAC_GROUP(smac[i]) && last_smac != stamp) {
+			sb[i] = nm_hash_bucket(ht, nm_bdg_mac_hash(smac[i]));
+			__builtin_prefetch(sb[i], 1);
+			last_smac = stamp;
+		}
+		if (!NM_VALE_MAC_GROUP(dmac[i])) {
+			db[i] = nm_hash_bucket(ht, nm_bdg_mac_hash(dmac[i]));
+			__builtin_prefetch(db[i]);
+		}
+	}
+	na->last_smac = last_smac;
+
+	for (i = 0; i < n; i++) {
+		if (dst_port[i] == NM_BDG_NOPORT)
+			continue;
+		if (sb[i] != NULL) {
+			nm_vale_ht_learn(sb[i], smac[i], mysrc, epoch,
+					&na->ft_stats);
+			nm_vale_learn_debug(smac[i], mysrc);
+		}
+		if (db[i] != NULL) {
+			dst_port[i] = nm_vale_ht_lookup(db[i], dmac[i], epoch);
+			if (dst_port[i] == NM_BDG_BROADCAST)
+				na->ft_stats.misses++;
+			else
+				na->ft_stats.hits++;
+		}
+		if (dst_port[i] == NM_BDG_BROADCAST)
+			na->ft_stats.floods++;
+	}
 }
 
 
+/*
+ * Copy the 'cnt' fragments starting at ft_p into the destination ring,
+ * starting from slot j. Returns the next slot to be filled.
+ */
+static inline u_int
+nm_vale_copy_frags(struct netmap_vp_adapter *na,
+		struct netmap_vp_adapter *dst_na, struct netmap_ring *ring,
+		struct nm_bdg_fwd *ft_p, u_int cnt, u_int j, u_int lim)
+{
+	struct nm_bdg_fwd *ft_end = ft_p + cnt;
+	struct netmap_slot *slot;
+
+	do {
+		char *dst, *src = ft_p->ft_buf;
+		size_t copy_len = ft_p->ft_len, dst_len = copy_len;
+
+		slot = &ring->slot[j];
+		dst = NMB(&dst_na->up, slot);
+
+		nm_prdis("send %d(%d) bytes at %s:%d",
+				(int)copy_len, (int)dst_len,
+				dst_na->up.name, j);
+		/* round to a multiple of 64 */
+		copy_len = (copy_len + 63) & ~63;
+
+		if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
+			     copy_len > NETMAP_BUF_SIZE(&na->up))) {
+			nm_prlim(5, "invalid len %d, down to 64", (int)copy_len);
+			copy_len = dst_len = 64; // XXX
+		}
+		if (ft_p->ft_flags & NS_INDIRECT) {
+			if (copyin(src, dst, copy_len)) {
+				// invalid user pointer, pretend len is 0
+				dst_len = 0;
+			}
+		} else {
+			//memcpy(dst, src, copy_len);
+			pkt_copy(src, dst, (int)copy_len);
+		}
+		slot->len = dst_len;
+		slot->flags = (cnt << 8)| NS_MOREFRAG;
+		j = nm_next(j, lim);
+		ft_p++;
+	} while (ft_p != ft_end);
+	slot->flags = (cnt << 8); /* clear flag on last entry */
+	return j;
+}
 
+/* Number of packets in the queue that starts at ft[next]. */
+static inline u_int
+nm_vale_q_count(struct nm_bdg_fwd *ft, u_int next)
+{
+	u_int n = 0;
+
+	for (; next != NM_FT_NULL; next = ft[next].ft_next)
+		n++;
+	return n;
+}
 
-/* make a lease on the kring for N positions. return the
- * lease index
- * XXX only used in VALE code and with is_rx = 1
+/*
+ * Complete the lease obtained with nm_kr_lease() (see
+ * nm_kr_lease_complete()) and account for 'pkts' packets delivered,
+ * 'drops' packets lost and 'merged' segments coalesced by GRO.
+ * If this makes new slots visible to the receiver, notify it and
+ * return 1 (the q_lock has been released before the notification),
+ * otherwise return 0.
  */
-static inline uint32_t
-nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
+static int
+nm_vale_lease_complete(struct netmap_kring *kring, uint32_t lease_idx,
+		uint32_t my_start, u_int j, u_int howmany, u_int pkts,
+		u_int drops, u_int merged)
 {
-	uint32_t lim = k->nkr_num_slots - 1;
-	uint32_t lease_idx = k->nkr_lease_idx;
-
-	k->nkr_leases[lease_idx] = NR_NOSLOT;
-	k->nkr_lease_idx = nm_next(lease_idx, lim);
-
-#ifdef CONFIG_NETMAP_DEBUG
-	if (n > nm_kr_space(k, is_rx)) {
-		nm_prerr("invalid request for %d slots", n);
-		panic("x");
-	}
-#endif /* CONFIG NETMAP_DEBUG */
-	/* XXX verify that there are n slots */
-	k->nkr_hwlease += n;
-	if (k->nkr_hwlease > lim)
-		k->nkr_hwlease -= lim + 1;
-
-#ifdef CONFIG_NETMAP_DEBUG
-	if (k->nkr_hwlease >= k->nkr_num_slots ||
-		k->nr_hwcur >= k->nkr_num_slots ||
-		k->nr_hwtail >= k->nkr_num_slots ||
-		k->nkr_lease_idx >= k->nkr_num_slots) {
-		nm_prerr("invalid kring %s, cur %d tail %d lease %d lease_idx %d lim %d",
-			k->na->name,
-			k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
-			k->nkr_lease_idx, k->nkr_num_slots);
-	}
-#endif /* CONFIG_NETMAP_DEBUG */
-	return lease_idx;
+	mtx_lock(&kring->q_lock);
+	kring->nkr_rx_pkts += pkts;
+	kring->nkr_rx_drops += drops;
+	kring->nkr_gro_merged += merged;
+	if (nm_kr_lease_complete(kring, lease_idx, my_start, j, howmany)) {
+		mtx_unlock(&kring->q_lock);
+		kring->nm_notify(kring, 0);
+		/* this is netmap_notify for VALE ports and
+		 * netmap_bwrap_notify for bwrap. The latter will
+		 * trigger a txsync on the underlying hwna
+		 */
+		return 1;
+	}
+	mtx_unlock(&kring->q_lock);
+	return 0;
+}
+
+/* State of a destination in nm_vale_flush_bcast() */
+struct nm_vale_bcast_dst {
+	struct netmap_vp_adapter *na;
+	struct netmap_kring *kring;
+	uint32_t start;		/* first slot of the lease */
+	uint32_t lease_idx;
+	u_int j;		/* next slot to fill */
+	u_int howmany;		/* reserved slots not yet filled */
+	u_int sent;		/* packets copied */
+	int full;		/* a packet did not fit, stop here */
+};
+
+/*
+ * Deliver the broadcast queue of ring r to the ports listed in 'ports',
+ * which receive no unicast traffic on that ring in this batch and need
+ * no virtio-net header conversion nor retries.
+ * Rather than reading the whole queue once per destination, we reserve
+ * slots on a group of NM_BDG_BCAST_BATCH destinations and then copy
+ * each packet to all of them, so that the source buffer is read from
+ * memory once per group.
+ */
+static void
+nm_vale_flush_bcast(struct nm_bdg_fwd *ft, struct nm_vale_q *brddst,
+		u_int r, struct netmap_vp_adapter *na, struct nm_bridge *b,
+		const uint16_t *ports, u_int nports)
+{
+	u_int k, npkts;
+
+	if (nports == 0)
+		return;
+	npkts = nm_vale_q_count(ft, brddst->bq_head);
+
+	for (k = 0; k < nports; k += NM_BDG_BCAST_BATCH) {
+		struct nm_vale_bcast_dst bd[NM_BDG_BCAST_BATCH];
+		u_int q, nd = 0, live, next;
+
+		/* reserve space on each destination of the group */
+		for (q = k; q < nports && q < k + NM_BDG_BCAST_BATCH; q++) {
+			struct netmap_vp_adapter *dst_na =
+				BDG_GET_VAR(b->bdg_ports[ports[q]]);
+			struct netmap_kring *kring;
+			u_int howmany;
+
+			if (unlikely(dst_na == NULL))
+				continue;
+			if (dst_na->up.na_flags & NAF_SW_ONLY)
+				continue;
+			if (unlikely(!nm_netmap_on(&dst_na->up)))
+				continue;
+			kring = dst_na->up.rx_rings[r % dst_na->up.num_rx_rings];
+			if (unlikely(kring->ring == NULL ||
+					kring->nr_mode != NKR_NETMAP_ON))
+				continue;
+			mtx_lock(&kring->q_lock);
+			if (kring->nkr_stopped) {
+				mtx_unlock(&kring->q_lock);
+				continue;
+			}
+			bd[nd].j = bd[nd].start = kring->nkr_hwlease;
+			howmany = nm_kr_space(kring, 1);
+			if (brddst->bq_len < howmany)
+				howmany = brddst->bq_len;
+			bd[nd].lease_idx = nm_kr_lease(kring, howmany, 1);
+			mtx_unlock(&kring->q_lock);
+			bd[nd].na = dst_na;
+			bd[nd].kring = kring;
+			bd[nd].howmany = howmany;
+			bd[nd].sent = 0;
+			bd[nd].full = 0;
+			nd++;
+		}
+
+		/* copy each packet to all the destinations of the group */
+		live = nd;
+		for (next = brddst->bq_head; live > 0 && next != NM_FT_NULL;
+				next = ft[next].ft_next) {
+			struct nm_bdg_fwd *ft_p = ft + next;
+			u_int cnt = ft_p->ft_frags;
+
+			for (q = 0; q < nd; q++) {
+				struct nm_vale_bcast_dst *d = bd + q;
+
+				if (d->full)
+					continue;
+				if (unlikely(cnt > d->howmany)) {
+					d->full = 1; /* no more space */
+					live--;
+					continue;
+				}
+				d->j = nm_vale_copy_frags(na, d->na, d->kring->ring,
+						ft_p, cnt, d->j,
+						d->kring->nkr_num_slots - 1);
+				d->howmany -= cnt;
+				d->sent++;
+			}
+		}
+
+		for (q = 0; q < nd; q++) {
+			nm_vale_lease_complete(bd[q].kring, bd[q].lease_idx,
+					bd[q].start, bd[q].j, bd[q].howmany,
+					bd[q].sent, npkts - bd[q].sent, 0);
+		}
+	}
 }
 
 /*
@@ -870,91 +1375,165 @@ nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
  * number of ports, and lets us replace the learn and dispatch functions.
  */
 int
-nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
-		u_int ring_nr)
+nm_vale_flush(struct netmap_kring *src_kring, u_int n)
 {
+	struct nm_bdg_fwd *ft = src_kring->nkr_ft;
+	struct netmap_vp_adapter *na =
+		(struct netmap_vp_adapter *)src_kring->na;
+	u_int ring_nr = src_kring->ring_id;
+	u_int nports = src_kring->nkr_ft_ports;
+	u_int nrings = src_kring->nkr_ft_rings;
 	struct nm_vale_q *dst_ents, *brddst;
-	uint16_t num_dsts = 0, *dsts;
+	uint16_t *dsts, *bdsts;
+	u_int num_dsts = 0, num_bdsts;
 	struct nm_bridge *b = na->na_bdg;
-	u_int i, me = na->bdg_port;
+	u_int i, r, me = na->bdg_port;
+	int steer = b->bdg_flags & NM_BDG_FLOW_STEERING;
 
 	/*
 	 * The work area (pointed by ft) is followed by an array of
-	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * pointers to queues , dst_ents; there are nrings queues
+	 * for each of the nports ports plus nrings for the broadcast
+	 * traffic. Then we have an array of destination indexes,
+	 * large enough for one entry per packet and one per port and ring.
 	 */
 	dst_ents = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
-
-	/* first pass: find a destination for each packet in the batch */
-	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
-		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
-		uint16_t dst_port, d_i;
-		struct nm_vale_q *d;
-		struct nm_bdg_fwd *start_ft = NULL;
-
-		nm_prdis("slot %d frags %d", i, ft[i].ft_frags);
-
-		if (na->up.virt_hdr_len < ft[i].ft_len) {
-			ft[i].ft_offset = na->up.virt_hdr_len;
-			start_ft = &ft[i];
-		} else if (na->up.virt_hdr_len == ft[i].ft_len && ft[i].ft_flags & NS_MOREFRAG) {
-			ft[i].ft_offset = ft[i].ft_len;
-			start_ft = &ft[i+1];
+	brddst = dst_ents + nports * nrings;
+	dsts = (uint16_t *)(brddst + nrings);
+	bdsts = dsts + NM_BDG_BATCH_MAX + nports * nrings; /* filled backwards */
+
+	/* first pass: find a destination for each packet in the batch.
+	 * Packets are classified in groups of NM_BDG_LOOKUP_BATCH,
+	 * with a single call to lookup_batch() if the bridge has one.
+	 */
+	for (i = 0; likely(i < n); ) {
+		struct nm_bdg_fwd *start_ft[NM_BDG_LOOKUP_BATCH];
+		uint16_t head[NM_BDG_LOOKUP_BATCH];
+		uint16_t dst_port[NM_BDG_LOOKUP_BATCH];
+		uint8_t dst_ring[NM_BDG_LOOKUP_BATCH];
+		u_int k, m = 0;
+
+		for (; likely(i < n) && m < NM_BDG_LOOKUP_BATCH;
+				i += ft[i].ft_frags) {
+			nm_prdis("slot %d frags %d", i, ft[i].ft_frags);
+
+			if (na->up.virt_hdr_len < ft[i].ft_len) {
+				ft[i].ft_offset = na->up.virt_hdr_len;
+				start_ft[m] = &ft[i];
+			} else if (na->up.virt_hdr_len == ft[i].ft_len && ft[i].ft_flags & NS_MOREFRAG) {
+				ft[i].ft_offset = ft[i].ft_len;
+				start_ft[m] = &ft[i+1];
+			} else {
+				/* Drop the packet if the virtio-net header is not into the first
+				 * fragment nor at the very beginning of the second.
+				 */
+				continue;
+			}
+			head[m] = i;
+			dst_ring[m] = ring_nr; /* default, same ring as origin */
+			m++;
+		}
+
+		if (b->bdg_ops.lookup_batch) {
+			b->bdg_ops.lookup_batch(start_ft, m, dst_port, dst_ring,
+					na, b->private_data);
 		} else {
-			/* Drop the packet if the virtio-net header is not into the first
-			 * fragment nor at the very beginning of the second.
-			 */
-			continue;
+			for (k = 0; k < m; k++)
+				dst_port[k] = b->bdg_ops.lookup(start_ft[k],
+					&dst_ring[k], na, b->private_data);
 		}
-		dst_port = b->bdg_ops.lookup(start_ft, &dst_ring, na, b->private_data);
-		if (netmap_verbose > 255)
-			nm_prlim(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port >= NM_BDG_NOPORT)
-			continue; /* this packet is identified to be dropped */
-		else if (dst_port == NM_BDG_BROADCAST)
-			dst_ring = 0; /* broadcasts always go to ring 0 */
-		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
-			continue;
 
-		/* get a position in the scratch pad */
-		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
-		d = dst_ents + d_i;
+		for (k = 0; k < m; k++) {
+			u_int j = head[k];
+			uint16_t d_i;
+			struct nm_vale_q *d;
+
+			if (netmap_verbose > 255)
+				nm_prlim(5, "slot %d port %d -> %d", j, me, dst_port[k]);
+			if (dst_port[k] >= NM_BDG_NOPORT)
+				continue; /* this packet is identified to be dropped */
+			if (dst_port[k] == NM_BDG_BROADCAST) {
+				/* without steering broadcasts go to ring 0 */
+				if (!steer)
+					dst_ring[k] = 0;
+				else if (dst_ring[k] >= nrings)
+					dst_ring[k] %= nrings;
+			} else {
+				struct netmap_vp_adapter *dst_na;
+				u_int dn;
 
-		/* append the first fragment to the list */
-		if (d->bq_head == NM_FT_NULL) { /* new destination */
-			d->bq_head = d->bq_tail = i;
-			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
-				dsts[num_dsts++] = d_i;
-		} else {
-			ft[d->bq_tail].ft_next = i;
-			d->bq_tail = i;
+				if (unlikely(dst_port[k] == me ||
+				    dst_port[k] >= b->bdg_max_ports))
+					continue;
+				dst_na = BDG_GET_VAR(b->bdg_ports[dst_port[k]]);
+				if (unlikely(dst_na == NULL))
+					continue;
+				/* use the rings the destination has */
+				dn = dst_na->up.num_rx_rings;
+				if (unlikely(dn == 0 || dn > nrings))
+					dn = nrings;
+				if (dst_ring[k] >= dn)
+					dst_ring[k] %= dn;
+			}
+
+			/* get a position in the scratch pad */
+			if (dst_port[k] == NM_BDG_BROADCAST)
+				d_i = nports * nrings + dst_ring[k];
+			else
+				d_i = dst_port[k] * nrings + dst_ring[k];
+			d = dst_ents + d_i;
+
+			/* append the first fragment to the list */
+			if (d->bq_head == NM_FT_NULL) { /* new destination */
+				d->bq_head = d->bq_tail = j;
+				/* remember this position to be scanned later */
+				if (dst_port[k] != NM_BDG_BROADCAST)
+					dsts[num_dsts++] = d_i;
+			} else {
+				ft[d->bq_tail].ft_next = j;
+				d->bq_tail = j;
+			}
+			d->bq_len += ft[j].ft_frags;
 		}
-		d->bq_len += ft[i].ft_frags;
 	}
 
 	/*
-	 * Broadcast traffic goes to ring 0 on all destinations.
-	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
+	 * The broadcast traffic of queue r goes to ring r (modulo the
+	 * number of rings) on all destinations. Ports that also have
+	 * unicast traffic on ring r, or that need header conversion or
+	 * retries, are added to the list of ports to scan in the second
+	 * pass. All the others are collected (at the end of dsts[]) and
+	 * served by nm_vale_flush_bcast().
 	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
-	if (brddst->bq_head != NM_FT_NULL) {
-		u_int j;
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
+	for (r = 0; r < nrings; r++) {
+		/* a detach may publish a new list of active ports
+		 * at any time, read it only once */
+		uint32_t *port_index = BDG_GET_VAR(b->bdg_port_index);
+		u_int j, active_ports = BDG_GET_VAR(b->bdg_active_ports);
+
+		if (brddst[r].bq_head == NM_FT_NULL)
+			continue;
+		num_bdsts = 0;
+		for (j = 0; likely(j < active_ports); j++) {
+			struct netmap_vp_adapter *dst_na;
 			uint16_t d_i;
-			i = b->bdg_port_index[j];
+			i = port_index[j];
 			if (unlikely(i == me))
 				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
+			d_i = i * nrings + r;
+			if (dst_ents[d_i].bq_head != NM_FT_NULL)
+				continue;
+			dst_na = BDG_GET_VAR(b->bdg_ports[i]);
+			if (dst_na != NULL && !dst_na->retry &&
+			    dst_na->up.virt_hdr_len == na->up.virt_hdr_len) {
+				num_bdsts++;
+				bdsts[-num_bdsts] = i;
+			} else {
 				dsts[num_dsts++] = d_i;
+			}
 		}
+		nm_vale_flush_bcast(ft, brddst + r, r, na, b,
+				bdsts - num_bdsts, num_bdsts);
 	}
 
 	nm_prdis(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
@@ -964,18 +1543,20 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		struct netmap_kring *kring;
 		struct netmap_ring *ring;
 		u_int dst_nr, lim, j, d_i, next, brd_next;
-		u_int needed, howmany;
-		int retry = netmap_txsync_retry;
-		struct nm_vale_q *d;
+		u_int needed, howmany, sent, lost, merged;
+		int retry = netmap_txsync_retry, can_retry;
+		struct nm_vale_q *d, *brd;
 		uint32_t my_start = 0, lease_idx = 0;
-		int nrings;
-		int virt_hdr_mismatch = 0;
+		int dst_nrings;
+		int virt_hdr_mismatch = 0, gro = 0;
 
 		d_i = dsts[i];
 		nm_prdis("second pass %d port %d", i, d_i);
 		d = dst_ents + d_i;
+		/* the broadcast queue for the same ring */
+		brd = brddst + d_i % nrings;
 		// XXX fix the division
-		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
+		dst_na = BDG_GET_VAR(b->bdg_ports[d_i / nrings]);
 		/* protect from the lookup function returning an inactive
 		 * destination port
 		 */
@@ -994,7 +1575,7 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		}
 
 		/* there is at least one either unicast or broadcast packet */
-		brd_next = brddst->bq_head;
+		brd_next = brd->bq_head;
 		next = d->bq_head;
 		/* we need to reserve this many slots. If fewer are
 		 * available, some packets will be dropped.
@@ -1003,7 +1584,7 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		 * we have claimed, so we will need to handle the leftover
 		 * ones when we regain the lock.
 		 */
-		needed = d->bq_len + brddst->bq_len;
+		needed = d->bq_len + brd->bq_len;
 
 		if (unlikely(dst_na->up.virt_hdr_len != na->up.virt_hdr_len)) {
 			if (netmap_verbose) {
@@ -1015,6 +1596,10 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			 * be used to cope with all the mismatches.
 			 */
 			virt_hdr_mismatch = 1;
+			/* Plain frames towards an offloading port may be
+			 * coalesced. */
+			gro = (b->bdg_flags & NM_BDG_GRO) &&
+				na->up.virt_hdr_len == 0;
 			if (dst_na->mfs < na->mfs) {
 				/* We may need to do segmentation offloadings, and so
 				 * we may need a number of destination slots greater
@@ -1035,10 +1620,10 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 
 		nm_prdis(5, "pass 2 dst %d is %x %s",
 			i, d_i, is_vp ? "virtual" : "nic/host");
-		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
-		nrings = dst_na->up.num_rx_rings;
-		if (dst_nr >= nrings)
-			dst_nr = dst_nr % nrings;
+		dst_nr = d_i % nrings;
+		dst_nrings = dst_na->up.num_rx_rings;
+		if (dst_nr >= dst_nrings)
+			dst_nr = dst_nr % dst_nrings;
 		kring = dst_na->up.rx_rings[dst_nr];
 		ring = kring->ring;
 		/* the destination ring may have not been opened for RX */
@@ -1075,12 +1660,13 @@ retry:
 		/* only retry if we need more than available slots */
 		if (retry && needed <= howmany)
 			retry = 0;
+		sent = lost = merged = 0;
 
 		/* copy to the destination queue */
 		while (howmany > 0) {
-			struct netmap_slot *slot;
-			struct nm_bdg_fwd *ft_p, *ft_end;
+			struct nm_bdg_fwd *ft_p;
 			u_int cnt;
+			int unicast = 0;
 
 			/* find the queue from which we pick next packet.
 			 * NM_FT_NULL is always higher than valid indexes
@@ -1091,128 +1677,71 @@ retry:
 			if (next < brd_next) {
 				ft_p = ft + next;
 				next = ft_p->ft_next;
+				unicast = 1;
 			} else { /* insert broadcast */
 				ft_p = ft + brd_next;
 				brd_next = ft_p->ft_next;
 			}
 			cnt = ft_p->ft_frags; // cnt > 0
-			if (unlikely(cnt > howmany))
-			    break; /* no more space */
+			if (unlikely(cnt > howmany)) {
+				lost++; /* no more space */
+				break;
+			}
 			if (netmap_verbose && cnt > 1)
 				nm_prlim(5, "rx %d frags to %d", cnt, j);
-			ft_end = ft_p + cnt;
 			if (unlikely(virt_hdr_mismatch)) {
-				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
+				if (gro && unicast) {
+					/* may take more packets from 'next' */
+					u_int segs = bdg_gro_datapath(na,
+						dst_na, ft, ft_p, &next, brd_next,
+						ring, &j, lim, &howmany);
+
+					sent += segs;
+					merged += segs;
+				} else {
+					bdg_mismatch_datapath(na, dst_na, ft_p,
+						ring, &j, lim, &howmany);
+				}
 			} else {
 				howmany -= cnt;
-				do {
-					char *dst, *src = ft_p->ft_buf;
-					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
-
-					slot = &ring->slot[j];
-					dst = NMB(&dst_na->up, slot);
-
-					nm_prdis("send [%d] %d(%d) bytes at %s:%d",
-							i, (int)copy_len, (int)dst_len,
-							NM_IFPNAME(dst_ifp), j);
-					/* round to a multiple of 64 */
-					copy_len = (copy_len + 63) & ~63;
-
-					if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
-						     copy_len > NETMAP_BUF_SIZE(&na->up))) {
-						nm_prlim(5, "invalid len %d, down to 64", (int)copy_len);
-						copy_len = dst_len = 64; // XXX
-					}
-					if (ft_p->ft_flags & NS_INDIRECT) {
-						if (copyin(src, dst, copy_len)) {
-							// invalid user pointer, pretend len is 0
-							dst_len = 0;
-						}
-					} else {
-						//memcpy(dst, src, copy_len);
-						pkt_copy(src, dst, (int)copy_len);
-					}
-					slot->len = dst_len;
-					slot->flags = (cnt << 8)| NS_MOREFRAG;
-					j = nm_next(j, lim);
-					needed--;
-					ft_p++;
-				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
+				needed -= cnt;
+				j = nm_vale_copy_frags(na, dst_na, ring, ft_p, cnt,
+						j, lim);
 			}
+			sent++;
 			/* are we done ? */
 			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
 				break;
 		}
-		{
-		    /* current position */
-		    uint32_t *p = kring->nkr_leases; /* shorthand */
-		    uint32_t update_pos;
-		    int still_locked = 1;
-
-		    mtx_lock(&kring->q_lock);
-		    if (unlikely(howmany > 0)) {
-			/* not used all bufs. If i am the last one
-			 * i can recover the slots, otherwise must
-			 * fill them with 0 to mark empty packets.
+		/* what is left in the queues is lost, unless we retry */
+		can_retry = dst_na->retry && retry;
+		if (!can_retry)
+			lost += nm_vale_q_count(ft, next) +
+				nm_vale_q_count(ft, brd_next);
+		if (nm_vale_lease_complete(kring, lease_idx, my_start, j, howmany,
+					sent, lost, merged) && can_retry) {
+			/* XXX this is going to call nm_notify again.
+			 * Only useful for bwrap in virtual machines
 			 */
-			nm_prdis("leftover %d bufs", howmany);
-			if (nm_next(lease_idx, lim) == kring->nkr_lease_idx) {
-			    /* yes i am the last one */
-			    nm_prdis("roll back nkr_hwlease to %d", j);
-			    kring->nkr_hwlease = j;
-			} else {
-			    while (howmany-- > 0) {
-				ring->slot[j].len = 0;
-				ring->slot[j].flags = 0;
-				j = nm_next(j, lim);
-			    }
-			}
-		    }
-		    p[lease_idx] = j; /* report I am done */
-
-		    update_pos = kring->nr_hwtail;
-
-		    if (my_start == update_pos) {
-			/* all slots before my_start have been reported,
-			 * so scan subsequent leases to see if other ranges
-			 * have been completed, and to a selwakeup or txsync.
-		         */
-			while (lease_idx != kring->nkr_lease_idx &&
-				p[lease_idx] != NR_NOSLOT) {
-			    j = p[lease_idx];
-			    p[lease_idx] = NR_NOSLOT;
-			    lease_idx = nm_next(lease_idx, lim);
-			}
-			/* j is the new 'write' position. j != my_start
-			 * means there are new buffers to report
-			 */
-			if (likely(j != my_start)) {
-				kring->nr_hwtail = j;
-				still_locked = 0;
-				mtx_unlock(&kring->q_lock);
-				kring->nm_notify(kring, 0);
-				/* this is netmap_notify for VALE ports and
-				 * netmap_bwrap_notify for bwrap. The latter will
-				 * trigger a txsync on the underlying hwna
-				 */
-				if (dst_na->retry && retry--) {
-					/* XXX this is going to call nm_notify again.
-					 * Only useful for bwrap in virtual machines
-					 */
-					goto retry;
-				}
-			}
-		    }
-		    if (still_locked)
+			retry--;
+			goto retry;
+		}
+		if (can_retry) {
+			/* no new slots were made visible, give up */
+			lost = nm_vale_q_count(ft, next) +
+				nm_vale_q_count(ft, brd_next);
+			mtx_lock(&kring->q_lock);
+			kring->nkr_rx_drops += lost;
 			mtx_unlock(&kring->q_lock);
 		}
 cleanup:
 		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
 		d->bq_len = 0;
 	}
-	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
-	brddst->bq_len = 0;
+	for (r = 0; r < nrings; r++) {
+		brddst[r].bq_head = brddst[r].bq_tail = NM_FT_NULL; /* cleanup */
+		brddst[r].bq_len = 0;
+	}
 	return 0;
 }
 
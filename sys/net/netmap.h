@@ -537,6 +537,18 @@ enum {
 	NETMAP_REQ_SYNC_KLOOP_STOP,
 	/* Enable CSB mode on a registered netmap control device. */
 	NETMAP_REQ_CSB_ENABLE,
+	/* Get or set the forwarding table parameters of a VALE switch,
+	 * and get its statistics. */
+	NETMAP_REQ_VALE_FTABLE,
+	/* Get the per-ring receive counters of a VALE port, or of an
+	 * interface in emulated netmap mode. */
+	NETMAP_REQ_VALE_RING_STATS,
+	/* Get the counters of the copy monitor bound to this control
+	 * device. */
+	NETMAP_REQ_MONITOR_STATS,
+	/* Get the per-worker counters of the sync kloop running on this
+	 * control device. */
+	NETMAP_REQ_SYNC_KLOOP_STATS,
 };
 
 enum {
@@ -563,6 +575,28 @@ enum {
 	 */
 	NETMAP_REQ_OPT_SYNC_KLOOP_MODE,
 
+	/* On NETMAP_REQ_REGISTER of a copy monitor, only copy the packets
+	 * accepted by a classic BPF program (see struct
+	 * nmreq_opt_monitor_filter).
+	 */
+	NETMAP_REQ_OPT_MONITOR_FILTER,
+
+	/* On NETMAP_REQ_REGISTER of a copy monitor, copy at most
+	 * the first nro_snaplen bytes of each packet.
+	 */
+	NETMAP_REQ_OPT_MONITOR_SNAPLEN,
+
+	/* On NETMAP_REQ_REGISTER of a copy monitor, only copy one
+	 * packet every nro_rate and/or at most nro_pps packets per
+	 * second (see struct nmreq_opt_monitor_sampling).
+	 */
+	NETMAP_REQ_OPT_MONITOR_SAMPLING,
+
+	/* On NETMAP_REQ_SYNC_KLOOP_START, split the rings among several
+	 * kernel threads (see struct nmreq_opt_sync_kloop_workers).
+	 */
+	NETMAP_REQ_OPT_SYNC_KLOOP_WORKERS,
+
 	/* This is a marker to count the number of available options.
 	 * New options must be added above it. */
 	NETMAP_REQ_OPT_MAX,
@@ -728,6 +762,88 @@ struct nmreq_vale_polling {
 	uint32_t	pad1;
 };
 
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_FTABLE
+ * Get or set the parameters of the forwarding table used by the learning
+ * VALE switch named in hdr.nr_name (either "valeX:" or the name of one of
+ * its ports), and read the forwarding statistics of the switch.
+ * A zero nr_buckets or nr_ageing_time leaves the corresponding parameter
+ * unchanged; on return all fields contain the current values.
+ * nr_buckets is rounded up to a power of 2. Resizing the table keeps
+ * the learned entries that still fit.
+ * nr_steering selects how packets are spread over the rx rings of the
+ * destination ports (only if NR_VALE_FTABLE_SET_STEERING is set):
+ * NR_VALE_STEER_SRC_RING (the default) uses the ring of the sender
+ * for unicast and ring 0 for broadcast; NR_VALE_STEER_FLOW_HASH uses
+ * a symmetric hash of the IP addresses and TCP/UDP ports (or of the
+ * MAC addresses for non-IP frames) for both, so the two directions
+ * of a flow end up on rings with the same index.
+ * nr_gro enables (1) or disables (0) the coalescing of TCP segments sent
+ * by ports without virtio-net headers to ports that have them (only if
+ * NR_VALE_FTABLE_SET_GRO is set). Consecutive in-order segments of the
+ * same flow found in a batch are delivered as a single GSO frame.
+ */
+struct nmreq_vale_ftable {
+	uint32_t	nr_buckets;	/* (in/out) number of hash buckets */
+	uint32_t	nr_ways;	/* (out) entries per bucket */
+	uint32_t	nr_ageing_time;	/* (in/out) seconds */
+	uint32_t	nr_flags;	/* (in) */
+#define NR_VALE_FTABLE_FLUSH		0x1	/* forget all the entries */
+#define NR_VALE_FTABLE_RESET_STATS	0x2	/* zero the counters */
+#define NR_VALE_FTABLE_SET_STEERING	0x4	/* apply nr_steering */
+#define NR_VALE_FTABLE_SET_GRO		0x8	/* apply nr_gro */
+	uint32_t	nr_entries;	/* (out) live entries */
+	uint32_t	nr_steering;	/* (in/out) */
+#define NR_VALE_STEER_SRC_RING		0
+#define NR_VALE_STEER_FLOW_HASH		1
+	uint64_t	nr_hits;	/* (out) unicast destination known */
+	uint64_t	nr_misses;	/* (out) unicast destination unknown */
+	uint64_t	nr_evictions;	/* (out) live entries replaced */
+	uint64_t	nr_floods;	/* (out) packets sent to all the ports */
+	uint32_t	nr_gro;		/* (in/out) */
+	uint32_t	pad1;
+	uint64_t	nr_gro_merged;	/* (out) segments coalesced by GRO */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_RING_STATS
+ * Get the number of packets delivered by the VALE switch to each
+ * rx ring of the port named in hdr.nr_name, and the number of packets
+ * dropped because the ring was full. Counters start from zero when
+ * the port is registered. Only the first NM_VALE_RING_STATS_MAX rings
+ * are reported.
+ * If hdr.nr_name is an interface in emulated netmap mode, the counters
+ * report the packets imported by rxsync and the packets dropped because
+ * the queue between the driver and the ring was full (see the
+ * dev.netmap.generic_rxqueue sysctl). EOPNOTSUPP is returned for
+ * other interfaces.
+ */
+#define NM_VALE_RING_STATS_MAX	16
+struct nmreq_vale_ring_stats {
+	uint32_t	nr_rx_rings;	/* (out) number of rings reported */
+	uint32_t	nr_flags;	/* (in) */
+#define NR_VALE_RING_STATS_RESET	0x1	/* zero after reading */
+	uint64_t	nr_rx_pkts[NM_VALE_RING_STATS_MAX];	/* (out) */
+	uint64_t	nr_rx_drops[NM_VALE_RING_STATS_MAX];	/* (out) */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_MONITOR_STATS
+ * Get the counters of the copy monitor bound to this control device,
+ * summed over all its rings: packets seen on the monitored rings,
+ * packets copied to the monitor (after sampling and filtering) and
+ * packets selected for copying but dropped because the monitor ring
+ * was full. Counters start from zero when the monitor is registered.
+ */
+struct nmreq_monitor_stats {
+	uint64_t	nr_seen;	/* (out) */
+	uint64_t	nr_sampled;	/* (out) */
+	uint64_t	nr_drops;	/* (out) */
+	uint32_t	nr_flags;	/* (in) */
+#define NR_MONITOR_STATS_RESET	0x1	/* zero after reading */
+	uint32_t	pad1;
+};
+
 /*
  * nr_reqtype: NETMAP_REQ_POOLS_INFO_GET
  * Get info about the pools of the memory allocator of the netmap
@@ -738,7 +854,11 @@ struct nmreq_vale_polling {
 struct nmreq_pools_info {
 	uint64_t	nr_memsize;
 	uint16_t	nr_mem_id; /* in/out argument */
-	uint16_t	pad1[3];
+	uint16_t	nr_pools_flags;	/* (out) */
+#define NR_POOLS_NUMA_NODE	0x1	/* pools found on nr_numa_node */
+#define NR_POOLS_BUF_HUGEPAGES	0x2	/* buffers live in hugepages */
+	uint16_t	nr_numa_node;	/* (out) valid if NR_POOLS_NUMA_NODE */
+	uint16_t	pad1;
 	uint64_t	nr_if_pool_offset;
 	uint32_t	nr_if_pool_objtotal;
 	uint32_t	nr_if_pool_objsize;
@@ -766,6 +886,26 @@ struct nmreq_sync_kloop_start {
 	uint32_t	pad1;
 };
 
+/*
+ * nr_reqtype: NETMAP_REQ_SYNC_KLOOP_STATS
+ * Get the counters of each worker of the sync kloop running on this
+ * control device (see NETMAP_REQ_OPT_SYNC_KLOOP_WORKERS). Without
+ * workers, the thread that started the kloop is reported as worker 0.
+ * Counters start from zero when the kloop is started. ENOENT is
+ * returned if no kloop is running.
+ */
+#define NM_SYNC_KLOOP_WORKERS_MAX	16
+struct nmreq_sync_kloop_stats {
+	uint32_t	nr_num_workers;	/* (out) */
+	uint32_t	pad1;
+	struct {
+		uint64_t	nr_busy_us;	/* time spent syncing rings */
+		uint64_t	nr_idle_us;	/* time spent sleeping */
+		uint64_t	nr_txsyncs;	/* txsync calls */
+		uint64_t	nr_rxsyncs;	/* rxsync calls */
+	} nr_workers[NM_SYNC_KLOOP_WORKERS_MAX];	/* (out) */
+};
+
 /* A CSB entry for the application --> kernel direction. */
 struct nm_csb_atok {
 	uint32_t head;		  /* AW+ KR+ the head of the appl netmap_ring */
@@ -914,7 +1054,34 @@ struct nmreq_opt_sync_kloop_mode {
 	struct nmreq_option	nro_opt;	/* common header */
 #define NM_OPT_SYNC_KLOOP_DIRECT_TX (1 << 0)
 #define NM_OPT_SYNC_KLOOP_DIRECT_RX (1 << 1)
+#define NM_OPT_SYNC_KLOOP_ADAPTIVE  (1 << 2)
 	uint32_t mode;
+	/* In adaptive mode each ring is polled on every iteration for
+	 * spin_us after it last had some work. Then it is polled at
+	 * exponentially growing intervals, up to backoff_max_us. After
+	 * that, if NETMAP_REQ_OPT_SYNC_KLOOP_EVENTFDS is also used, the
+	 * kloop stops polling the ring and waits for a notification.
+	 * Both values are in microseconds and at most one second.
+	 * The two fields are only read in adaptive mode, and nro_size
+	 * must then cover them.
+	 */
+	uint32_t spin_us;
+	uint32_t backoff_max_us;
+	uint32_t pad1;
+};
+
+/* Serve the rings with nro_num_workers kernel threads rather than in
+ * the thread that issued NETMAP_REQ_SYNC_KLOOP_START, which only waits
+ * for NETMAP_REQ_SYNC_KLOOP_STOP. Queue pair i (TX and RX ring i) is
+ * assigned to worker i % nro_num_workers. If nro_first_cpu is not
+ * negative, worker i is bound to CPU nro_first_cpu + i.
+ * Workers sleep for sleep_us between iterations, so the option cannot
+ * be combined with NETMAP_REQ_OPT_SYNC_KLOOP_EVENTFDS.
+ */
+struct nmreq_opt_sync_kloop_workers {
+	struct nmreq_option	nro_opt;	/* common header */
+	uint32_t		nro_num_workers;
+	int32_t			nro_first_cpu;
 };
 
 struct nmreq_opt_extmem {
@@ -935,4 +1102,48 @@ struct nmreq_opt_csb {
 	uint64_t		csb_ktoa;
 };
 
+/* One classic BPF instruction, laid out as struct bpf_insn, so that
+ * the output of pcap_compile() can be used as is. */
+struct nm_bpf_insn {
+	uint16_t	code;
+	uint8_t		jt;
+	uint8_t		jf;
+	uint32_t	k;
+};
+#define NM_BPF_MAXINSNS	4096
+
+/* The program is run on the first slot of every packet, as if it were
+ * the whole frame. A return value of 0 skips the packet, otherwise at
+ * most that many bytes of the packet are copied, starting from its
+ * first slot (a truncated packet ends at the last slot copied, without
+ * NS_MOREFRAG). Only the instructions
+ * of the classic BPF machine are supported (no extensions).
+ * nro_opt.nro_size must cover the nro_ninsns instructions.
+ */
+struct nmreq_opt_monitor_filter {
+	struct nmreq_option	nro_opt;	/* common header */
+	uint32_t		nro_ninsns;
+	uint32_t		pad1;
+	struct nm_bpf_insn	nro_insns[0];
+};
+
+struct nmreq_opt_monitor_snaplen {
+	struct nmreq_option	nro_opt;	/* common header */
+	uint32_t		nro_snaplen;	/* must be > 0 */
+	uint32_t		pad1;
+};
+
+/*
+ * nro_reqtype: NETMAP_REQ_OPT_MONITOR_SAMPLING
+ * Deterministic sampling for copy monitors: of the packets seen on
+ * each monitored ring pair, copy the first one of every nro_rate,
+ * and no more than nro_pps per second. The state is kept per monitor
+ * ring. Sampling is applied before the filter, if any.
+ */
+struct nmreq_opt_monitor_sampling {
+	struct nmreq_option	nro_opt;	/* common header */
+	uint32_t		nro_rate;	/* 0 or 1 to sample all packets */
+	uint32_t		nro_pps;	/* 0 for no limit */
+};
+
 #endif /* _NET_NETMAP_H_ */
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Compare the transmit rate of the emulated (generic) adapter on a
+# veth pair when packets are passed to the driver one by one and in
+# batches with xmit_more.
+#
+# usage: bench-generic-tx.sh [batch] [seconds]
+#
+# batch defaults to 32 packets.
+#
+# Needs root, a loaded netmap module, pkt-gen in $PATH (or $PKTGEN)
+# and ip(8). Batches bypass the qdisc, so both runs use
+# generic_txqdisc=0.
+
+BATCH=${1:-32}
+SECS=${2:-10}
+PKTGEN=${PKTGEN:-pkt-gen}
+PARAMS=/sys/module/netmap/parameters
+TX=nmgtx$$
+RX=nmgrx$$
+
+old_admode=$(cat $PARAMS/admode)
+old_txqdisc=$(cat $PARAMS/generic_txqdisc)
+old_batch=$(cat $PARAMS/generic_txbatch)
+
+cleanup() {
+	ip link del $TX 2> /dev/null
+	echo $old_admode > $PARAMS/admode
+	echo $old_txqdisc > $PARAMS/generic_txqdisc
+	echo $old_batch > $PARAMS/generic_txbatch
+}
+trap cleanup EXIT
+
+echo 2 > $PARAMS/admode
+echo 0 > $PARAMS/generic_txqdisc
+
+run() {
+	# the batch size is read when the adapter is created
+	ip link del $TX 2> /dev/null
+	echo $1 > $PARAMS/generic_txbatch
+	ip link add $TX type veth peer name $RX || exit 1
+	ip link set $TX up
+	ip link set $RX up
+	before=$(cat /sys/class/net/$RX/statistics/rx_packets)
+	echo "=== generic_txbatch=$1"
+	timeout -s INT $SECS $PKTGEN -i $TX -f tx -l 60 2>&1 |
+		grep -E "pps" | tail -n 1
+	after=$(cat /sys/class/net/$RX/statistics/rx_packets)
+	echo "$RX received $(( (after - before) / SECS )) pps"
+}
+
+run 1
+run $BATCH
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Compare dTLB misses of a pkt-gen pair over a VALE switch with the
+# global buffer pool built out of regular pages and out of hugepages.
+#
+# usage: bench-hugepages.sh [buf_num] [seconds]
+#
+# buf_num defaults to the largest global pool (1M buffers, 2 GB).
+#
+# Needs root, a loaded netmap module, pkt-gen in $PATH (or $PKTGEN),
+# perf(1), and transparent hugepages set to "madvise" or "always".
+# No other netmap application must be running, since the global
+# allocator is only reconfigured when it is not in use.
+#
+# While the sender runs, the huge page counters of /proc/meminfo and
+# the PMD-mapped size of the sender's netmap mapping are printed.
+# The mapping is PFNMAP, so the PMDs may not be accounted in every
+# counter on every kernel: the dTLB misses are the ground truth.
+
+BUF_NUM=${1:-1000000}
+SECS=${2:-10}
+PKTGEN=${PKTGEN:-pkt-gen}
+PARAMS=/sys/module/netmap/parameters
+SW=valehp$$
+
+old_num=$(cat $PARAMS/buf_num)
+old_huge=$(cat $PARAMS/buf_hugepages)
+
+cleanup() {
+	echo $old_num > $PARAMS/buf_num
+	echo $old_huge > $PARAMS/buf_hugepages
+}
+trap cleanup EXIT
+
+run() {
+	echo $BUF_NUM > $PARAMS/buf_num
+	echo $1 > $PARAMS/buf_hugepages
+	timeout -s INT $((SECS + 2)) $PKTGEN -i $SW:rx -f rx \
+		> /dev/null 2>&1 &
+	rxpid=$!
+	sleep 1
+	echo "=== buf_hugepages=$1 buf_num=$BUF_NUM"
+	perf stat -e dTLB-load-misses,dTLB-store-misses,instructions \
+		timeout -s INT $SECS $PKTGEN -i $SW:tx -f tx -l 60 2>&1 |
+		grep -E "TLB|instructions|pps" &
+	sleep $((SECS / 2))
+	grep -E "AnonHugePages|FilePmdMapped" /proc/meminfo
+	txpid=$(pgrep -n -f "$SW:tx")
+	[ -n "$txpid" ] && awk '/netmap/ { m = 1; next }
+		/^[0-9a-f]+-/ { m = 0 }
+		m && /PmdMapped|AnonHugePages/ { print "netmap mapping " $0 }' \
+		/proc/$txpid/smaps
+	wait
+	wait $rxpid
+}
+
+run 0
+run 1
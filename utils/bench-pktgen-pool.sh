@@ -0,0 +1,36 @@
+#!/bin/sh
+# Compare the multi-flow transmit rate of pkt-gen when each packet
+# is rewritten from a single template and when the frames come from
+# a pool of pre-built frames (-L).
+#
+# usage: bench-pktgen-pool.sh [flows] [seconds]
+#
+# flows defaults to 65536 (256 source ports times 256 destination
+# ports); the pool is as large as the number of flows.
+#
+# Needs root, a loaded netmap module and pkt-gen in $PATH (or
+# $PKTGEN). Packets are sent to a VALE port, so the rate is not
+# limited by a NIC.
+
+FLOWS=${1:-65536}
+SECS=${2:-10}
+PKTGEN=${PKTGEN:-pkt-gen}
+SW=valepool$$
+
+PORTS=$(( (FLOWS + 255) / 256 ))
+SRC=10.0.0.1:1000-10.0.0.1:$((1000 + PORTS - 1))
+DST=10.1.0.1:2000-10.1.0.1:2255
+
+run() {
+	timeout -s INT $((SECS + 2)) $PKTGEN -i $SW:rx -f rx \
+		> /dev/null 2>&1 &
+	rxpid=$!
+	sleep 1
+	echo "=== $1"
+	timeout -s INT $SECS $PKTGEN -i $SW:tx -f tx -l 60 -a 1 \
+		-s $SRC -d $DST $2 2>&1 | grep -E "pps" | tail -n 1
+	wait $rxpid
+}
+
+run "per-packet rewrite (copy)" "-o 4"
+run "pool of $FLOWS frames" "-L $FLOWS"
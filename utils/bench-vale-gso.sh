@@ -0,0 +1,33 @@
+#!/bin/sh
+# Measure VALE software segmentation: a "guest" port with virtio-net
+# headers sends 64 KB GSO frames to a "host" port without headers,
+# so the switch segments every frame and computes its checksums.
+# A second run sends the same traffic already segmented, which is
+# the cost the segmentation should be compared with.
+#
+# usage: bench-vale-gso.sh [frame_size] [seconds]
+#
+# frame_size defaults to 65000 bytes.
+#
+# Needs root, a loaded netmap module and pkt-gen in $PATH (or
+# $PKTGEN). pkt-gen only builds UDP frames, so the UDP flavour of
+# GSO is used; TCP segments go through the same code.
+
+SIZE=${1:-65000}
+SECS=${2:-10}
+PKTGEN=${PKTGEN:-pkt-gen}
+MSS=1472
+SW=valegso$$
+
+run() {
+	echo "=== $1"
+	timeout -s INT $((SECS + 2)) $PKTGEN -i $SW:host -f rx 2>&1 |
+		grep -E "pps" | tail -n 1 &
+	sleep 1
+	shift
+	timeout -s INT $SECS $PKTGEN -i $SW:guest -f tx "$@" > /dev/null 2>&1
+	wait
+}
+
+run "guest GSO frames of $SIZE bytes" -H 12 -G $MSS -l $SIZE -F 2
+run "guest frames of $((MSS + 42)) bytes" -H 12 -l $((MSS + 42))
@@ -594,6 +594,192 @@ vale_attach_detach_host_rings(struct TestContext *ctx)
 	return vale_attach_detach(ctx);
 }
 
+/* NETMAP_REQ_VALE_FTABLE */
+static int
+vale_ftable(struct TestContext *ctx)
+{
+	struct nmreq_vale_ftable req;
+	struct nmreq_header hdr;
+	char vpname[256];
+	int ret;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	snprintf(vpname, sizeof(vpname), "%s:", ctx->bdgname);
+	printf("Testing NETMAP_REQ_VALE_FTABLE on '%s'\n", vpname);
+
+	nmreq_hdr_init(&hdr, vpname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_FTABLE;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_buckets     = 4096;
+	req.nr_ageing_time = 60;
+	req.nr_flags       = NR_VALE_FTABLE_FLUSH | NR_VALE_FTABLE_RESET_STATS;
+	ret                = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_FTABLE)");
+		vale_detach(ctx);
+		return ret;
+	}
+	printf("nr_buckets %u nr_ways %u nr_ageing_time %u nr_entries %u\n",
+	       req.nr_buckets, req.nr_ways, req.nr_ageing_time,
+	       req.nr_entries);
+
+	if (req.nr_buckets != 4096 || req.nr_ageing_time != 60 ||
+	    req.nr_ways == 0 || req.nr_entries != 0 || req.nr_hits != 0) {
+		vale_detach(ctx);
+		return -1;
+	}
+
+	return vale_detach(ctx);
+}
+
+/* NETMAP_REQ_VALE_FTABLE to enable flow steering, then
+ * NETMAP_REQ_VALE_RING_STATS on the attached port. */
+static int
+vale_ring_stats(struct TestContext *ctx)
+{
+	struct nmreq_vale_ring_stats req;
+	struct nmreq_vale_ftable ftreq;
+	struct nmreq_header hdr;
+	char vpname[256];
+	int ret;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	snprintf(vpname, sizeof(vpname), "%s:", ctx->bdgname);
+	printf("Testing NETMAP_REQ_VALE_FTABLE (steering) on '%s'\n", vpname);
+	nmreq_hdr_init(&hdr, vpname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_FTABLE;
+	hdr.nr_body    = (uintptr_t)&ftreq;
+	memset(&ftreq, 0, sizeof(ftreq));
+	ftreq.nr_flags    = NR_VALE_FTABLE_SET_STEERING;
+	ftreq.nr_steering = NR_VALE_STEER_FLOW_HASH;
+	ret               = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_FTABLE)");
+		vale_detach(ctx);
+		return ret;
+	}
+	if (ftreq.nr_steering != NR_VALE_STEER_FLOW_HASH) {
+		vale_detach(ctx);
+		return -1;
+	}
+
+	snprintf(vpname, sizeof(vpname), "%s:%s", ctx->bdgname, ctx->ifname_ext);
+	printf("Testing NETMAP_REQ_VALE_RING_STATS on '%s'\n", vpname);
+	nmreq_hdr_init(&hdr, vpname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_RING_STATS;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_flags = NR_VALE_RING_STATS_RESET;
+	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_RING_STATS)");
+		vale_detach(ctx);
+		return ret;
+	}
+	printf("nr_rx_rings %u\n", req.nr_rx_rings);
+
+	if (req.nr_rx_rings == 0 ||
+	    req.nr_rx_rings > NM_VALE_RING_STATS_MAX) {
+		vale_detach(ctx);
+		return -1;
+	}
+
+	return vale_detach(ctx);
+}
+
+/* NETMAP_REQ_VALE_FTABLE to enable and disable GRO. */
+static int
+vale_gro(struct TestContext *ctx)
+{
+	struct nmreq_vale_ftable req;
+	struct nmreq_header hdr;
+	char vpname[256];
+	uint32_t gro;
+	int ret;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	snprintf(vpname, sizeof(vpname), "%s:", ctx->bdgname);
+	for (gro = 1; gro <= 2; gro++) {
+		printf("Testing NETMAP_REQ_VALE_FTABLE (nr_gro %u) on '%s'\n",
+			gro, vpname);
+		nmreq_hdr_init(&hdr, vpname);
+		hdr.nr_reqtype = NETMAP_REQ_VALE_FTABLE;
+		hdr.nr_body    = (uintptr_t)&req;
+		memset(&req, 0, sizeof(req));
+		req.nr_flags = NR_VALE_FTABLE_SET_GRO;
+		req.nr_gro   = gro;
+		ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
+		if (gro > 1) {
+			/* only 0 and 1 are valid */
+			if (ret == 0 || errno != EINVAL) {
+				vale_detach(ctx);
+				return -1;
+			}
+			break;
+		}
+		if (ret != 0) {
+			perror("ioctl(/dev/netmap, NIOCCTRL, VALE_FTABLE)");
+			vale_detach(ctx);
+			return ret;
+		}
+		if (req.nr_gro != 1 || req.nr_gro_merged != 0) {
+			vale_detach(ctx);
+			return -1;
+		}
+	}
+
+	return vale_detach(ctx);
+}
+
+/* NETMAP_REQ_VALE_RING_STATS on a registered hardware port. Only
+ * emulated adapters have the counters, native ones report EOPNOTSUPP. */
+static int
+hw_ring_stats(struct TestContext *ctx)
+{
+	struct nmreq_vale_ring_stats req;
+	struct nmreq_header hdr;
+	int fd, ret;
+
+	if ((ret = port_register_hwall(ctx)) != 0) {
+		return ret;
+	}
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("open(/dev/netmap)");
+		return -1;
+	}
+	printf("Testing NETMAP_REQ_VALE_RING_STATS on '%s'\n", ctx->ifname_ext);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_RING_STATS;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	ret = ioctl(fd, NIOCCTRL, &hdr);
+	close(fd);
+	if (ret != 0) {
+		if (errno == EOPNOTSUPP) {
+			printf("'%s' is not in emulated mode\n", ctx->ifname_ext);
+			return 0;
+		}
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_RING_STATS)");
+		return ret;
+	}
+	printf("nr_rx_rings %u\n", req.nr_rx_rings);
+
+	return (req.nr_rx_rings == 0 ||
+		req.nr_rx_rings > NM_VALE_RING_STATS_MAX) ? -1 : 0;
+}
+
 /* First NETMAP_REQ_PORT_HDR_SET and the NETMAP_REQ_PORT_HDR_GET
  * to check that we get the same value. */
 static int
@@ -745,6 +931,15 @@ pools_info_get(struct TestContext *ctx)
 		(unsigned long long)req.nr_buf_pool_offset);
 	printf("nr_buf_pool_objtotal %u\n", req.nr_buf_pool_objtotal);
 	printf("nr_buf_pool_objsize %u\n", req.nr_buf_pool_objsize);
+	if (req.nr_pools_flags & NR_POOLS_NUMA_NODE)
+		printf("nr_numa_node %u\n", req.nr_numa_node);
+	if (req.nr_pools_flags & NR_POOLS_BUF_HUGEPAGES)
+		printf("buffers in hugepages\n");
+	if (req.nr_pools_flags &
+			~(NR_POOLS_NUMA_NODE | NR_POOLS_BUF_HUGEPAGES)) {
+		printf("unexpected nr_pools_flags 0x%x\n", req.nr_pools_flags);
+		return -1;
+	}
 
 	return req.nr_memsize && req.nr_if_pool_objtotal &&
 	                       req.nr_if_pool_objsize &&
@@ -988,6 +1183,153 @@ infinite_options(struct TestContext *ctx)
 	return (errno == EMSGSIZE ? 0 : -1);
 }
 
+static void
+push_monitor_options(struct TestContext *ctx,
+		     struct nmreq_opt_monitor_filter *f, uint32_t ninsns,
+		     struct nmreq_opt_monitor_snaplen *s, uint32_t snaplen)
+{
+	memset(f, 0, sizeof(*f));
+	f->nro_opt.nro_reqtype = NETMAP_REQ_OPT_MONITOR_FILTER;
+	f->nro_opt.nro_size    = sizeof(*f) + ninsns * sizeof(f->nro_insns[0]);
+	f->nro_ninsns          = ninsns;
+	push_option(&f->nro_opt, ctx);
+
+	memset(s, 0, sizeof(*s));
+	s->nro_opt.nro_reqtype = NETMAP_REQ_OPT_MONITOR_SNAPLEN;
+	s->nro_snaplen         = snaplen;
+	push_option(&s->nro_opt, ctx);
+}
+
+/* Register a copy monitor on a pipe with a filter program and a
+ * snaplen. Invalid programs must be rejected. */
+static int
+monitor_filter(struct TestContext *ctx)
+{
+	struct {
+		struct nmreq_opt_monitor_filter f;
+		struct nm_bpf_insn insns[2];
+	} fopt;
+	struct nmreq_opt_monitor_snaplen sopt;
+	int pfd = ctx->fd;
+	int ret;
+
+	strncat(ctx->ifname_ext, "{monf", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if ((ret = port_register(ctx)) != 0)
+		return ret;
+
+	/* the monitor needs its own file descriptor */
+	ctx->fd = open("/dev/netmap", O_RDWR);
+	if (ctx->fd < 0) {
+		perror("open(/dev/netmap)");
+		ctx->fd = pfd;
+		return -1;
+	}
+	ctx->nr_flags = NR_MONITOR_RX;
+
+	printf("Testing invalid monitor filter on '%s'\n", ctx->ifname_ext);
+	push_monitor_options(ctx, &fopt.f, 2, &sopt, 128);
+	/* ldh [12]; add #1: does not end with a ret */
+	fopt.insns[0] = (struct nm_bpf_insn){ 0x28, 0, 0, 12 };
+	fopt.insns[1] = (struct nm_bpf_insn){ 0x04, 0, 0, 1 };
+	ret = port_register(ctx);
+	clear_options(ctx);
+	if (ret == 0 || fopt.f.nro_opt.nro_status != EINVAL) {
+		printf("invalid filter accepted (status %u)\n",
+		       fopt.f.nro_opt.nro_status);
+		ret = -1;
+		goto out;
+	}
+
+	printf("Testing valid monitor filter on '%s'\n", ctx->ifname_ext);
+	push_monitor_options(ctx, &fopt.f, 2, &sopt, 128);
+	/* ldh [12]; ret #96 */
+	fopt.insns[0] = (struct nm_bpf_insn){ 0x28, 0, 0, 12 };
+	fopt.insns[1] = (struct nm_bpf_insn){ 0x06, 0, 0, 96 };
+	ret = port_register(ctx);
+	clear_options(ctx);
+	if (ret == 0 && (fopt.f.nro_opt.nro_status != 0 ||
+			 sopt.nro_opt.nro_status != 0)) {
+		printf("filter status %u snaplen status %u\n",
+		       fopt.f.nro_opt.nro_status, sopt.nro_opt.nro_status);
+		ret = -1;
+	}
+out:
+	close(ctx->fd);
+	ctx->fd = pfd;
+	return ret;
+}
+
+/* Register a sampling copy monitor on a pipe and read its counters
+ * with NETMAP_REQ_MONITOR_STATS, which must fail on the pipe itself. */
+static int
+monitor_sampling(struct TestContext *ctx)
+{
+	struct nmreq_opt_monitor_sampling sopt;
+	struct nmreq_monitor_stats req;
+	struct nmreq_header hdr;
+	int pfd = ctx->fd;
+	int ret;
+
+	strncat(ctx->ifname_ext, "{mons", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if ((ret = port_register(ctx)) != 0)
+		return ret;
+
+	/* the monitor needs its own file descriptor */
+	ctx->fd = open("/dev/netmap", O_RDWR);
+	if (ctx->fd < 0) {
+		perror("open(/dev/netmap)");
+		ctx->fd = pfd;
+		return -1;
+	}
+	ctx->nr_flags = NR_MONITOR_RX | NR_MONITOR_TX;
+
+	printf("Testing sampling monitor on '%s'\n", ctx->ifname_ext);
+	memset(&sopt, 0, sizeof(sopt));
+	sopt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_MONITOR_SAMPLING;
+	sopt.nro_rate            = 100;
+	sopt.nro_pps             = 1000;
+	push_option(&sopt.nro_opt, ctx);
+	ret = port_register(ctx);
+	clear_options(ctx);
+	if (ret != 0 || sopt.nro_opt.nro_status != 0) {
+		printf("sampling status %u\n", sopt.nro_opt.nro_status);
+		ret = -1;
+		goto out;
+	}
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_MONITOR_STATS;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_flags = NR_MONITOR_STATS_RESET;
+	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, MONITOR_STATS)");
+		goto out;
+	}
+	printf("seen %" PRIu64 " sampled %" PRIu64 " drops %" PRIu64 "\n",
+	       req.nr_seen, req.nr_sampled, req.nr_drops);
+	if (req.nr_seen != 0 || req.nr_sampled != 0 || req.nr_drops != 0) {
+		ret = -1;
+		goto out;
+	}
+
+	/* not a monitor */
+	ret = ioctl(pfd, NIOCCTRL, &hdr);
+	if (ret == 0 || errno != EINVAL) {
+		printf("MONITOR_STATS accepted on a pipe\n");
+		ret = -1;
+		goto out;
+	}
+	ret = 0;
+out:
+	close(ctx->fd);
+	ctx->fd = pfd;
+	return ret;
+}
+
 #ifdef CONFIG_NETMAP_EXTMEM
 int
 change_param(const char *pname, unsigned long newv, unsigned long *poldv)
@@ -1375,6 +1717,11 @@ sync_kloop_eventfds(struct TestContext *ctx)
 	memset(&modeopt, 0, sizeof(modeopt));
 	modeopt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_SYNC_KLOOP_MODE;
 	modeopt.mode = ctx->sync_kloop_mode;
+	if (modeopt.mode & NM_OPT_SYNC_KLOOP_ADAPTIVE) {
+		modeopt.nro_opt.nro_size = sizeof(modeopt);
+		modeopt.spin_us          = 50;
+		modeopt.backoff_max_us   = 1000;
+	}
 	push_option(&modeopt.nro_opt, ctx);
 
 	num_entries = num_registered_rings(ctx);
@@ -1477,6 +1824,12 @@ sync_kloop_eventfds_all_direct_rx(struct TestContext *ctx)
 	    NM_OPT_SYNC_KLOOP_DIRECT_RX);
 }
 
+static int
+sync_kloop_eventfds_all_adaptive(struct TestContext *ctx)
+{
+	return sync_kloop_eventfds_all_mode(ctx, NM_OPT_SYNC_KLOOP_ADAPTIVE);
+}
+
 static int
 sync_kloop_nocsb(struct TestContext *ctx)
 {
@@ -1650,6 +2003,83 @@ sync_kloop_eventfds_mismatch(struct TestContext *ctx)
 	return (sync_kloop_eventfds(ctx) != 0) ? 0 : -1;
 }
 
+/* Start a kloop served by a kernel worker, and read its counters
+ * with NETMAP_REQ_SYNC_KLOOP_STATS while it runs. */
+static int
+sync_kloop_workers(struct TestContext *ctx)
+{
+	struct nmreq_opt_sync_kloop_workers wopt;
+	struct nmreq_sync_kloop_stats req;
+	struct nmreq_option wsave;
+	struct nmreq_header hdr;
+	void *thret = THRET_FAILURE;
+	pthread_t th;
+	int ret, i;
+
+	ret = csb_mode(ctx);
+	if (ret != 0) {
+		return ret;
+	}
+
+	memset(&wopt, 0, sizeof(wopt));
+	wopt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_SYNC_KLOOP_WORKERS;
+	wopt.nro_num_workers     = 1;
+	wopt.nro_first_cpu       = -1;
+	push_option(&wopt.nro_opt, ctx);
+	wsave = wopt.nro_opt;
+
+	ret = pthread_create(&th, NULL, sync_kloop_worker, ctx);
+	if (ret != 0) {
+		printf("pthread_create(kloop): %s\n", strerror(ret));
+		clear_options(ctx);
+		return -1;
+	}
+
+	printf("Testing NETMAP_REQ_SYNC_KLOOP_STATS on '%s'\n", ctx->ifname_ext);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_SYNC_KLOOP_STATS;
+	hdr.nr_body    = (uintptr_t)&req;
+	/* The kloop may not be running yet. */
+	for (i = 0; i < 100; i++) {
+		memset(&req, 0, sizeof(req));
+		ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+		if (ret == 0 || errno != ENOENT) {
+			break;
+		}
+		usleep(10000);
+	}
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, SYNC_KLOOP_STATS)");
+	} else {
+		printf("nr_num_workers %u txsyncs %" PRIu64 " rxsyncs %" PRIu64
+		       "\n", req.nr_num_workers,
+		       req.nr_workers[0].nr_txsyncs,
+		       req.nr_workers[0].nr_rxsyncs);
+		if (req.nr_num_workers != 1) {
+			ret = -1;
+		}
+	}
+
+	if (sync_kloop_stop(ctx) != 0) {
+		ret = -1;
+	}
+	if (pthread_join(th, &thret) != 0 || thret != THRET_SUCCESS) {
+		ret = -1;
+	}
+	clear_options(ctx);
+	if (ret != 0) {
+#ifdef __linux__
+		return ret;
+#else  /* !__linux__ */
+		/* Kernel workers are not available. */
+		return 0;
+#endif /* !__linux__ */
+	}
+	wsave.nro_status = 0;
+
+	return checkoption(&wopt.nro_opt, &wsave);
+}
+
 static int
 null_port(struct TestContext *ctx)
 {
@@ -1971,6 +2401,10 @@ static struct mytest tests[] = {
 	decltest(port_register_hostall_many),
 	decltest(vale_attach_detach),
 	decltest(vale_attach_detach_host_rings),
+	decltest(vale_ftable),
+	decltest(vale_ring_stats),
+	decltest(vale_gro),
+	decltest(hw_ring_stats),
 	decltest(vale_ephemeral_port_hdr_manipulation),
 	decltest(vale_persistent_port),
 	decltest(pools_info_get_and_register),
@@ -1979,6 +2413,8 @@ static struct mytest tests[] = {
 	decltest(pipe_slave),
 	decltest(pipe_port_info_get),
 	decltest(pipe_pools_info_get),
+	decltest(monitor_filter),
+	decltest(monitor_sampling),
 	decltest(vale_polling_enable_disable),
 	decltest(unsupported_option),
 	decltest(infinite_options),
@@ -1995,10 +2431,12 @@ static struct mytest tests[] = {
 	decltest(sync_kloop_eventfds_all_direct),
 	decltest(sync_kloop_eventfds_all_direct_tx),
 	decltest(sync_kloop_eventfds_all_direct_rx),
+	decltest(sync_kloop_eventfds_all_adaptive),
 	decltest(sync_kloop_nocsb),
 	decltest(sync_kloop_csb_enable),
 	decltest(sync_kloop_conflict),
 	decltest(sync_kloop_eventfds_mismatch),
+	decltest(sync_kloop_workers),
 	decltest(null_port),
 	decltest(null_port_all_zero),
 	decltest(null_port_sync),
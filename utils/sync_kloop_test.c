@@ -40,6 +40,20 @@ struct context {
 	int batch;
 	int num_entries;
 	struct eventfds *eventfds;
+	int adaptive;
+	uint32_t spin_us;
+	uint32_t backoff_max_us;
+};
+
+/* Latency histogram, in power of two microseconds. Bucket i counts
+ * the samples in [2^(i-1), 2^i) us, bucket 0 the ones below 1 us. */
+#define LAT_BUCKETS	24
+
+struct lat_sample {
+	int pending;
+	uint32_t hwcur;		/* hwcur when the sample was taken */
+	uint32_t head;		/* head published by the sample */
+	struct timeval ts;
 };
 
 static void *
@@ -47,6 +61,7 @@ kloop_worker(void *opaque)
 {
 	struct nmreq_opt_sync_kloop_eventfds *opt = NULL;
 	struct context *ctx                       = opaque;
+	struct nmreq_opt_sync_kloop_mode modeopt;
 	struct nmreq_sync_kloop_start req;
 	struct nmreq_header hdr;
 	int ret;
@@ -75,6 +90,16 @@ kloop_worker(void *opaque)
 	hdr.nr_reqtype = NETMAP_REQ_SYNC_KLOOP_START;
 	hdr.nr_body    = (uintptr_t)&req;
 	hdr.nr_options = (uintptr_t)opt;
+	if (ctx->adaptive) {
+		memset(&modeopt, 0, sizeof(modeopt));
+		modeopt.nro_opt.nro_next    = (uintptr_t)opt;
+		modeopt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_SYNC_KLOOP_MODE;
+		modeopt.nro_opt.nro_size    = sizeof(modeopt);
+		modeopt.mode                = NM_OPT_SYNC_KLOOP_ADAPTIVE;
+		modeopt.spin_us             = ctx->spin_us;
+		modeopt.backoff_max_us      = ctx->backoff_max_us;
+		hdr.nr_options              = (uintptr_t)&modeopt;
+	}
 	memset(&req, 0, sizeof(req));
 	req.sleep_us = (uint32_t)ctx->sleep_us;
 	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
@@ -98,6 +123,58 @@ ringspace(struct netmap_ring *ring, uint32_t head)
 	return space;
 }
 
+static inline uint32_t
+ringdist(struct netmap_ring *ring, uint32_t from, uint32_t to)
+{
+	return (to >= from) ? to - from : to + ring->num_slots - from;
+}
+
+static void
+lat_record(unsigned long long *hist, const struct timeval *from)
+{
+	struct timeval now, diff;
+	unsigned long us;
+	int b = 0;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, from, &diff);
+	us = diff.tv_sec * 1000000 + diff.tv_usec;
+	while (us && b < LAT_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	hist[b]++;
+}
+
+static void
+print_kloop_stats(struct context *ctx)
+{
+	struct nmreq_sync_kloop_stats req;
+	struct nmreq_header hdr;
+	unsigned int i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_SYNC_KLOOP_STATS;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr)) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, SYNC_KLOOP_STATS)");
+		return;
+	}
+	for (i = 0; i < req.nr_num_workers; i++) {
+		uint64_t busy = req.nr_workers[i].nr_busy_us;
+		uint64_t idle = req.nr_workers[i].nr_idle_us;
+
+		printf("kloop worker %u: busy %.1f%% (%llu us, idle %llu us), "
+		       "txsyncs %llu, rxsyncs %llu\n", i,
+		       busy + idle ? 100.0 * busy / (busy + idle) : 0.0,
+		       (unsigned long long)busy, (unsigned long long)idle,
+		       (unsigned long long)req.nr_workers[i].nr_txsyncs,
+		       (unsigned long long)req.nr_workers[i].nr_rxsyncs);
+	}
+}
+
 static void
 usage(const char *progname)
 {
@@ -109,6 +186,7 @@ usage(const char *progname)
 	       "[-b BATCH_SIZE (in packets)]\n"
 	       "[-u KLOOP_SLEEP_US (in microseconds)]\n"
 	       "[-k (use eventfd-based notifications)]\n"
+	       "[-a SPIN_US,BACKOFF_MAX_US (adaptive kloop)]\n"
 	       "-i NETMAP_PORT\n",
 	       progname);
 }
@@ -140,6 +218,8 @@ main(int argc, char **argv)
 	int packet_budget;
 	struct timeval loop_begin, loop_end;
 	int use_eventfds = 0;
+	struct lat_sample *lat = NULL;
+	unsigned long long lat_hist[LAT_BUCKETS];
 
 	int init_tx_payload = 1;
 	function_t func;
@@ -166,7 +246,7 @@ main(int argc, char **argv)
 	ctx.batch    = 1;
 	ctx.sleep_us = 100;
 
-	while ((opt = getopt(argc, argv, "hi:f:vR:b:u:k")) != -1) {
+	while ((opt = getopt(argc, argv, "hi:f:vR:b:u:ka:")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage(argv[0]);
@@ -218,6 +298,16 @@ main(int argc, char **argv)
 			use_eventfds = 1;
 			break;
 
+		case 'a':
+			if (sscanf(optarg, "%u,%u", &ctx.spin_us,
+			           &ctx.backoff_max_us) != 2) {
+				printf("    Invalid adaptive parameters %s\n",
+				       optarg);
+				return -1;
+			}
+			ctx.adaptive = 1;
+			break;
+
 		default:
 			printf("    Unrecognized option %c\n", opt);
 			usage(argv[0]);
@@ -380,6 +470,13 @@ main(int argc, char **argv)
 		last_ring  = num_rx_entries-1;
 	}
 
+	/* On TX, measure how long the kloop takes to consume what
+	 * we publish, one sample per ring at a time. */
+	memset(lat_hist, 0, sizeof(lat_hist));
+	if (func == F_TX) {
+		lat = calloc(last_ring + 1, sizeof(*lat));
+	}
+
 	gettimeofday(&next_time, NULL);
 	loop_begin    = next_time;
 	packet_budget = 0;
@@ -443,6 +540,12 @@ main(int argc, char **argv)
 			nm_sync_kloop_appl_read(ktoa,
 			                        /*hwtail=*/&ring->tail,
 			                        /*hwcur=*/&ring->cur);
+			if (lat && lat[r].pending &&
+			    ringdist(ring, lat[r].hwcur, ring->cur) >=
+			            ringdist(ring, lat[r].hwcur, lat[r].head)) {
+				lat_record(lat_hist, &lat[r].ts);
+				lat[r].pending = 0;
+			}
 			batch = ringspace(ring, head);
 			if (batch > packet_budget) { /* rate limiting */
 				batch = packet_budget;
@@ -500,6 +603,12 @@ main(int argc, char **argv)
 			}
 			/* Write updated information for the kernel. */
 			nm_sync_kloop_appl_write(atok, head, head);
+			if (lat && !lat[r].pending) {
+				lat[r].pending = 1;
+				lat[r].hwcur   = ring->cur;
+				lat[r].head    = head;
+				gettimeofday(&lat[r].ts, NULL);
+			}
 			/* Notify the kernel if needed. */
 			if (evfds && ACCESS_ONCE(ktoa->kern_need_kick)) {
 				uint64_t x = 1;
@@ -532,6 +641,20 @@ main(int argc, char **argv)
 		printf("Measured rate: %.6f Mpps\n", measured_rate);
 	}
 
+	if (lat) {
+		int b;
+
+		printf("TX kloop latency:\n");
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			if (lat_hist[b]) {
+				printf("  < %8lu us: %llu\n", 1UL << b,
+				       lat_hist[b]);
+			}
+		}
+		free(lat);
+	}
+	print_kloop_stats(&ctx);
+
 	/* Stop the kernel worker thread. */
 	{
 		struct nmreq_header hdr;